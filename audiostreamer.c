@@ -1,26 +1,373 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "audiostreamer.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <libavdevice/avdevice.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define AS_HAVE_AVX2 1
+#endif
+
+// The pipeline's decode thread hands converted samples to each output's encode
+// thread in blocks. Each block holds up to AS_CONVERTED_SAMPLES_MIN samples per
+// channel.
+struct SampleBlock {
+	uint8_t * * samples;
+	int nb_samples;
+
+	// When we read them from the input (CLOCK_MONOTONIC, nanoseconds).
+	int64_t capture_time;
+};
+
+// A single producer, single consumer ring of sample blocks. The decode thread
+// is the producer and an output's encode thread is the consumer.
+struct BlockRing {
+	struct SampleBlock * blocks;
+	size_t nb_blocks;
+
+	// Number of blocks ever written and read. The producer only changes head
+	// and the consumer only changes tail. Block i is at i%nb_blocks.
+	atomic_size_t head;
+	atomic_size_t tail;
+
+	// When the ring is empty the consumer blocks reading data_fd, and when it's
+	// full the producer blocks reading space_fd (both eventfds). Each side sets
+	// its parked flag before its last look at the other's index, and the other
+	// side writes the fd only if it sees the flag after moving its index. That
+	// way neither side makes a syscall while the other is busy, and neither can
+	// miss a wakeup.
+	int data_fd;
+	int space_fd;
+	atomic_bool consumer_parked;
+	atomic_bool producer_parked;
+
+	// Back-pressure accounting. See struct PipelineStats.
+	atomic_uint_fast64_t nb_pushed;
+	atomic_uint_fast64_t stalls;
+	atomic_uint_fast64_t drops;
+	atomic_size_t high_water;
+};
+
+struct PipelineEncoder {
+	struct Pipeline * pipeline;
+	size_t index;
+	pthread_t thread;
+	bool started;
+};
+
+struct Pipeline {
+	struct Audiostreamer * as;
+
+	// If a ring is full, whether the decode thread drops the block (true) or
+	// waits for room (false).
+	bool drop_when_full;
+
+	pthread_t decode_thread;
+	bool decode_started;
+
+	// One ring and encode thread per output.
+	struct BlockRing * rings;
+	struct PipelineEncoder * encoders;
+
+	// Set to tell the threads to stop.
+	atomic_bool stop;
+
+	// Set by the decode thread once it pushed every block it will push.
+	atomic_bool input_done;
+
+	// Set if any thread failed.
+	atomic_bool failed;
+
+	// Number of threads still running.
+	atomic_int running;
+};
+
+// A path the fan-out server serves, and the ring it serves it from.
+struct FanoutRoute {
+	char * path;
+	struct FrameRing * ring;
+
+	// What we send each client before the stream header.
+	char * response;
+	size_t response_size;
+
+	// See struct FanoutStats.
+	atomic_uint_fast64_t clients;
+	atomic_uint_fast64_t accepted;
+	atomic_uint_fast64_t too_slow;
+	atomic_uint_fast64_t bytes_out;
+	atomic_uint_fast64_t writes;
+};
+
+// A connection to the fan-out server. This and its slot in its loop's list are
+// all the memory a client costs us once it's getting frames.
+struct FanoutClient {
+	int fd;
+
+	// Index in its loop's clients.
+	size_t index;
+
+	// NULL until we've read the request.
+	struct FanoutRoute * route;
+
+	// The request as we read it. Then the response and the stream header, which
+	// we send before any frames. We free it once we've sent it.
+	uint8_t * buf;
+	size_t buf_size;
+	size_t buf_offset;
+
+	// Whether we added the stream header to buf. We wait until there's a frame
+	// to send, since if the encoder was not running it may not have written
+	// the header yet.
+	bool header_added;
+
+	// The frame we send next, and how much of it we sent already.
+	uint64_t seq;
+	size_t frame_offset;
+
+	// When we accepted it (CLOCK_MONOTONIC, nanoseconds).
+	int64_t accepted;
+
+	// Whether the socket can't take more until epoll says it can.
+	bool blocked;
+};
+
+// A thread of the fan-out server. It accepts clients on its own listening
+// socket and sends frames to those clients.
+struct FanoutLoop {
+	struct Fanout * fanout;
+
+	pthread_t thread;
+	bool started;
+
+	int listen_fd;
+	int epoll_fd;
+
+	// Rings write to this when they get a frame. So do we, to stop.
+	int event_fd;
+
+	struct FanoutClient * * clients;
+	size_t nb_clients;
+	size_t clients_capacity;
+};
+
+struct Fanout {
+	struct FanoutRoute * routes;
+	size_t nb_routes;
+
+	struct FanoutLoop * loops;
+	size_t nb_loops;
+
+	// How much recent audio to send new clients right away.
+	int burst_ms;
+
+	// Set to tell the threads to stop.
+	atomic_bool stop;
+};
 
 static int
-__decode_and_store_frame(const struct Audiostreamer * const);
+__read_write(struct Audiostreamer * const, struct FrameInfo * const);
 static int
-__decode_and_store_samples(const struct Input * const,
-		const struct Output * const, AVAudioFifo * const);
-static const uint8_t * *
-__copy_samples(uint8_t * * const, const int);
+__decode_and_store_frame(struct Audiostreamer * const);
 static int
-__encode_and_write_frame(struct Audiostreamer * const);
+__decode_and_store_samples(struct Audiostreamer * const);
+static bool
+__convert_samples(struct Audiostreamer * const, struct Output * const);
+static void
+__choose_converter(struct Output * const, const enum AVSampleFormat,
+		const int);
+static void
+__convert_s16_to_s16(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+static void
+__convert_s16_to_s16p(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+static void
+__convert_s16_to_s32p(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+static void
+__convert_s16_to_fltp(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+static void
+__convert_flt_to_flt(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+static void
+__convert_flt_to_fltp(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+#if defined(__SSE2__)
+static void
+__convert_s16_to_s16p_sse2(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+static void
+__convert_s16_to_s32p_sse2(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+static void
+__convert_s16_to_fltp_sse2(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+static void
+__convert_flt_to_fltp_sse2(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+#endif
+#if defined(AS_HAVE_AVX2)
+static void
+__convert_s16_to_s32p_avx2(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+static void
+__convert_s16_to_fltp_avx2(const uint8_t * const, uint8_t * const * const,
+		const int, const int);
+#endif
+static bool
+__store_samples(struct Audiostreamer * const, const size_t,
+		const struct Output * const);
+static bool
+__grow_fifo(struct Audiostreamer * const, struct Output * const, const int);
+static void
+__count_allocation(struct Audiostreamer * const);
+static void
+__count_frame_written(struct Audiostreamer * const, struct Output * const,
+		const int);
+static void
+__count_error(struct Audiostreamer * const);
+static void
+__stage_add(struct StageStats * const, const int64_t, const uint64_t);
+static void
+__stage_load(const struct StageStats * const, struct StageStats * const);
+static void
+__fifo_high_water(struct Output * const);
+static int
+__write_frame(struct Audiostreamer * const, struct Output * const);
 static int
-__read_and_write_packet(struct Audiostreamer * const);
+__encode_and_write_frame(struct Audiostreamer * const,
+		struct Output * const);
+static int
+__read_and_write_packet(struct Audiostreamer * const, struct Output * const);
 static char *
 __get_error_string(const int);
 static bool
 __drain_codecs(struct Audiostreamer * const);
+static bool
+__drain_decoder(struct Audiostreamer * const);
+static bool
+__drain_encoder(struct Audiostreamer * const, struct Output * const);
+static int
+__write_pending(void * const, uint8_t * const, const int);
+static int
+__commit_pending(struct Audiostreamer * const, struct Output * const,
+		const int64_t);
+static void
+__cache_frame(struct Audiostreamer * const, struct Output * const);
+static void
+__free_cache(struct FrameCache * const);
+static int
+__replay_frame(struct Audiostreamer * const, struct FrameInfo * const);
+static bool
+__restart_input(struct Audiostreamer * const);
+static bool
+__pace(struct Output * const);
+static int64_t
+__monotonic_ns(void);
+static void
+__mark_capture(struct Output * const, const int64_t);
+static bool
+__encode_silent_frame(struct Output * const);
+static void
+__track_loudness(struct Output * const, uint8_t * const * const, const int);
+static int
+__last_loud_sample(const struct Output * const, uint8_t * const * const,
+		const int);
+static bool
+__sample_loud(const struct Output * const, const enum AVSampleFormat,
+		const uint8_t * const, const int);
+static bool
+__gate_silence(struct Output * const);
+static int
+__write_silent_frame(struct Output * const);
+static int64_t
+__capture_time(const struct Output * const, const int64_t);
+static void
+__frame_ring_write(struct FrameRing * const, const uint8_t * const,
+		const size_t, const int64_t, const int64_t);
+static bool
+__pipeline_push(struct Pipeline * const, const size_t,
+		const struct Output * const);
+static void *
+__pipeline_decode(void * const);
+static void *
+__pipeline_encode(void * const);
+static int
+__pipeline_encode_block(struct Audiostreamer * const, struct Output * const,
+		const struct SampleBlock * const);
+static void
+__pipeline_free(struct Pipeline * const);
+static void
+__block_ring_wait(const int);
+static void
+__block_ring_wake(const int);
+static void
+__pipeline_wake_all(struct Pipeline * const);
+static bool
+__stream_params_known(const AVStream * const);
+static int
+__read_write_n(struct Audiostreamer * const, struct FrameInfo * const,
+		const int, const int, int * const);
+static int64_t
+__thread_cpu_ns(void);
+static void
+__add_cpu(struct Audiostreamer * const, const int64_t);
+static void
+__worker_acquire(struct Audiostreamer * const);
+static void
+__worker_release(void);
+static bool
+__frame_ring_notify(struct FrameRing * const, const int, const bool);
+static void *
+__fanout_loop(void * const);
+static void
+__fanout_accept(struct FanoutLoop * const);
+static bool
+__fanout_read(struct FanoutLoop * const, struct FanoutClient * const);
+static bool
+__fanout_route(struct FanoutLoop * const, struct FanoutClient * const);
+static bool
+__fanout_query_ok(const char * const, const size_t);
+static void
+__fanout_reject(struct FanoutLoop * const, struct FanoutClient * const,
+		const char * const);
+static bool
+__fanout_add_header(struct FanoutClient * const);
+static bool
+__fanout_too_slow(struct FanoutLoop * const, struct FanoutClient * const,
+		const uint64_t);
+static bool
+__fanout_send(struct FanoutLoop * const, struct FanoutClient * const);
+static void
+__fanout_send_all(struct FanoutLoop * const);
+static void
+__fanout_drop(struct FanoutLoop * const, struct FanoutClient * const);
+
+// We let at most __workers_max threads encode at once, across every
+// Audiostreamer in the process. 0 means no limit. See as_set_max_workers().
+static pthread_mutex_t __workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t __workers_cond = PTHREAD_COND_INITIALIZER;
+static int __workers_max;
+static int __workers_busy;
 
 void
 as_setup(void)
@@ -35,9 +382,20 @@ as_setup(void)
 }
 
 // Open input and set up decoder.
+//
+// input_options: Options for the input format separated by ':', such as
+// "sample_rate=48000:channels=2:fragment_size=4096" for pulse, or
+// "probesize=32:analyzeduration=0". May be NULL.
+//
+// Normally we read some of the input to find out what's in it
+// (avformat_find_stream_info()). With a live input such as pulse that means
+// waiting for audio. If you give sample_rate and channels, we trust the format
+// already knows its stream and skip that. We record how long opening took in
+// the Input's open_ns.
 struct Input *
 as_open_input(const char * const input_format_name,
-		const char * const input_url, const bool verbose)
+		const char * const input_url, const char * const input_options,
+		const bool verbose)
 {
 	if (!input_format_name || strlen(input_format_name) == 0 ||
 			!input_url || strlen(input_url) == 0) {
@@ -45,6 +403,8 @@ as_open_input(const char * const input_format_name,
 		return NULL;
 	}
 
+	const int64_t start = __monotonic_ns();
+
 	struct Input * const input = calloc(1, sizeof(struct Input));
 	if (!input) {
 		printf("%s\n", strerror(errno));
@@ -59,16 +419,53 @@ as_open_input(const char * const input_format_name,
 		return NULL;
 	}
 
+	AVDictionary * opts = NULL;
+	if (input_options && strlen(input_options) > 0) {
+		if (av_dict_parse_string(&opts, input_options, "=", ":", 0) < 0) {
+			printf("invalid input options: %s\n", input_options);
+			av_dict_free(&opts);
+			as_destroy_input(input);
+			return NULL;
+		}
+	}
+
+	const bool have_params = av_dict_get(opts, "sample_rate", NULL, 0) &&
+		av_dict_get(opts, "channels", NULL, 0);
+
 	// Open the input stream.
 	if (avformat_open_input(&input->format_ctx, input_url, input_format,
-				NULL) != 0) {
+				&opts) != 0) {
 		printf("open input failed\n");
+		av_dict_free(&opts);
+		as_destroy_input(input);
+		return NULL;
+	}
+
+	// The format takes out the options it recognizes.
+	if (av_dict_count(opts) > 0) {
+		const AVDictionaryEntry * const entry = av_dict_get(opts, "", NULL,
+				AV_DICT_IGNORE_SUFFIX);
+		printf("unknown input option: %s\n", entry->key);
+		av_dict_free(&opts);
 		as_destroy_input(input);
 		return NULL;
 	}
+	av_dict_free(&opts);
+
+	// Read packets to get stream info, unless we were told what to expect and
+	// the format agrees. Some formats don't know much until they've read some
+	// packets. If so we probe anyway.
+	bool probe = true;
+	if (have_params) {
+		if (input->format_ctx->nb_streams == 1 &&
+				__stream_params_known(input->format_ctx->streams[0])) {
+			probe = false;
+		} else {
+			printf("input parameters given but stream is not known, probing\n");
+		}
+	}
 
-	// Read packets to get stream info.
-	if (avformat_find_stream_info(input->format_ctx, NULL) < 0) {
+	if (probe && avformat_find_stream_info(input->format_ctx, NULL) < 0) {
 		printf("failed to find stream info\n");
 		as_destroy_input(input);
 		return NULL;
@@ -79,9 +476,20 @@ as_open_input(const char * const input_format_name,
 		av_dump_format(input->format_ctx, 0, input_url, 0);
 	}
 
+	// Find the audio stream. We ignore packets from any others.
+	input->stream_index = av_find_best_stream(input->format_ctx,
+			AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+	if (input->stream_index < 0) {
+		printf("no audio stream found\n");
+		as_destroy_input(input);
+		return NULL;
+	}
+
+	AVStream * const stream = input->format_ctx->streams[input->stream_index];
+
 	// Find codec for the input stream.
 	AVCodec * const input_codec = avcodec_find_decoder(
-			input->format_ctx->streams[0]->codecpar->codec_id);
+			stream->codecpar->codec_id);
 	if (!input_codec) {
 		printf("codec not found\n");
 		as_destroy_input(input);
@@ -99,7 +507,7 @@ as_open_input(const char * const input_format_name,
 	// Set decoder attributes (channels, sample rate, etc). I think we could set
 	// these manually, but I copy from the input stream.
 	if (avcodec_parameters_to_context(input->codec_ctx,
-				input->format_ctx->streams[0]->codecpar) < 0) {
+				stream->codecpar) < 0) {
 		printf("unable to initialize input codec parameters\n");
 		as_destroy_input(input);
 		return NULL;
@@ -113,9 +521,27 @@ as_open_input(const char * const input_format_name,
 		return NULL;
 	}
 
+	input->open_ns = __monotonic_ns() - start;
+
+	if (verbose) {
+		printf("opened input in %.3f ms (%s)\n", (double) input->open_ns/1e6,
+				probe ? "probed" : "not probed");
+	}
+
 	return input;
 }
 
+// Tell whether we know enough about a stream to decode it without probing.
+static bool
+__stream_params_known(const AVStream * const stream)
+{
+	const AVCodecParameters * const par = stream->codecpar;
+	return par->codec_type == AVMEDIA_TYPE_AUDIO &&
+		par->codec_id != AV_CODEC_ID_NONE &&
+		par->sample_rate > 0 &&
+		par->channels > 0;
+}
+
 void
 as_destroy_input(struct Input * const input)
 {
@@ -139,14 +565,26 @@ as_destroy_input(struct Input * const input)
 //
 // output_url: For stdout use 'pipe:1'. For output to a file use 'file:out.mp3'
 // (to name the file out.mp3).
+//
+// bit_rate: Bits per second to encode at.
+//
+// encoder_options: Options for the encoder separated by ':', such as
+// "frame_duration=20" for libopus. May be NULL.
+//
+// ring: If this is set, we ignore output_url and instead place each encoded
+// frame into the ring. The stream header goes into the ring's header. If the
+// muxer supports flushing (e.g. Ogg and WebM), we flush it after every packet,
+// so each frame in the ring is whole pages (or clusters) and a reader can start
+// from any of them.
 struct Output *
 as_open_output(const struct Input * const input,
 		const char * const output_format, const char * const output_url,
-		const char * const output_encoder)
+		const char * const output_encoder, const char * const encoder_options,
+		const int bit_rate, struct FrameRing * const ring)
 {
 	if (!output_format || strlen(output_format) == 0 ||
-			!output_url || strlen(output_url) == 0 ||
-			!output_encoder || strlen(output_encoder) == 0) {
+			(!ring && (!output_url || strlen(output_url) == 0)) ||
+			!output_encoder || strlen(output_encoder) == 0 || bit_rate <= 0) {
 		printf("%s\n", strerror(EINVAL));
 		return NULL;
 	}
@@ -170,10 +608,41 @@ as_open_output(const struct Input * const input,
 
 
 	// Open IO context - open output file.
-	if (avio_open(&output->format_ctx->pb, output_url, AVIO_FLAG_WRITE) < 0) {
-		printf("unable to open output\n");
-		as_destroy_output(output);
-		return NULL;
+	//
+	// If we're writing to a ring then we set up our own IO context instead. The
+	// muxer writes through it into our pending buffer. After each packet we
+	// flush it and commit what the muxer wrote as a frame in the ring.
+	if (ring) {
+		output->ring = ring;
+
+		output->pending = calloc(1, ring->frame_capacity);
+		if (!output->pending) {
+			printf("%s\n", strerror(errno));
+			as_destroy_output(output);
+			return NULL;
+		}
+
+		unsigned char * const avio_buf = av_malloc(AS_AVIO_BUFFER_SIZE);
+		if (!avio_buf) {
+			printf("unable to allocate IO buffer\n");
+			as_destroy_output(output);
+			return NULL;
+		}
+
+		output->format_ctx->pb = avio_alloc_context(avio_buf,
+				AS_AVIO_BUFFER_SIZE, 1, output, NULL, __write_pending, NULL);
+		if (!output->format_ctx->pb) {
+			printf("unable to allocate IO context\n");
+			av_free(avio_buf);
+			as_destroy_output(output);
+			return NULL;
+		}
+	} else {
+		if (avio_open(&output->format_ctx->pb, output_url, AVIO_FLAG_WRITE) < 0) {
+			printf("unable to open output\n");
+			as_destroy_output(output);
+			return NULL;
+		}
 	}
 
 
@@ -198,12 +667,31 @@ as_open_output(const struct Input * const input,
 		return NULL;
 	}
 
+	// Some encoders support only certain sample rates. For example, Opus wants
+	// 48 kHz. If the encoder doesn't support the input's rate, use the first it
+	// supports. The resampler converts to it.
+	int sample_rate = input->codec_ctx->sample_rate;
+	if (output_codec->supported_samplerates) {
+		bool supported = false;
+		for (const int * rate = output_codec->supported_samplerates; *rate != 0;
+				rate++) {
+			if (*rate == sample_rate) {
+				supported = true;
+				break;
+			}
+		}
+
+		if (!supported) {
+			sample_rate = output_codec->supported_samplerates[0];
+		}
+	}
+
 	// Unit of time (in seconds) in which frame timestamps are represented.
 
 	// Numerator
 	stream->time_base.num = 1;
 	// Denominator
-	stream->time_base.den = input->codec_ctx->sample_rate;
+	stream->time_base.den = sample_rate;
 
 
 	// Set up output encoder
@@ -217,10 +705,9 @@ as_open_output(const struct Input * const input,
 
 	output->codec_ctx->channels       = input->codec_ctx->channels;
 	output->codec_ctx->channel_layout = AV_CH_LAYOUT_STEREO;
-	output->codec_ctx->sample_rate    = input->codec_ctx->sample_rate;
+	output->codec_ctx->sample_rate    = sample_rate;
 	output->codec_ctx->sample_fmt     = output_codec->sample_fmts[0];
-	// 96 Kb/s
-	output->codec_ctx->bit_rate       = 96000;
+	output->codec_ctx->bit_rate       = bit_rate;
 
 	// Turn off using bit reservoir if we're using MP3. This allows any frame to
 	// be valid on its own in exchange for a potential reduction in quality. See
@@ -238,12 +725,40 @@ as_open_output(const struct Input * const input,
 		}
 	}
 
+	// Containers such as Ogg want codec headers (e.g. OpusHead) up front rather
+	// than in the stream.
+	if (output->format_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+		output->codec_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	}
+
+	AVDictionary * opts = NULL;
+	if (encoder_options && strlen(encoder_options) > 0) {
+		if (av_dict_parse_string(&opts, encoder_options, "=", ":", 0) < 0) {
+			printf("invalid encoder options: %s\n", encoder_options);
+			av_dict_free(&opts);
+			as_destroy_output(output);
+			return NULL;
+		}
+	}
+
 	// Initialize the codec context to use the codec.
-	if (avcodec_open2(output->codec_ctx, output_codec, NULL) != 0) {
+	if (avcodec_open2(output->codec_ctx, output_codec, &opts) != 0) {
 		printf("unable to initialize output codec context to use codec\n");
+		av_dict_free(&opts);
+		as_destroy_output(output);
+		return NULL;
+	}
+
+	// The encoder takes out the options it recognizes.
+	if (av_dict_count(opts) > 0) {
+		const AVDictionaryEntry * const entry = av_dict_get(opts, "", NULL,
+				AV_DICT_IGNORE_SUFFIX);
+		printf("unknown encoder option: %s\n", entry->key);
+		av_dict_free(&opts);
 		as_destroy_output(output);
 		return NULL;
 	}
+	av_dict_free(&opts);
 
 	// Set AVStream.codecpar (stream codec parameters).
 	if (avcodec_parameters_from_context(stream->codecpar,
@@ -260,6 +775,35 @@ as_open_output(const struct Input * const input,
 		return NULL;
 	}
 
+	// Keep the header in the ring so readers joining at any point can send it.
+	if (ring) {
+		output->flush_packets = output->format_ctx->oformat->flags &
+			AVFMT_ALLOW_FLUSH;
+
+		// Make the muxer write out any header pages it's holding on to.
+		if (output->flush_packets && av_write_frame(output->format_ctx, NULL) < 0) {
+			printf("unable to flush header\n");
+			as_destroy_output(output);
+			return NULL;
+		}
+
+		avio_flush(output->format_ctx->pb);
+
+		if (output->pending_overflow) {
+			printf("header is too large\n");
+			as_destroy_output(output);
+			return NULL;
+		}
+
+		pthread_mutex_lock(&ring->mutex);
+		memcpy(ring->header, output->pending, output->pending_size);
+		ring->header_size = output->pending_size;
+		ring->header_generation++;
+		pthread_mutex_unlock(&ring->mutex);
+
+		output->pending_size = 0;
+	}
+
 
 	// Set up resampler. To be able to convert audio sample formats, we need a
 	// resampler. See transcode_aac.c
@@ -286,6 +830,94 @@ as_open_output(const struct Input * const input,
 		return NULL;
 	}
 
+	// We still set up the resampler even if we can convert ourselves. We use it
+	// if the decoder ever gives us a format we don't expect.
+	if (output->codec_ctx->sample_rate == input->codec_ctx->sample_rate &&
+			output->codec_ctx->channels == input->codec_ctx->channels) {
+		__choose_converter(output, input->codec_ctx->sample_fmt,
+				output->codec_ctx->channels);
+	}
+
+
+	// The number of samples read in a frame from the input can be larger or
+	// smaller than what the encoder wants. We need to give it the exact number
+	// it wants. This means we can't reliably feed a single frame at a time from
+	// the input into the output.
+	//
+	// To make it possible to always feed the expected number of samples to the
+	// encoder, we use a AvAudioFifo for buffering samples. We read and decode
+	// samples from the input, and add them to the FIFO queue. When we have
+	// enough, we extract, encode, and write them to the output.
+	//
+	// Note AudioFrameQueue looks like something similar to AvAudioFifo, but is
+	// apparently not available in my version of ffmpeg. Also, it appears to not
+	// hold raw data either, so I'm not sure it is applicable.
+
+	// Size the FIFO so that it can hold several encoder frames. Typically we
+	// never need to grow it after this.
+	output->af = av_audio_fifo_alloc(output->codec_ctx->sample_fmt,
+			output->codec_ctx->channels,
+			output->codec_ctx->frame_size*AS_FIFO_FRAMES);
+	if (!output->af) {
+		printf("unable to allocate audio fifo\n");
+		as_destroy_output(output);
+		return NULL;
+	}
+
+	// Set up the frame and packet we reuse for every write.
+
+	output->pkt = av_packet_alloc();
+	output->frame = av_frame_alloc();
+	if (!output->pkt || !output->frame) {
+		printf("unable to allocate packet and frame\n");
+		as_destroy_output(output);
+		return NULL;
+	}
+
+	output->frame->nb_samples     = output->codec_ctx->frame_size;
+	output->frame->channel_layout = output->codec_ctx->channel_layout;
+	output->frame->format         = output->codec_ctx->sample_fmt;
+	output->frame->sample_rate    = output->codec_ctx->sample_rate;
+
+	if (av_frame_get_buffer(output->frame, 0) < 0) {
+		printf("unable to allocate output frame buffer\n");
+		as_destroy_output(output);
+		return NULL;
+	}
+
+	output->converted_samples = calloc((size_t) output->codec_ctx->channels,
+			sizeof(uint8_t *));
+	if (!output->converted_samples) {
+		printf("%s\n", strerror(errno));
+		as_destroy_output(output);
+		return NULL;
+	}
+
+	// We don't know how many samples the input gives us per frame until we see
+	// one. Start with a size that covers common inputs. We grow it if needed.
+	if (av_samples_alloc(output->converted_samples, NULL,
+				output->codec_ctx->channels, AS_CONVERTED_SAMPLES_MIN,
+				output->codec_ctx->sample_fmt, 0) < 0) {
+		printf("av_samples_alloc\n");
+		as_destroy_output(output);
+		return NULL;
+	}
+	output->converted_samples_capacity = AS_CONVERTED_SAMPLES_MIN;
+
+	output->samples_from = output;
+
+	// Presentation timestamp (PTS). This needs to increase for each sample we
+	// output.
+	output->pts = 1;
+
+	output->active = true;
+
+	// We can only loop from cached frames if each is valid on its own and
+	// carries no timestamps or sequence numbers. MP3 without the bit reservoir
+	// is. Ogg pages for example have sequence numbers and granule positions
+	// that would go backwards.
+	output->cacheable = strcmp(output_format, "mp3") == 0;
+
 	return output;
 }
 
@@ -302,8 +934,17 @@ as_destroy_output(struct Output * const output)
 			printf("unable to write trailer\n");
 		}
 
-		if (avio_closep(&output->format_ctx->pb) != 0) {
-			printf("avio_closep failed\n");
+		// With a ring the trailer ends up in pending. We discard it as readers
+		// are only interested in frames.
+		if (output->ring) {
+			if (output->format_ctx->pb) {
+				av_freep(&output->format_ctx->pb->buffer);
+				av_freep(&output->format_ctx->pb);
+			}
+		} else {
+			if (avio_closep(&output->format_ctx->pb) != 0) {
+				printf("avio_closep failed\n");
+			}
 		}
 
 		avformat_free_context(output->format_ctx);
@@ -317,59 +958,136 @@ as_destroy_output(struct Output * const output)
 		swr_free(&output->resample_ctx);
 	}
 
+	if (output->pending) {
+		free(output->pending);
+	}
+
+	if (output->af) {
+		av_audio_fifo_free(output->af);
+	}
+
+	av_packet_free(&output->pkt);
+	av_frame_free(&output->frame);
+
+	if (output->converted_samples) {
+		av_freep(&output->converted_samples[0]);
+		free(output->converted_samples);
+	}
+
+	__free_cache(&output->cache);
+
+	if (output->silent_frame) {
+		free(output->silent_frame);
+	}
+
 	free(output);
 }
 
-// Create an initialize a new Audiostreamer struct.
+// Create an initialize a new Audiostreamer struct. It takes ownership of the
+// input and outputs.
 struct Audiostreamer *
-as_init_audiostreamer(struct Input * const input, struct Output * const output)
+as_init_audiostreamer(struct Input * const input,
+		struct Output * * const outputs, const size_t nb_outputs)
 {
+	if (!input || !outputs || nb_outputs == 0) {
+		printf("%s\n", strerror(EINVAL));
+		return NULL;
+	}
+
 	struct Audiostreamer * const as = calloc(1, sizeof(struct Audiostreamer));
 	if (!as) {
 		printf("%s\n", strerror(errno));
 		return NULL;
 	}
 
-	// The number of samples read in a frame from the input can be larger or
-	// smaller than what the encoder wants. We need to give it the exact number
-	// it wants. This means we can't reliably feed a single frame at a time from
-	// the input into the output.
-	//
-	// To make it possible to always feed the expected number of samples to the
-	// encoder, we use a AvAudioFifo for buffering samples. We read and decode
-	// samples from the input, and add them to the FIFO queue. When we have
-	// enough, we extract, encode, and write them to the output.
-	//
-	// Note AudioFrameQueue looks like something similar to AvAudioFifo, but is
-	// apparently not available in my version of ffmpeg. Also, it appears to not
-	// hold raw data either, so I'm not sure it is applicable.
+	as->outputs = calloc(nb_outputs, sizeof(struct Output *));
+	if (!as->outputs) {
+		printf("%s\n", strerror(errno));
+		free(as);
+		return NULL;
+	}
 
-	// We must have an initial allocation size of at least 1.
-	as->af = av_audio_fifo_alloc(output->codec_ctx->sample_fmt,
-			output->codec_ctx->channels, 1);
-	if (!as->af) {
-		printf("unable to allocate audio fifo\n");
+	// Outputs that want samples in the same format share one conversion.
+	for (size_t i = 0; i < nb_outputs; i++) {
+		struct Output * const output = outputs[i];
+
+		for (size_t j = 0; j < i; j++) {
+			const struct Output * const other = outputs[j];
+
+			if (other->codec_ctx->sample_fmt == output->codec_ctx->sample_fmt &&
+					other->codec_ctx->sample_rate == output->codec_ctx->sample_rate &&
+					other->codec_ctx->channels == output->codec_ctx->channels) {
+				output->samples_from = other->samples_from;
+				break;
+			}
+		}
+
+		as->outputs[i] = output;
+	}
+
+	// Set up the packet and frame we reuse for every read.
+
+	as->input_pkt = av_packet_alloc();
+	as->input_frame = av_frame_alloc();
+	if (!as->input_pkt || !as->input_frame) {
+		printf("unable to allocate packet and frame\n");
 		as_destroy_audiostreamer(as);
 		return NULL;
 	}
 
-	// Presentation timestamp (PTS). This needs to increase for each sample we
-	// output.
-	as->pts = 1;
+	as->input_samples = calloc((size_t) input->codec_ctx->channels,
+			sizeof(uint8_t *));
+	if (!as->input_samples) {
+		printf("%s\n", strerror(errno));
+		as_destroy_audiostreamer(as);
+		return NULL;
+	}
 
 	as->frames_written = 0;
 
+	// Take ownership only once we can't fail. The caller cleans up the input and
+	// outputs if we do.
+	as->nb_outputs = nb_outputs;
 	as->input = input;
-	as->output = output;
 
 	return as;
 }
 
+// Start or stop encoding to an output.
+//
+// While an output is inactive we do not convert or encode anything for it.
+// When it becomes active again it starts with samples decoded from then on.
+void
+as_set_output_active(struct Audiostreamer * const as, const size_t index,
+		const bool active)
+{
+	if (!as || index >= as->nb_outputs) {
+		printf("%s\n", strerror(EINVAL));
+		return;
+	}
+
+	struct Output * const output = as->outputs[index];
+
+	// When running a pipeline, the output's encoder thread owns its FIFO. Any
+	// samples left in it are from just before we stopped, which is harmless.
+	if (active && !output->active && !as->pipeline) {
+		av_audio_fifo_reset(output->af);
+	}
+
+	// If we're caching a file to loop, we'd miss frames. Don't use the cache.
+	if (!active && output->caching) {
+		__free_cache(&output->cache);
+		output->cache.overflow = true;
+	}
+
+	__atomic_store_n(&output->active, active, __ATOMIC_RELAXED);
+}
+
 // Take one of two actions each call:
 //
-// 1. If there are insufficient samples for the encoder, read more samples.
-// 2. If there are sufficient samples for the encoder, feed them to the encoder
-//   and try to write a frame.
+// 1. If an active output has sufficient samples for its encoder, feed them to
+//   the encoder and try to write a frame.
+// 2. Otherwise, read more samples and store them for each active output.
 //
 // If we hit stream EOF on read, we drain the codecs and complete.
 //
@@ -399,458 +1117,3641 @@ as_init_audiostreamer(struct Input * const input, struct Output * const output)
 // -1 if error
 //
 // If we write a packet out, its size will be in frame_size (compressed size).
+// It may be for any of the outputs.
 int
 as_read_write(struct Audiostreamer * const as, int * const frame_size)
 {
-	if (!as || !as->input || !as->output || !as->af) {
+	if (!as || !frame_size) {
 		printf("%s\n", strerror(EINVAL));
 		return -1;
 	}
 
-	// Find how many samples are in the FIFO.
-	const int available_samples = av_audio_fifo_size(as->af);
+	struct FrameInfo frame;
+	memset(&frame, 0, sizeof(struct FrameInfo));
 
-	// Do we need to read & decode another frame from the input? We do if there
-	// are insufficient number of samples for the encoder.
-	if (available_samples < as->output->codec_ctx->frame_size) {
-		const int read_res = __decode_and_store_frame(as);
-		if (read_res == -1) {
-			printf("__decode_and_store_frame error\n");
-			return -1;
-		}
+	const int64_t cpu_start = __thread_cpu_ns();
 
-		// EOF from input.
-		if (read_res == 0) {
-			if (!__drain_codecs(as)) {
-				printf("unable to drain codecs\n");
-				return -1;
-			}
+	const int res = __read_write(as, &frame);
+	if (res == -1) {
+		__count_error(as);
+	}
 
-			// We're done.
-			return 0;
-		}
+	__add_cpu(as, cpu_start);
 
-		// We did some work. Let caller call us again.
-		return 1;
+	if (frame.size > 0) {
+		*frame_size = frame.size;
 	}
 
-	// We have enough samples to encode and write.
+	return res;
+}
 
-	const int write_res = __encode_and_write_frame(as);
-	if (write_res == -1) {
+// Do units of work like as_read_write() until we write max_frames frames,
+// timeout_ms milliseconds pass, or we hit EOF.
+//
+// This is for callers where calling in is expensive, such as from Go. They can
+// make one call for a batch of frames rather than one call per unit of work.
+//
+// We describe each frame we write in frames, which must be able to hold
+// max_frames. nb_frames is set to how many we wrote.
+//
+// Returns the same as as_read_write():
+// 1 if made progress (and more to do)
+// 0 if done (hit EOF). We may still have written frames.
+// -1 if error
+int
+as_read_write_n(struct Audiostreamer * const as,
+		struct FrameInfo * const frames, const int max_frames,
+		const int timeout_ms, int * const nb_frames)
+{
+	if (!as || !frames || max_frames <= 0 || !nb_frames) {
+		printf("%s\n", strerror(EINVAL));
 		return -1;
 	}
 
-	if (write_res > 0) {
-		if (as->frames_written == UINT64_MAX) {
-			as->frames_written = 0;
-		} else {
-			as->frames_written += 1;
-		}
+	const int64_t cpu_start = __thread_cpu_ns();
 
-		*frame_size = write_res;
-	}
+	const int res = __read_write_n(as, frames, max_frames, timeout_ms,
+			nb_frames);
 
-	// We did a unit of work. Let caller call us again.
-	return 1;
+	__add_cpu(as, cpu_start);
+
+	return res;
 }
 
-// Destroy an audiostreamer.
-//
-// We clean up everything including input and output.
-void
-as_destroy_audiostreamer(struct Audiostreamer * const as)
+static int
+__read_write_n(struct Audiostreamer * const as,
+		struct FrameInfo * const frames, const int max_frames,
+		const int timeout_ms, int * const nb_frames)
 {
-	if (!as) {
-		return;
-	}
+	*nb_frames = 0;
 
-	if (as->input) {
-		as_destroy_input(as->input);
+	struct timespec now;
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+		printf("clock_gettime: %s\n", strerror(errno));
+		return -1;
 	}
 
-	if (as->output) {
-		as_destroy_output(as->output);
-	}
+	const int64_t deadline = now.tv_sec*INT64_C(1000) + now.tv_nsec/1000000 +
+		timeout_ms;
 
-	if (as->af) {
-		av_audio_fifo_free(as->af);
-	}
+	while (1) {
+		struct FrameInfo * const frame = &frames[*nb_frames];
+		memset(frame, 0, sizeof(struct FrameInfo));
 
-	free(as);
+		const int res = __read_write(as, frame);
+		if (res == -1) {
+			__count_error(as);
+		}
+
+		if (res != 1) {
+			if (res == 0 && frame->size > 0) {
+				*nb_frames += 1;
+			}
+			return res;
+		}
+
+		if (frame->size > 0) {
+			*nb_frames += 1;
+			if (*nb_frames == max_frames) {
+				return 1;
+			}
+		}
+
+		if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+			printf("clock_gettime: %s\n", strerror(errno));
+			return -1;
+		}
+
+		if (now.tv_sec*INT64_C(1000) + now.tv_nsec/1000000 >= deadline) {
+			return 1;
+		}
+	}
 }
 
-// Read an encoded frame (packet) from the input. Decode it (frame). Store the
-// frame's samples into the FIFO.
+// Do one unit of work. See as_read_write().
 //
-// Returns:
-// 1 if read a frame
-// 0 if EOF
-// -1 if error
+// If we write a frame, we describe it in frame.
 static int
-__decode_and_store_frame(const struct Audiostreamer * const as)
+__read_write(struct Audiostreamer * const as, struct FrameInfo * const frame)
 {
-	if (!as) {
+	if (!as || !as->input || !as->outputs || as->pipeline) {
 		printf("%s\n", strerror(EINVAL));
 		return -1;
 	}
 
-	// Read an encoded frame as a packet.
+	if (as->replaying) {
+		return __replay_frame(as, frame);
+	}
 
-	AVPacket input_pkt;
-	memset(&input_pkt, 0, sizeof(AVPacket));
+	// Does any output have enough samples to encode and write?
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		struct Output * const output = as->outputs[i];
 
-	if (av_read_frame(as->input->format_ctx, &input_pkt) != 0) {
-		// EOF.
-		return 0;
-	}
+		if (!output->active ||
+				av_audio_fifo_size(output->af) < output->codec_ctx->frame_size) {
+			continue;
+		}
 
+		if (as->realtime && !__pace(output)) {
+			return -1;
+		}
 
-	// Send encoded packet to the input's decoder.
+		const int write_res = __write_frame(as, output);
+		if (write_res == -1) {
+			return -1;
+		}
 
-	if (avcodec_send_packet(as->input->codec_ctx, &input_pkt) != 0) {
-		printf("send_packet failed\n");
-		av_packet_unref(&input_pkt);
+		if (write_res > 0) {
+			__count_frame_written(as, output, write_res);
+			frame->output = i;
+			frame->size = write_res;
+			frame->pts = output->last_pts;
+		}
+
+		// We did a unit of work. Let caller call us again.
+		return 1;
+	}
+
+	// We need to read & decode another frame from the input as there are an
+	// insufficient number of samples for the encoders.
+
+	const int read_res = __decode_and_store_frame(as);
+	if (read_res == -1) {
+		printf("__decode_and_store_frame error\n");
 		return -1;
 	}
 
-	av_packet_unref(&input_pkt);
+	// EOF from input.
+	if (read_res == 0) {
+		if (as->loop) {
+			return __restart_input(as) ? 1 : -1;
+		}
+
+		if (!__drain_codecs(as)) {
+			printf("unable to drain codecs\n");
+			return -1;
+		}
+
+		// We're done.
+		return 0;
+	}
 
-	return __decode_and_store_samples(as->input, as->output, as->af);
+	// We did some work. Let caller call us again.
+	return 1;
 }
 
-// Read a decoded frame out of the input's decoder. Convert the samples and
-// store them in the FIFO.
+// Write frames no faster than real time, and loop the input forever.
 //
-// Prereq: We must either have sent an encoded packet to the decoder, or be in
-// draining mode.
+// This is for when the input is a file. Otherwise we decode and encode as fast
+// as we can. The first time through we cache each output's encoded frames.
+// After that we write frames from the caches, so looping costs next to
+// nothing. This relies on every frame being valid on its own, as MP3 frames
+// are without the bit reservoir.
 //
-// Returns:
-// -1 if error
-// 1 if frame read and stored
-// 0 if EOF/EAGAIN
-static int
-__decode_and_store_samples(const struct Input * const input,
-		const struct Output * const output, AVAudioFifo * const af)
+// This applies to as_read_write() and as_read_write_n(). It does not apply to
+// the pipeline.
+void
+as_set_realtime(struct Audiostreamer * const as, const bool loop)
 {
-	// Get decoded data out as a frame.
+	if (!as) {
+		printf("%s\n", strerror(EINVAL));
+		return;
+	}
 
-	AVFrame * input_frame = av_frame_alloc();
-	if (!input_frame) {
-		printf("av_frame_alloc\n");
-		return -1;
+	as->realtime = true;
+	as->loop = loop;
+
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		struct Output * const output = as->outputs[i];
+		output->caching = loop && output->ring && output->cacheable;
 	}
+}
 
-	const int error = avcodec_receive_frame(input->codec_ctx, input_frame);
-	if (error != 0) {
-		if (error == AVERROR(EAGAIN) || error == AVERROR_EOF) {
-			av_frame_free(&input_frame);
-			return 0;
+// Don't run the encoder on silence. Our inputs are often idle, and encoding
+// digital silence costs as much as encoding music.
+//
+// When an output's samples have been silent for AS_SILENCE_HOLD_FRAMES frames
+// in a row, we stop giving them to its encoder. For each frame's worth of
+// samples we write a frame of silence we encoded up front instead. As soon as
+// a sample is louder than threshold we go back to encoding. By then the
+// encoder's lookahead holds only silence, so it picks up where it left off.
+//
+// threshold is a fraction of full scale, from 0 to 1. A sample counts as
+// silent if its absolute value is at most this.
+//
+// This only applies to outputs writing to a ring whose frames are each valid
+// on their own (MP3 without the bit reservoir, see cacheable). Call it before
+// starting work. We count the frames in as_get_stats().
+//
+// Returns false if we couldn't encode a silent frame for an output.
+bool
+as_set_silence_gate(struct Audiostreamer * const as, const double threshold)
+{
+	if (!as || threshold < 0 || threshold > 1) {
+		printf("%s\n", strerror(EINVAL));
+		return false;
+	}
+
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		struct Output * const output = as->outputs[i];
+		if (!output->ring || !output->cacheable) {
+			continue;
 		}
 
-		printf("avcodec_receive_frame failed: %s\n", __get_error_string(error));
-		av_frame_free(&input_frame);
-		return -1;
-	}
+		if (!output->silent_frame && !__encode_silent_frame(output)) {
+			return false;
+		}
 
+		output->silence_threshold = threshold;
 
-	// Convert the samples in the frame.
+		// Scale to the output's integer sample format, if it has one.
+		const enum AVSampleFormat fmt =
+			av_get_packed_sample_fmt(output->codec_ctx->sample_fmt);
+		const double max = fmt == AV_SAMPLE_FMT_S16 ? INT16_MAX :
+			fmt == AV_SAMPLE_FMT_S32 ? INT32_MAX : 0;
+		output->silence_threshold_int = (int64_t) (threshold*max);
 
-	const uint8_t * * const raw_samples = __copy_samples(
-			input_frame->extended_data, output->codec_ctx->channels);
-	if (!raw_samples) {
-		av_frame_free(&input_frame);
-		return -1;
+		// Until we see a sample we don't know it's quiet.
+		output->loud_until = INT64_MAX;
 	}
 
-	uint8_t * * const converted_input_samples = calloc(
-			(size_t) output->codec_ctx->channels, sizeof(uint8_t *));
-	if (!converted_input_samples) {
-		printf("%s\n", strerror(errno));
-		av_frame_free(&input_frame);
-		free(raw_samples);
-		return -1;
+	return true;
+}
+
+// Encode a frame of silence with a new encoder set up like the output's. We
+// keep it to write in place of encoding silence.
+//
+// We encode a few frames and keep the last so that it has nothing of the
+// encoder's start in it.
+static bool
+__encode_silent_frame(struct Output * const output)
+{
+	const AVCodec * const codec = output->codec_ctx->codec;
+
+	AVCodecContext * ctx = avcodec_alloc_context3(codec);
+	AVFrame * frame = av_frame_alloc();
+	AVPacket * pkt = av_packet_alloc();
+	if (!ctx || !frame || !pkt) {
+		printf("unable to allocate silence encoder\n");
+		avcodec_free_context(&ctx);
+		av_frame_free(&frame);
+		av_packet_free(&pkt);
+		return false;
 	}
 
-	if (av_samples_alloc(converted_input_samples, NULL,
-				output->codec_ctx->channels, input_frame->nb_samples,
-				output->codec_ctx->sample_fmt, 0) < 0) {
-		printf("av_samples_alloc\n");
-		av_frame_free(&input_frame);
-		free(converted_input_samples);
-		free(raw_samples);
-		return -1;
+	ctx->channels       = output->codec_ctx->channels;
+	ctx->channel_layout = output->codec_ctx->channel_layout;
+	ctx->sample_rate    = output->codec_ctx->sample_rate;
+	ctx->sample_fmt     = output->codec_ctx->sample_fmt;
+	ctx->bit_rate       = output->codec_ctx->bit_rate;
+
+	// As in as_open_output(), each frame must be valid on its own.
+	if (strcmp(codec->name, "libmp3lame") == 0 &&
+			av_opt_set_int(ctx->priv_data, "reservoir", 0, 0) != 0) {
+		printf("unable to set option\n");
+		goto fail;
 	}
 
-	if (swr_convert(output->resample_ctx, converted_input_samples,
-				input_frame->nb_samples, raw_samples, input_frame->nb_samples) < 0) {
-		printf("swr_convert\n");
-		av_frame_free(&input_frame);
-		free(raw_samples);
-		av_freep(&converted_input_samples[0]);
-		free(converted_input_samples);
-		return -1;
+	if (avcodec_open2(ctx, codec, NULL) != 0 ||
+			ctx->frame_size != output->codec_ctx->frame_size) {
+		printf("unable to open silence encoder\n");
+		goto fail;
 	}
 
-	free(raw_samples);
+	frame->nb_samples     = ctx->frame_size;
+	frame->channel_layout = ctx->channel_layout;
+	frame->format         = ctx->sample_fmt;
+	frame->sample_rate    = ctx->sample_rate;
 
+	if (av_frame_get_buffer(frame, 0) < 0) {
+		printf("unable to allocate silence frame buffer\n");
+		goto fail;
+	}
 
-	// Add the samples to the fifo.
+	if (av_samples_set_silence(frame->extended_data, 0, frame->nb_samples,
+				ctx->channels, ctx->sample_fmt) < 0) {
+		printf("av_samples_set_silence\n");
+		goto fail;
+	}
 
-	// Resize fifo so it can contain old and new samples.
+	for (int i = 0; i < AS_SILENCE_HOLD_FRAMES*2; i++) {
+		frame->pts = (int64_t) i*ctx->frame_size;
 
-	if (av_audio_fifo_size(af) > INT_MAX - input_frame->nb_samples) {
-		printf("overflow\n");
-		av_frame_free(&input_frame);
-		av_freep(&converted_input_samples[0]);
-		free(converted_input_samples);
-		return -1;
-	}
+		if (avcodec_send_frame(ctx, frame) != 0) {
+			printf("unable to encode silence\n");
+			goto fail;
+		}
 
-	if (av_audio_fifo_realloc(af,
-				av_audio_fifo_size(af)+input_frame->nb_samples) != 0) {
-		printf("unable to resize fifo\n");
-		av_frame_free(&input_frame);
-		av_freep(&converted_input_samples[0]);
-		free(converted_input_samples);
-		return -1;
+		while (avcodec_receive_packet(ctx, pkt) == 0) {
+			if (pkt->size > 0 &&
+					(size_t) pkt->size <= output->ring->frame_capacity) {
+				uint8_t * const data = realloc(output->silent_frame,
+						(size_t) pkt->size);
+				if (!data) {
+					printf("%s\n", strerror(errno));
+					av_packet_unref(pkt);
+					goto fail;
+				}
+
+				memcpy(data, pkt->data, (size_t) pkt->size);
+				output->silent_frame = data;
+				output->silent_frame_size = (size_t) pkt->size;
+			}
+
+			av_packet_unref(pkt);
+		}
 	}
 
-	if (av_audio_fifo_write(af, (void * *) converted_input_samples,
-				input_frame->nb_samples) != input_frame->nb_samples) {
-		printf("could not write all samples to fifo\n");
-		av_frame_free(&input_frame);
-		av_freep(&converted_input_samples[0]);
-		free(converted_input_samples);
-		return -1;
+	avcodec_free_context(&ctx);
+	av_frame_free(&frame);
+	av_packet_free(&pkt);
+
+	if (!output->silent_frame) {
+		printf("silence encoder gave us no frame\n");
+		return false;
 	}
 
-	av_frame_free(&input_frame);
-	av_freep(&converted_input_samples[0]);
-	free(converted_input_samples);
+	return true;
 
-	return 1;
+fail:
+	avcodec_free_context(&ctx);
+	av_frame_free(&frame);
+	av_packet_free(&pkt);
+
+	if (output->silent_frame) {
+		free(output->silent_frame);
+		output->silent_frame = NULL;
+		output->silent_frame_size = 0;
+	}
+
+	return false;
 }
 
-// Turn uint8_t * * samples into const uint8_t * * samples. Because for input
-// samples, that is what swr_convert() wants as a parameter.
-static const uint8_t * *
-__copy_samples(uint8_t * * const src, const int nb_channels)
+// We hit EOF while looping. If we cached every output's frames, replay from
+// the caches from now on. Otherwise go back to the start of the input.
+//
+// We don't drain the codecs. Doing so would mean we could not keep encoding,
+// and the little audio they hold at the end of the file is not worth it.
+static bool
+__restart_input(struct Audiostreamer * const as)
 {
-	if (!src) {
-		printf("%s\n", strerror(EINVAL));
-		return NULL;
+	bool cached = true;
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		const struct Output * const output = as->outputs[i];
+		if (!output->caching || output->cache.overflow ||
+				output->cache.nb_frames == 0) {
+			cached = false;
+		}
 	}
 
-	const uint8_t * * const dst = calloc((size_t) nb_channels, sizeof(uint8_t *));
-	if (!dst) {
-		printf("%s\n", strerror(errno));
-		return NULL;
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		struct Output * const output = as->outputs[i];
+		output->caching = false;
+
+		if (!cached) {
+			__free_cache(&output->cache);
+		}
 	}
 
-	for (int i = 0; i < nb_channels; i++) {
-		dst[i] = src[i];
+	if (cached) {
+		as->replaying = true;
+		return true;
 	}
 
-	return dst;
+	if (av_seek_frame(as->input->format_ctx, -1, 0, AVSEEK_FLAG_BACKWARD) < 0) {
+		printf("unable to seek to start of input\n");
+		return false;
+	}
+
+	avcodec_flush_buffers(as->input->codec_ctx);
+
+	return true;
 }
 
-// Take samples from the FIFO, encode them, and write them to the encoder. We
-// try to pull out a fully encoded frame from the encoder, which may or may not
-// succeed, depending on whether there is sufficient data present. If there is,
-// we write the frame to the output.
-//
-// We update the pts.
+// Write the next frame from an output's cache. We pick the active output that
+// is furthest behind.
 //
-// Return values:
-// > 0 if we write a frame. This will be the frame's size (compressed size).
-// 0 if we do not write a frame (this is not an error)
-// -1 if error
+// Returns 1 (there is always more to do) or -1 if error.
 static int
-__encode_and_write_frame(struct Audiostreamer * const as)
+__replay_frame(struct Audiostreamer * const as, struct FrameInfo * const frame)
 {
-	if (!as) {
-		printf("%s\n", strerror(EINVAL));
-		return -1;
+	struct Output * output = NULL;
+	size_t index = 0;
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		struct Output * const o = as->outputs[i];
+		if (!o->active) {
+			continue;
+		}
+
+		// Compare how far along each is in seconds, as sample rates may differ.
+		if (!output || o->pts*output->codec_ctx->sample_rate <
+				output->pts*o->codec_ctx->sample_rate) {
+			output = o;
+			index = i;
+		}
 	}
 
-	// Get frame out of fifo.
+	// Nothing to do. Don't spin.
+	if (!output) {
+		const struct timespec ts = { .tv_sec = 0, .tv_nsec = 10000000L };
+		nanosleep(&ts, NULL);
+		return 1;
+	}
 
-	AVFrame * output_frame = av_frame_alloc();
-	if (!output_frame) {
-		printf("unable to allocate output frame\n");
+	if (!__pace(output)) {
 		return -1;
 	}
 
-	output_frame->nb_samples     = as->output->codec_ctx->frame_size;
-	output_frame->channel_layout = as->output->codec_ctx->channel_layout;
-	output_frame->format         = as->output->codec_ctx->sample_fmt;
-	output_frame->sample_rate    = as->output->codec_ctx->sample_rate;
+	struct FrameCache * const cache = &output->cache;
+	const struct CachedFrame * const cached = &cache->frames[cache->next];
+	cache->next = (cache->next+1)%cache->nb_frames;
 
-	if (av_frame_get_buffer(output_frame, 0) < 0) {
-		printf("unable to allocate output frame buffer\n");
-		av_frame_free(&output_frame);
-		return -1;
-	}
+	// The frame's audio is from the file we read long ago. What we want to know
+	// is how long it takes to reach clients from here, so we say we captured it
+	// now.
+	__frame_ring_write(output->ring, cache->data+cached->offset, cached->size,
+			output->pts, __monotonic_ns());
 
-	if (av_audio_fifo_read(as->af, (void * *) output_frame->data,
-				as->output->codec_ctx->frame_size) < as->output->codec_ctx->frame_size) {
-		printf("short read from fifo\n");
-		av_frame_free(&output_frame);
-		return -1;
-	}
+	output->last_pts = output->pts;
+	output->pts += output->codec_ctx->frame_size;
 
-	output_frame->pts = as->pts;
+	__count_frame_written(as, output, (int) cached->size);
 
-	if (as->pts > INT64_MAX - output_frame->nb_samples) {
-		printf("overflow\n");
-		av_frame_free(&output_frame);
-		return -1;
+	frame->output = index;
+	frame->size = (int) cached->size;
+	frame->pts = output->last_pts;
+
+	return 1;
+}
+
+// Wait until the output's next frame (the one with PTS output->pts) is due.
+static bool
+__pace(struct Output * const output)
+{
+	const int64_t now = __monotonic_ns();
+	if (now == -1) {
+		return false;
 	}
 
-	// PTS can tell us how many seconds we've decoded/encoded. It tells us how
-	// many samples we've processed. Since we know how many samples make up a
-	// second (sample rate is samples per second), we can tell how many seconds
-	// we've output by dividing pts by input->codec_ctx->sample_rate.
-	as->pts += output_frame->nb_samples;
+	const int64_t due = output->pace_base_ns +
+		(output->pts - output->pace_base_pts)*INT64_C(1000000000)/
+		output->codec_ctx->sample_rate;
 
+	// First frame, or we fell behind. Start from now.
+	if (output->pace_base_ns == 0 || now - due > AS_PACE_MAX_LAG_NS) {
+		output->pace_base_ns = now;
+		output->pace_base_pts = output->pts;
+		return true;
+	}
 
-	// Send the raw frame to the encoder.
-	const int error = avcodec_send_frame(as->output->codec_ctx, output_frame);
-	if (error != 0) {
-		printf("avcodec_send_frame failed: %s\n", __get_error_string(error));
-		av_frame_free(&output_frame);
-		return -1;
+	if (due <= now) {
+		return true;
 	}
 
-	av_frame_free(&output_frame);
+	const struct timespec ts = {
+		.tv_sec  = (due-now)/1000000000,
+		.tv_nsec = (due-now)%1000000000,
+	};
+	nanosleep(&ts, NULL);
 
-	return __read_and_write_packet(as);
+	return true;
 }
 
-// Read an encoded packet from output encoder. Write it out as a packet.
-//
-// Prereq: We must either have sent a raw frame to the encoder, or be in
-// draining mode.
-//
-// Returns:
-// -1 if error
-// > 0 if we write a frame. This will be the frame's size (compressed size).
-// 0 if we need to try again with more frames/samples before we can encode a
-//   packet (EAGAIN) or we're done (EOF).
-static int
-__read_and_write_packet(struct Audiostreamer * const as)
+static int64_t
+__monotonic_ns(void)
 {
-	if (!as) {
-		printf("%s\n", strerror(EINVAL));
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+		printf("clock_gettime: %s\n", strerror(errno));
 		return -1;
 	}
 
-	// Read encoded data from the encoder.
+	return ts.tv_sec*INT64_C(1000000000) + ts.tv_nsec;
+}
 
-	AVPacket output_pkt;
-	memset(&output_pkt, 0, sizeof(AVPacket));
+// Return the time on the clock we use for timestamps (CLOCK_MONOTONIC, in
+// nanoseconds), or -1 if error. Callers can use it to line their clock up with
+// ours.
+int64_t
+as_monotonic_ns(void)
+{
+	return __monotonic_ns();
+}
 
-	const int error = avcodec_receive_packet(as->output->codec_ctx, &output_pkt);
-	if (error != 0) {
-		// We expect that we will not always have enough data to get a fully encoded
-		// frame out.
-		if (error == AVERROR(EAGAIN)) {
-			return 0;
-		}
+// Remember when the samples we're about to add to the output's FIFO were
+// read from the input. They go after what's in the FIFO, and output->pts is
+// the PTS of the first sample in the FIFO, so we know their PTS.
+//
+// Only the thread encoding for the output calls this.
+static void
+__mark_capture(struct Output * const output, const int64_t time)
+{
+	struct CaptureMark * const mark =
+		&output->capture_marks[output->nb_capture_marks%AS_CAPTURE_MARKS];
+	mark->pts = output->pts + av_audio_fifo_size(output->af);
+	mark->time = time;
+	output->nb_capture_marks++;
+}
 
-		// In draining mode we never get EAGAIN, but we get EOF.
-		if (error == AVERROR_EOF) {
-			return 0;
+// Find when we read the sample with the given PTS from the input. An encoded
+// packet's PTS is that of its first sample, so this tells when we captured
+// the packet's audio. The time since includes however long the samples sat in
+// the FIFO and in the encoder's lookahead.
+//
+// If the sample is older than every mark we have, we use the oldest. If we
+// have no marks, we return 0.
+static int64_t
+__capture_time(const struct Output * const output, const int64_t pts)
+{
+	uint64_t i = output->nb_capture_marks;
+	const uint64_t oldest = i > AS_CAPTURE_MARKS ? i - AS_CAPTURE_MARKS : 0;
+
+	int64_t time = 0;
+
+	// Newest first. If we reset the FIFO, newer marks may have PTS as low as
+	// older ones, and the newer ones are right.
+	while (i > oldest) {
+		i--;
+		const struct CaptureMark * const mark =
+			&output->capture_marks[i%AS_CAPTURE_MARKS];
+		time = mark->time;
+		if (mark->pts <= pts) {
+			break;
 		}
-
-		printf("avcodec_receive_packet failed: %s\n", __get_error_string(error));
-		return -1;
 	}
 
-	// We now have a compressed, encoded frame. This frame is in a packet. We can
-	// tell its compressed size: output_pkt.size.
-	const int sz = output_pkt.size;
+	return time;
+}
 
-	// Write encoded data packet out using av_write_frame().
-	if (av_write_frame(as->output->format_ctx, &output_pkt) < 0) {
-		printf("av_write_frame failed\n");
-		av_packet_unref(&output_pkt);
-		return -1;
+// Note where the last loud sample is among those we're about to add to the
+// output's FIFO. Like __mark_capture(), they go after what's in the FIFO.
+static void
+__track_loudness(struct Output * const output,
+		uint8_t * const * const samples, const int nb_samples)
+{
+	if (!output->silent_frame) {
+		return;
 	}
 
-	av_packet_unref(&output_pkt);
+	const int last = __last_loud_sample(output, samples, nb_samples);
+	if (last == -1) {
+		// If we never saw a loud sample, these are the first we know to be quiet.
+		if (output->loud_until == INT64_MAX) {
+			output->loud_until = output->pts + av_audio_fifo_size(output->af);
+		}
+		return;
+	}
 
-	return sz;
+	output->loud_until = output->pts + av_audio_fifo_size(output->af) + last + 1;
 }
 
-// Take an error code from the ffmpeg libraries and translate it into a string.
+// Find the last sample (per channel) louder than the output's silence
+// threshold. Returns its index, or -1 if every sample is quiet.
 //
-// Do not free the returned buffer.
-static char *
-__get_error_string(const int error)
+// We search from the end. With audio playing we stop right away, so this costs
+// next to nothing unless it's quiet.
+static int
+__last_loud_sample(const struct Output * const output,
+		uint8_t * const * const samples, const int nb_samples)
 {
-	static char buf[255];
-	memset(buf, 0, 255);
+	const enum AVSampleFormat fmt = output->codec_ctx->sample_fmt;
+	const enum AVSampleFormat packed = av_get_packed_sample_fmt(fmt);
+	const int channels = output->codec_ctx->channels;
 
-	av_strerror(error, buf, 255);
+	const bool planar = av_sample_fmt_is_planar(fmt);
+	const int nb_planes = planar ? channels : 1;
+	const int stride = planar ? 1 : channels;
 
-	return buf;
+	int last = -1;
+
+	for (int p = 0; p < nb_planes; p++) {
+		for (int i = nb_samples*stride - 1; i >= 0 && i/stride > last; i--) {
+			if (__sample_loud(output, packed, samples[p], i)) {
+				last = i/stride;
+				break;
+			}
+		}
+	}
+
+	return last;
 }
 
-// We're at EOF. However, we still have work to finish up. First, there may be
-// samples still in the FIFO. Second, we need to drain the codecs. As
-// described in avcodec.h, the codecs may buffer for one reason or another.
-//
-// To drain them, we put each in draining mode. This is done by sending NULL
-// to avcodec_send_packet() (for decoding) and to avcodec_send_frame() for
-// encoding. Then we need to call avcodec_receive_frame() (decoding) or
-// avcodec_receive_packet() (encoding) repeatedly until we hit
-// AVERROR(EAGAIN).
+// Whether sample i of the given (packed) format in data is louder than the
+// output's silence threshold. Formats we don't know are always loud.
 static bool
-__drain_codecs(struct Audiostreamer * const as)
+__sample_loud(const struct Output * const output,
+		const enum AVSampleFormat fmt, const uint8_t * const data, const int i)
 {
-	if (!as) {
+	if (fmt == AV_SAMPLE_FMT_S16) {
+		const int64_t v = ((const int16_t *) (const void *) data)[i];
+		return v > output->silence_threshold_int ||
+			-v > output->silence_threshold_int;
+	}
+
+	if (fmt == AV_SAMPLE_FMT_S32) {
+		const int64_t v = ((const int32_t *) (const void *) data)[i];
+		return v > output->silence_threshold_int ||
+			-v > output->silence_threshold_int;
+	}
+
+	if (fmt == AV_SAMPLE_FMT_FLT) {
+		const double v = ((const float *) (const void *) data)[i];
+		return v > output->silence_threshold || -v > output->silence_threshold;
+	}
+
+	if (fmt == AV_SAMPLE_FMT_DBL) {
+		const double v = ((const double *) (const void *) data)[i];
+		return v > output->silence_threshold || -v > output->silence_threshold;
+	}
+
+	return true;
+}
+
+// Decide whether to write a silent frame rather than encode the output's next
+// frame. The next frame is silent if there's no loud sample from its first
+// sample on. We only skip the encoder once we've given it
+// AS_SILENCE_HOLD_FRAMES silent frames in a row.
+static bool
+__gate_silence(struct Output * const output)
+{
+	// While caching a file to loop we need every frame encoded.
+	if (!output->silent_frame || output->caching) {
+		return false;
+	}
+
+	if (output->loud_until > output->pts) {
+		output->quiet_frames = 0;
+		return false;
+	}
+
+	if (output->quiet_frames < AS_SILENCE_HOLD_FRAMES) {
+		output->quiet_frames++;
+		return false;
+	}
+
+	return true;
+}
+
+// Take the output's next frame of samples out of its FIFO and write the
+// silent frame in its place.
+//
+// Returns the size of the frame we wrote, or -1 if error.
+static int
+__write_silent_frame(struct Output * const output)
+{
+	const int frame_size = output->codec_ctx->frame_size;
+
+	const int64_t start = __monotonic_ns();
+
+	if (av_audio_fifo_drain(output->af, frame_size) != 0) {
+		printf("unable to drain fifo\n");
+		return -1;
+	}
+
+	__stage_add(&output->stats.fifo, start, 1);
+
+	const int64_t capture_time = __capture_time(output, output->pts);
+
+	output->pts += frame_size;
+
+	// Carry on from the encoder's last packet.
+	const int64_t pts = output->last_pts + frame_size;
+
+	__frame_ring_write(output->ring, output->silent_frame,
+			output->silent_frame_size, pts, capture_time);
+
+	output->last_pts = pts;
+
+	__atomic_fetch_add(&output->stats.silent_frames, 1, __ATOMIC_RELAXED);
+
+	return (int) output->silent_frame_size;
+}
+
+// Destroy an audiostreamer.
+//
+// We clean up everything including input and output.
+void
+as_destroy_audiostreamer(struct Audiostreamer * const as)
+{
+	if (!as) {
+		return;
+	}
+
+	if (as->pipeline) {
+		as_pipeline_stop(as);
+	}
+
+	if (as->input) {
+		as_destroy_input(as->input);
+	}
+
+	if (as->outputs) {
+		for (size_t i = 0; i < as->nb_outputs; i++) {
+			as_destroy_output(as->outputs[i]);
+		}
+		free(as->outputs);
+	}
+
+	av_packet_free(&as->input_pkt);
+	av_frame_free(&as->input_frame);
+
+	if (as->input_samples) {
+		free(as->input_samples);
+	}
+
+	free(as);
+}
+
+// Read an encoded frame (packet) from the input. Decode it (frame). Store the
+// frame's samples into the FIFO.
+//
+// Returns:
+// 1 if read a frame
+// 0 if EOF
+// -1 if error
+static int
+__decode_and_store_frame(struct Audiostreamer * const as)
+{
+	if (!as) {
+		printf("%s\n", strerror(EINVAL));
+		return -1;
+	}
+
+	// Read an encoded frame as a packet.
+
+	const int64_t read_start = __monotonic_ns();
+
+	if (av_read_frame(as->input->format_ctx, as->input_pkt) != 0) {
+		// EOF.
+		return 0;
+	}
+
+	__stage_add(&as->stats.read, read_start, 1);
+
+	// Every sample we decode from the packet was captured by now.
+	as->input_time = __monotonic_ns();
+
+	// A packet from a stream we're not decoding. Move on.
+	if (as->input_pkt->stream_index != as->input->stream_index) {
+		av_packet_unref(as->input_pkt);
+		return 1;
+	}
+
+
+	// Send encoded packet to the input's decoder.
+
+	const int64_t decode_start = __monotonic_ns();
+
+	if (avcodec_send_packet(as->input->codec_ctx, as->input_pkt) != 0) {
+		printf("send_packet failed\n");
+		av_packet_unref(as->input_pkt);
+		return -1;
+	}
+
+	// We count decoded frames when we receive them.
+	__stage_add(&as->stats.decode, decode_start, 0);
+
+	av_packet_unref(as->input_pkt);
+
+	return __decode_and_store_samples(as);
+}
+
+// Read a decoded frame out of the input's decoder. Convert the samples and
+// store them in the FIFO of each active output.
+//
+// Prereq: We must either have sent an encoded packet to the decoder, or be in
+// draining mode.
+//
+// Returns:
+// -1 if error
+// 1 if frame read and stored
+// 0 if EOF/EAGAIN
+static int
+__decode_and_store_samples(struct Audiostreamer * const as)
+{
+	// Get decoded data out as a frame.
+
+	AVFrame * const input_frame = as->input_frame;
+
+	const int64_t decode_start = __monotonic_ns();
+
+	const int error = avcodec_receive_frame(as->input->codec_ctx, input_frame);
+	if (error != 0) {
+		if (error == AVERROR(EAGAIN) || error == AVERROR_EOF) {
+			return 0;
+		}
+
+		printf("avcodec_receive_frame failed: %s\n", __get_error_string(error));
+		return -1;
+	}
+
+	__stage_add(&as->stats.decode, decode_start, 1);
+
+	as->frames_decoded++;
+
+	// swr_convert() wants const uint8_t * * for its input samples.
+	for (int i = 0; i < as->input->codec_ctx->channels; i++) {
+		as->input_samples[i] = input_frame->extended_data[i];
+	}
+
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		struct Output * const output = as->outputs[i];
+		if (!__atomic_load_n(&output->active, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		// Convert the samples in the frame. If another output already converted
+		// them to the format we want, we use its samples.
+
+		struct Output * const src = output->samples_from;
+
+		if (src->converted_frame != as->frames_decoded) {
+			if (!__convert_samples(as, src)) {
+				av_frame_unref(input_frame);
+				return -1;
+			}
+		}
+
+
+		if (!__store_samples(as, i, src)) {
+			av_frame_unref(input_frame);
+			return -1;
+		}
+	}
+
+	av_frame_unref(input_frame);
+
+	return 1;
+}
+
+// Convert the samples in the current input frame to the output's format. They
+// end up in its converted samples buffer.
+//
+// We only reallocate the buffer if it is too small.
+static bool
+__convert_samples(struct Audiostreamer * const as, struct Output * const output)
+{
+	const AVFrame * const input_frame = as->input_frame;
+
+	const bool fast = output->convert &&
+		input_frame->format == output->convert_from &&
+		input_frame->channels == output->codec_ctx->channels;
+
+	// Converting ourselves gives us exactly as many samples as we put in. The
+	// resampler may hold some back or give us some it held back before.
+	const int nb_samples = fast ? input_frame->nb_samples :
+		swr_get_out_samples(output->resample_ctx, input_frame->nb_samples);
+	if (nb_samples < 0) {
+		printf("swr_get_out_samples\n");
+		return false;
+	}
+
+	if (nb_samples > output->converted_samples_capacity) {
+		av_freep(&output->converted_samples[0]);
+		output->converted_samples_capacity = 0;
+
+		if (av_samples_alloc(output->converted_samples, NULL,
+					output->codec_ctx->channels, nb_samples,
+					output->codec_ctx->sample_fmt, 0) < 0) {
+			printf("av_samples_alloc\n");
+			return false;
+		}
+
+		output->converted_samples_capacity = nb_samples;
+		__count_allocation(as);
+	}
+
+	const int64_t start = __monotonic_ns();
+
+	if (fast) {
+		output->convert(input_frame->extended_data[0], output->converted_samples,
+				nb_samples, output->codec_ctx->channels);
+
+		output->nb_converted_samples = nb_samples;
+		output->converted_frame = as->frames_decoded;
+
+		__stage_add(&output->stats.resample, start, 1);
+		return true;
+	}
+
+	const int converted = swr_convert(output->resample_ctx,
+			output->converted_samples, output->converted_samples_capacity,
+			as->input_samples, as->input_frame->nb_samples);
+	if (converted < 0) {
+		printf("swr_convert\n");
+		return false;
+	}
+
+	__stage_add(&output->stats.resample, start, 1);
+
+	output->nb_converted_samples = converted;
+	output->converted_frame = as->frames_decoded;
+
+	return true;
+}
+
+// Decide whether we can convert samples from the input's format to the
+// output's ourselves, and if so, how. The sample rate and channels must match.
+//
+// We convert interleaved signed 16 bit and float samples, which is what live
+// capture gives us, into the formats encoders usually want. For stereo we have
+// SIMD versions. Anything else goes through the resampler.
+static void
+__choose_converter(struct Output * const output,
+		const enum AVSampleFormat input_fmt, const int channels)
+{
+	const enum AVSampleFormat output_fmt = output->codec_ctx->sample_fmt;
+
+#if defined(AS_HAVE_AVX2)
+	const bool avx2 = av_get_cpu_flags() & AV_CPU_FLAG_AVX2;
+#endif
+
+	output->convert_from = input_fmt;
+	output->convert = NULL;
+
+	if (input_fmt == AV_SAMPLE_FMT_S16) {
+		if (output_fmt == AV_SAMPLE_FMT_S16) {
+			output->convert = __convert_s16_to_s16;
+		}
+
+		if (output_fmt == AV_SAMPLE_FMT_S16P) {
+			output->convert = __convert_s16_to_s16p;
+#if defined(__SSE2__)
+			if (channels == 2) {
+				output->convert = __convert_s16_to_s16p_sse2;
+			}
+#endif
+		}
+
+		if (output_fmt == AV_SAMPLE_FMT_S32P) {
+			output->convert = __convert_s16_to_s32p;
+#if defined(__SSE2__)
+			if (channels == 2) {
+				output->convert = __convert_s16_to_s32p_sse2;
+			}
+#endif
+#if defined(AS_HAVE_AVX2)
+			if (channels == 2 && avx2) {
+				output->convert = __convert_s16_to_s32p_avx2;
+			}
+#endif
+		}
+
+		if (output_fmt == AV_SAMPLE_FMT_FLTP) {
+			output->convert = __convert_s16_to_fltp;
+#if defined(__SSE2__)
+			if (channels == 2) {
+				output->convert = __convert_s16_to_fltp_sse2;
+			}
+#endif
+#if defined(AS_HAVE_AVX2)
+			if (channels == 2 && avx2) {
+				output->convert = __convert_s16_to_fltp_avx2;
+			}
+#endif
+		}
+	}
+
+	if (input_fmt == AV_SAMPLE_FMT_FLT) {
+		if (output_fmt == AV_SAMPLE_FMT_FLT) {
+			output->convert = __convert_flt_to_flt;
+		}
+
+		if (output_fmt == AV_SAMPLE_FMT_FLTP) {
+			output->convert = __convert_flt_to_fltp;
+#if defined(__SSE2__)
+			if (channels == 2) {
+				output->convert = __convert_flt_to_fltp_sse2;
+			}
+#endif
+		}
+	}
+}
+
+// The converters. Each takes nb_samples interleaved samples per channel and
+// writes them to out, which has one plane per channel (or one plane if the
+// output is interleaved too).
+//
+// They produce the same values as the resampler: 16 bit samples become 32 bit
+// by shifting them up, and float by dividing by 32768.
+
+static void
+__convert_s16_to_s16(const uint8_t * const in, uint8_t * const * const out,
+		const int nb_samples, const int channels)
+{
+	memcpy(out[0], in, (size_t) nb_samples*(size_t) channels*sizeof(int16_t));
+}
+
+static void
+__convert_s16_to_s16p(const uint8_t * const in, uint8_t * const * const out,
+		const int nb_samples, const int channels)
+{
+	const int16_t * const src = (const int16_t *) in;
+
+	for (int c = 0; c < channels; c++) {
+		int16_t * const dst = (int16_t *) out[c];
+		for (int i = 0; i < nb_samples; i++) {
+			dst[i] = src[i*channels+c];
+		}
+	}
+}
+
+static void
+__convert_s16_to_s32p(const uint8_t * const in, uint8_t * const * const out,
+		const int nb_samples, const int channels)
+{
+	const int16_t * const src = (const int16_t *) in;
+
+	for (int c = 0; c < channels; c++) {
+		int32_t * const dst = (int32_t *) out[c];
+		for (int i = 0; i < nb_samples; i++) {
+			dst[i] = (int32_t) src[i*channels+c]*65536;
+		}
+	}
+}
+
+static void
+__convert_s16_to_fltp(const uint8_t * const in, uint8_t * const * const out,
+		const int nb_samples, const int channels)
+{
+	const int16_t * const src = (const int16_t *) in;
+
+	for (int c = 0; c < channels; c++) {
+		float * const dst = (float *) out[c];
+		for (int i = 0; i < nb_samples; i++) {
+			dst[i] = (float) src[i*channels+c]*(1.0f/32768.0f);
+		}
+	}
+}
+
+static void
+__convert_flt_to_flt(const uint8_t * const in, uint8_t * const * const out,
+		const int nb_samples, const int channels)
+{
+	memcpy(out[0], in, (size_t) nb_samples*(size_t) channels*sizeof(float));
+}
+
+static void
+__convert_flt_to_fltp(const uint8_t * const in, uint8_t * const * const out,
+		const int nb_samples, const int channels)
+{
+	const float * const src = (const float *) in;
+
+	for (int c = 0; c < channels; c++) {
+		float * const dst = (float *) out[c];
+		for (int i = 0; i < nb_samples; i++) {
+			dst[i] = src[i*channels+c];
+		}
+	}
+}
+
+// The SIMD converters are for stereo only. We convert as many samples as we
+// can a vector at a time and the rest with the plain versions.
+//
+// For 16 bit stereo each 32 bit lane holds one left sample (low half) and one
+// right sample (high half). Shifting the lanes separates them without any
+// shuffling.
+
+#if defined(__SSE2__)
+static void
+__convert_s16_to_s16p_sse2(const uint8_t * const in,
+		uint8_t * const * const out, const int nb_samples, const int channels)
+{
+	const int16_t * const src = (const int16_t *) in;
+	int16_t * const left = (int16_t *) out[0];
+	int16_t * const right = (int16_t *) out[1];
+
+	// Samples we can convert a vector at a time.
+	const int nb_vectored = nb_samples - nb_samples%8;
+
+	int i = 0;
+	for (; i < nb_vectored; i += 8) {
+		const __m128i a = _mm_loadu_si128((const __m128i *) (src+i*2));
+		const __m128i b = _mm_loadu_si128((const __m128i *) (src+i*2+8));
+
+		const __m128i la = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		const __m128i lb = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+		const __m128i ra = _mm_srai_epi32(a, 16);
+		const __m128i rb = _mm_srai_epi32(b, 16);
+
+		_mm_storeu_si128((__m128i *) (left+i), _mm_packs_epi32(la, lb));
+		_mm_storeu_si128((__m128i *) (right+i), _mm_packs_epi32(ra, rb));
+	}
+
+	for (; i < nb_samples; i++) {
+		left[i] = src[i*2];
+		right[i] = src[i*2+1];
+	}
+
+	(void) channels;
+}
+
+static void
+__convert_s16_to_s32p_sse2(const uint8_t * const in,
+		uint8_t * const * const out, const int nb_samples, const int channels)
+{
+	const int16_t * const src = (const int16_t *) in;
+	int32_t * const left = (int32_t *) out[0];
+	int32_t * const right = (int32_t *) out[1];
+
+	const __m128i high = _mm_set1_epi32((int) 0xffff0000u);
+
+	// Samples we can convert a vector at a time.
+	const int nb_vectored = nb_samples - nb_samples%8;
+
+	int i = 0;
+	for (; i < nb_vectored; i += 8) {
+		const __m128i a = _mm_loadu_si128((const __m128i *) (src+i*2));
+		const __m128i b = _mm_loadu_si128((const __m128i *) (src+i*2+8));
+
+		_mm_storeu_si128((__m128i *) (left+i), _mm_slli_epi32(a, 16));
+		_mm_storeu_si128((__m128i *) (left+i+4), _mm_slli_epi32(b, 16));
+		_mm_storeu_si128((__m128i *) (right+i), _mm_and_si128(a, high));
+		_mm_storeu_si128((__m128i *) (right+i+4), _mm_and_si128(b, high));
+	}
+
+	for (; i < nb_samples; i++) {
+		left[i] = (int32_t) src[i*2]*65536;
+		right[i] = (int32_t) src[i*2+1]*65536;
+	}
+
+	(void) channels;
+}
+
+static void
+__convert_s16_to_fltp_sse2(const uint8_t * const in,
+		uint8_t * const * const out, const int nb_samples, const int channels)
+{
+	const int16_t * const src = (const int16_t *) in;
+	float * const left = (float *) out[0];
+	float * const right = (float *) out[1];
+
+	const __m128 scale = _mm_set1_ps(1.0f/32768.0f);
+
+	// Samples we can convert a vector at a time.
+	const int nb_vectored = nb_samples - nb_samples%4;
+
+	int i = 0;
+	for (; i < nb_vectored; i += 4) {
+		const __m128i a = _mm_loadu_si128((const __m128i *) (src+i*2));
+
+		const __m128i l = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+		const __m128i r = _mm_srai_epi32(a, 16);
+
+		_mm_storeu_ps(left+i, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+		_mm_storeu_ps(right+i, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+	}
+
+	for (; i < nb_samples; i++) {
+		left[i] = (float) src[i*2]*(1.0f/32768.0f);
+		right[i] = (float) src[i*2+1]*(1.0f/32768.0f);
+	}
+
+	(void) channels;
+}
+
+static void
+__convert_flt_to_fltp_sse2(const uint8_t * const in,
+		uint8_t * const * const out, const int nb_samples, const int channels)
+{
+	const float * const src = (const float *) in;
+	float * const left = (float *) out[0];
+	float * const right = (float *) out[1];
+
+	// Samples we can convert a vector at a time.
+	const int nb_vectored = nb_samples - nb_samples%4;
+
+	int i = 0;
+	for (; i < nb_vectored; i += 4) {
+		const __m128 a = _mm_loadu_ps(src+i*2);
+		const __m128 b = _mm_loadu_ps(src+i*2+4);
+
+		_mm_storeu_ps(left+i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_storeu_ps(right+i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+	}
+
+	for (; i < nb_samples; i++) {
+		left[i] = src[i*2];
+		right[i] = src[i*2+1];
+	}
+
+	(void) channels;
+}
+#endif
+
+// The AVX2 versions are the SSE2 ones with twice as wide vectors. As each lane
+// holds a whole stereo sample we don't need to shuffle across lanes. We only
+// use them if the CPU supports AVX2.
+
+#if defined(AS_HAVE_AVX2)
+__attribute__((target("avx2")))
+static void
+__convert_s16_to_s32p_avx2(const uint8_t * const in,
+		uint8_t * const * const out, const int nb_samples, const int channels)
+{
+	const int16_t * const src = (const int16_t *) in;
+	int32_t * const left = (int32_t *) out[0];
+	int32_t * const right = (int32_t *) out[1];
+
+	const __m256i high = _mm256_set1_epi32((int) 0xffff0000u);
+
+	// Samples we can convert a vector at a time.
+	const int nb_vectored = nb_samples - nb_samples%16;
+
+	int i = 0;
+	for (; i < nb_vectored; i += 16) {
+		const __m256i a = _mm256_loadu_si256((const __m256i *) (src+i*2));
+		const __m256i b = _mm256_loadu_si256((const __m256i *) (src+i*2+16));
+
+		_mm256_storeu_si256((__m256i *) (left+i), _mm256_slli_epi32(a, 16));
+		_mm256_storeu_si256((__m256i *) (left+i+8), _mm256_slli_epi32(b, 16));
+		_mm256_storeu_si256((__m256i *) (right+i), _mm256_and_si256(a, high));
+		_mm256_storeu_si256((__m256i *) (right+i+8), _mm256_and_si256(b, high));
+	}
+
+	for (; i < nb_samples; i++) {
+		left[i] = (int32_t) src[i*2]*65536;
+		right[i] = (int32_t) src[i*2+1]*65536;
+	}
+
+	(void) channels;
+}
+
+__attribute__((target("avx2")))
+static void
+__convert_s16_to_fltp_avx2(const uint8_t * const in,
+		uint8_t * const * const out, const int nb_samples, const int channels)
+{
+	const int16_t * const src = (const int16_t *) in;
+	float * const left = (float *) out[0];
+	float * const right = (float *) out[1];
+
+	const __m256 scale = _mm256_set1_ps(1.0f/32768.0f);
+
+	// Samples we can convert a vector at a time.
+	const int nb_vectored = nb_samples - nb_samples%8;
+
+	int i = 0;
+	for (; i < nb_vectored; i += 8) {
+		const __m256i a = _mm256_loadu_si256((const __m256i *) (src+i*2));
+
+		const __m256i l = _mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16);
+		const __m256i r = _mm256_srai_epi32(a, 16);
+
+		_mm256_storeu_ps(left+i, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+		_mm256_storeu_ps(right+i, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+	}
+
+	for (; i < nb_samples; i++) {
+		left[i] = (float) src[i*2]*(1.0f/32768.0f);
+		right[i] = (float) src[i*2+1]*(1.0f/32768.0f);
+	}
+
+	(void) channels;
+}
+#endif
+
+// Store the converted samples from src for the output at the given index.
+//
+// Usually we add them to the output's FIFO. If we are running a pipeline we
+// hand them to the output's encoder thread instead.
+static bool
+__store_samples(struct Audiostreamer * const as, const size_t index,
+		const struct Output * const src)
+{
+	if (as->pipeline) {
+		return __pipeline_push(as->pipeline, index, src);
+	}
+
+	struct Output * const output = as->outputs[index];
+
+	// Add the samples to the fifo.
+
+	const int64_t start = __monotonic_ns();
+
+	__mark_capture(output, as->input_time);
+	__track_loudness(output, src->converted_samples, src->nb_converted_samples);
+
+	if (!__grow_fifo(as, output, src->nb_converted_samples)) {
+		return false;
+	}
+
+	if (av_audio_fifo_write(output->af, (void * *) src->converted_samples,
+				src->nb_converted_samples) != src->nb_converted_samples) {
+		printf("could not write all samples to fifo\n");
+		return false;
+	}
+
+	__stage_add(&output->stats.fifo, start, 1);
+	__fifo_high_water(output);
+
+	return true;
+}
+
+// Make sure the output's FIFO has room for nb_samples more samples. We only
+// reallocate if it is too small. When we do, we double it so this stays rare.
+static bool
+__grow_fifo(struct Audiostreamer * const as, struct Output * const output,
+		const int nb_samples)
+{
+	if (av_audio_fifo_space(output->af) >= nb_samples) {
+		return true;
+	}
+
+	const int size = av_audio_fifo_size(output->af);
+	if (size > INT_MAX/2 - nb_samples) {
+		printf("overflow\n");
+		return false;
+	}
+
+	if (av_audio_fifo_realloc(output->af, (size+nb_samples)*2) != 0) {
+		printf("unable to resize fifo\n");
+		return false;
+	}
+
+	__count_allocation(as);
+
+	return true;
+}
+
+// Count an allocation we made after initialization. When we run a pipeline
+// several threads may do this at once.
+static void
+__count_allocation(struct Audiostreamer * const as)
+{
+	__atomic_fetch_add(&as->allocations, 1, __ATOMIC_RELAXED);
+}
+
+// Count a frame we wrote to an output. These counters wrap around to 0.
+//
+// Only the thread encoding for the output changes the output's counts, but
+// as_get_stats() may read them from another thread. When we run a pipeline
+// several threads change the total at once.
+static void
+__count_frame_written(struct Audiostreamer * const as,
+		struct Output * const output, const int size)
+{
+	__atomic_fetch_add(&output->frames_written, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&as->frames_written, 1, __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&output->stats.bytes_out, (uint64_t) size,
+			__ATOMIC_RELAXED);
+	__atomic_fetch_add(&output->stats.samples_written,
+			(uint64_t) output->codec_ctx->frame_size, __ATOMIC_RELAXED);
+}
+
+static void
+__count_error(struct Audiostreamer * const as)
+{
+	__atomic_fetch_add(&as->stats.errors, 1, __ATOMIC_RELAXED);
+}
+
+// Add time spent in a stage since start (from __monotonic_ns()). We count it
+// as count more times in the stage.
+//
+// If we couldn't tell the time we skip it.
+static void
+__stage_add(struct StageStats * const stage, const int64_t start,
+		const uint64_t count)
+{
+	const int64_t now = __monotonic_ns();
+	if (start == -1 || now == -1 || now < start) {
+		return;
+	}
+
+	__atomic_fetch_add(&stage->count, count, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&stage->ns, (uint64_t) (now-start), __ATOMIC_RELAXED);
+}
+
+static void
+__stage_load(const struct StageStats * const src, struct StageStats * const dst)
+{
+	dst->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->ns = __atomic_load_n(&src->ns, __ATOMIC_RELAXED);
+}
+
+// Note how many samples are in the output's FIFO if it's the most so far. Only
+// the thread writing to the FIFO calls this.
+static void
+__fifo_high_water(struct Output * const output)
+{
+	const uint64_t size = (uint64_t) av_audio_fifo_size(output->af);
+
+	if (size > __atomic_load_n(&output->stats.fifo_high_water,
+				__ATOMIC_RELAXED)) {
+		__atomic_store_n(&output->stats.fifo_high_water, size, __ATOMIC_RELAXED);
+	}
+}
+
+// Write the output's next frame from the samples in its FIFO. If they're
+// silent we may write a silent frame we encoded up front. Otherwise we take a
+// worker and encode them.
+//
+// Returns the same as __encode_and_write_frame().
+static int
+__write_frame(struct Audiostreamer * const as, struct Output * const output)
+{
+	if (__gate_silence(output)) {
+		return __write_silent_frame(output);
+	}
+
+	__worker_acquire(as);
+	const int res = __encode_and_write_frame(as, output);
+	__worker_release();
+
+	return res;
+}
+
+// Take samples from the FIFO, encode them, and write them to the encoder. We
+// try to pull out a fully encoded frame from the encoder, which may or may not
+// succeed, depending on whether there is sufficient data present. If there is,
+// we write the frame to the output.
+//
+// We update the pts.
+//
+// Return values:
+// > 0 if we write a frame. This will be the frame's size (compressed size).
+// 0 if we do not write a frame (this is not an error)
+// -1 if error
+static int
+__encode_and_write_frame(struct Audiostreamer * const as,
+		struct Output * const output)
+{
+	if (!as || !output) {
+		printf("%s\n", strerror(EINVAL));
+		return -1;
+	}
+
+	// Get frame out of fifo.
+
+	AVFrame * const output_frame = output->frame;
+
+	// The encoder may still hold a reference to the frame's buffer from the
+	// last frame we sent it. If so, this gives us a new buffer.
+	if (!av_frame_is_writable(output_frame)) {
+		__count_allocation(as);
+	}
+
+	if (av_frame_make_writable(output_frame) < 0) {
+		printf("unable to make output frame writable\n");
+		return -1;
+	}
+
+	const int64_t fifo_start = __monotonic_ns();
+
+	if (av_audio_fifo_read(output->af, (void * *) output_frame->data,
+				output->codec_ctx->frame_size) < output->codec_ctx->frame_size) {
+		printf("short read from fifo\n");
+		return -1;
+	}
+
+	__stage_add(&output->stats.fifo, fifo_start, 1);
+
+	output_frame->pts = output->pts;
+
+	if (output->pts > INT64_MAX - output_frame->nb_samples) {
+		printf("overflow\n");
+		return -1;
+	}
+
+	// PTS can tell us how many seconds we've decoded/encoded. It tells us how
+	// many samples we've processed. Since we know how many samples make up a
+	// second (sample rate is samples per second), we can tell how many seconds
+	// we've output by dividing pts by output->codec_ctx->sample_rate.
+	output->pts += output_frame->nb_samples;
+
+
+	// Send the raw frame to the encoder.
+	const int64_t encode_start = __monotonic_ns();
+
+	const int error = avcodec_send_frame(output->codec_ctx, output_frame);
+	if (error != 0) {
+		printf("avcodec_send_frame failed: %s\n", __get_error_string(error));
+		return -1;
+	}
+
+	// We count packets when we receive them.
+	__stage_add(&output->stats.encode, encode_start, 0);
+
+	return __read_and_write_packet(as, output);
+}
+
+// Read an encoded packet from output encoder. Write it out as a packet.
+//
+// Prereq: We must either have sent a raw frame to the encoder, or be in
+// draining mode.
+//
+// Returns:
+// -1 if error
+// > 0 if we write a frame. This will be the frame's size (compressed size).
+// 0 if we need to try again with more frames/samples before we can encode a
+//   packet (EAGAIN) or we're done (EOF).
+static int
+__read_and_write_packet(struct Audiostreamer * const as,
+		struct Output * const output)
+{
+	if (!as || !output) {
+		printf("%s\n", strerror(EINVAL));
+		return -1;
+	}
+
+	// Read encoded data from the encoder.
+
+	AVPacket * const output_pkt = output->pkt;
+
+	const int64_t encode_start = __monotonic_ns();
+
+	const int error = avcodec_receive_packet(output->codec_ctx, output_pkt);
+	if (error != 0) {
+		// We expect that we will not always have enough data to get a fully encoded
+		// frame out.
+		if (error == AVERROR(EAGAIN)) {
+			return 0;
+		}
+
+		// In draining mode we never get EAGAIN, but we get EOF.
+		if (error == AVERROR_EOF) {
+			return 0;
+		}
+
+		printf("avcodec_receive_packet failed: %s\n", __get_error_string(error));
+		return -1;
+	}
+
+	__stage_add(&output->stats.encode, encode_start, 1);
+
+	// We now have a compressed, encoded frame. This frame is in a packet. We can
+	// tell its compressed size: output_pkt->size.
+	int sz = output_pkt->size;
+	int64_t pts = output_pkt->pts;
+
+	// If we wrote silent frames in place of encoding, the encoder still held
+	// some of the silence we gave it before that. It gives it to us now, after
+	// the silent frames, so its PTS would go back in time. Keep them
+	// increasing. They only label frames in the ring.
+	if (output->stats.silent_frames > 0 && pts <= output->last_pts) {
+		pts = output->last_pts + output->codec_ctx->frame_size;
+	}
+
+	const int64_t mux_start = __monotonic_ns();
+
+	// Write encoded data packet out using av_write_frame().
+	if (av_write_frame(output->format_ctx, output_pkt) < 0) {
+		printf("av_write_frame failed\n");
+		av_packet_unref(output_pkt);
+		return -1;
+	}
+
+	av_packet_unref(output_pkt);
+
+	// Make the muxer write out the page or cluster with the packet now, so that
+	// every frame we commit starts at a boundary.
+	if (output->flush_packets && av_write_frame(output->format_ctx, NULL) < 0) {
+		printf("unable to flush muxer\n");
+		return -1;
+	}
+
+	output->last_pts = pts;
+
+	// If we're writing to a ring, what the muxer wrote becomes the frame. Its
+	// size may differ from the packet's if the muxer adds framing.
+	if (output->ring) {
+		sz = __commit_pending(as, output, pts);
+	}
+
+	if (sz >= 0) {
+		__stage_add(&output->stats.mux, mux_start, 1);
+	}
+
+	return sz;
+}
+
+// Take an error code from the ffmpeg libraries and translate it into a string.
+//
+// Do not free the returned buffer.
+static char *
+__get_error_string(const int error)
+{
+	static char buf[255];
+	memset(buf, 0, 255);
+
+	av_strerror(error, buf, 255);
+
+	return buf;
+}
+
+// We're at EOF. However, we still have work to finish up. First, there may be
+// samples still in the FIFO. Second, we need to drain the codecs. As
+// described in avcodec.h, the codecs may buffer for one reason or another.
+//
+// To drain them, we put each in draining mode. This is done by sending NULL
+// to avcodec_send_packet() (for decoding) and to avcodec_send_frame() for
+// encoding. Then we need to call avcodec_receive_frame() (decoding) or
+// avcodec_receive_packet() (encoding) repeatedly until we hit
+// AVERROR(EAGAIN).
+static bool
+__drain_codecs(struct Audiostreamer * const as)
+{
+	if (!as) {
+		printf("%s\n", strerror(EINVAL));
+		return false;
+	}
+
+	if (!__drain_decoder(as)) {
+		return false;
+	}
+
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		struct Output * const output = as->outputs[i];
+		if (!output->active) {
+			continue;
+		}
+
+		if (!__drain_encoder(as, output)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// Put the decoder in draining mode and store the samples it still holds.
+static bool
+__drain_decoder(struct Audiostreamer * const as)
+{
+	// Enter draining mode for decoder.
+	if (avcodec_send_packet(as->input->codec_ctx, NULL) != 0) {
+		printf("send_packet failed (draining mode)\n");
+		return false;
+	}
+
+	// Drain the decoder. All frames/samples end up in the FIFOs.
+	while (1) {
+		const int res = __decode_and_store_samples(as);
+		if (res == -1) {
+			return false;
+		}
+
+		// Decoder said EOF.
+		if (res == 0) {
+			break;
+		}
+	}
+
+	return true;
+}
+
+// Put an output's encoder in draining mode and write the packets it still
+// holds.
+static bool
+__drain_encoder(struct Audiostreamer * const as, struct Output * const output)
+{
+	// Enter draining mode for encoder.
+	if (avcodec_send_frame(output->codec_ctx, NULL) != 0) {
+		printf("send_frame failed (draining mode)\n");
+		return false;
+	}
+
+	while (1) {
+		const int res = __read_and_write_packet(as, output);
+		if (res == -1) {
+			return false;
+		}
+
+		// Encoder said EOF.
+		if (res == 0) {
+			break;
+		}
+	}
+
+	return true;
+}
+
+// AVIOContext write callback for outputs writing to a FrameRing. We hold on to
+// what the muxer writes until __commit_pending().
+static int
+__write_pending(void * const opaque, uint8_t * const buf, const int buf_size)
+{
+	struct Output * const output = opaque;
+
+	if (buf_size < 0 ||
+			(size_t) buf_size > output->ring->frame_capacity - output->pending_size) {
+		output->pending_overflow = true;
+		return AVERROR(ENOSPC);
+	}
+
+	memcpy(output->pending + output->pending_size, buf, (size_t) buf_size);
+	output->pending_size += (size_t) buf_size;
+
+	return buf_size;
+}
+
+// Flush the muxer's IO context and add what it wrote to the ring as a frame.
+//
+// Returns:
+// -1 if error
+// 0 if the muxer did not write anything (e.g. it is holding the packet)
+// > 0 the size of the frame we added
+static int
+__commit_pending(struct Audiostreamer * const as, struct Output * const output,
+		const int64_t pts)
+{
+	avio_flush(output->format_ctx->pb);
+
+	if (output->pending_overflow) {
+		printf("frame is too large for ring\n");
+		output->pending_overflow = false;
+		output->pending_size = 0;
+		return -1;
+	}
+
+	if (output->pending_size == 0) {
+		return 0;
+	}
+
+	__frame_ring_write(output->ring, output->pending, output->pending_size, pts,
+			__capture_time(output, pts));
+
+	if (output->caching) {
+		__cache_frame(as, output);
+	}
+
+	const int sz = (int) output->pending_size;
+	output->pending_size = 0;
+
+	return sz;
+}
+
+// Add the frame in the output's pending buffer to its cache. If the cache gets
+// too large we give up on it.
+static void
+__cache_frame(struct Audiostreamer * const as, struct Output * const output)
+{
+	struct FrameCache * const cache = &output->cache;
+
+	if (cache->overflow) {
+		return;
+	}
+
+	if (output->pending_size > AS_LOOP_CACHE_MAX - cache->size) {
+		printf("file is too large to cache, looping by decoding again\n");
+		__free_cache(cache);
+		cache->overflow = true;
+		return;
+	}
+
+	if (cache->size + output->pending_size > cache->capacity) {
+		size_t capacity = cache->capacity == 0 ? 65536 : cache->capacity*2;
+		if (capacity > AS_LOOP_CACHE_MAX) {
+			capacity = AS_LOOP_CACHE_MAX;
+		}
+
+		uint8_t * const data = realloc(cache->data, capacity);
+		if (!data) {
+			printf("%s\n", strerror(errno));
+			__free_cache(cache);
+			cache->overflow = true;
+			return;
+		}
+
+		cache->data = data;
+		cache->capacity = capacity;
+		__count_allocation(as);
+	}
+
+	if (cache->nb_frames == cache->frames_capacity) {
+		const size_t frames_capacity = cache->frames_capacity == 0 ? 1024 :
+			cache->frames_capacity*2;
+
+		struct CachedFrame * const frames = realloc(cache->frames,
+				frames_capacity*sizeof(struct CachedFrame));
+		if (!frames) {
+			printf("%s\n", strerror(errno));
+			__free_cache(cache);
+			cache->overflow = true;
+			return;
+		}
+
+		cache->frames = frames;
+		cache->frames_capacity = frames_capacity;
+		__count_allocation(as);
+	}
+
+	memcpy(cache->data+cache->size, output->pending, output->pending_size);
+
+	cache->frames[cache->nb_frames].offset = cache->size;
+	cache->frames[cache->nb_frames].size = output->pending_size;
+	cache->nb_frames++;
+
+	cache->size += output->pending_size;
+}
+
+static void
+__free_cache(struct FrameCache * const cache)
+{
+	if (cache->data) {
+		free(cache->data);
+	}
+
+	if (cache->frames) {
+		free(cache->frames);
+	}
+
+	memset(cache, 0, sizeof(struct FrameCache));
+}
+
+// Create a FrameRing holding up to nb_frames frames of up to frame_capacity
+// bytes each.
+struct FrameRing *
+as_frame_ring_alloc(const size_t nb_frames, const size_t frame_capacity)
+{
+	if (nb_frames == 0 || frame_capacity == 0 ||
+			nb_frames > SIZE_MAX/frame_capacity) {
+		printf("%s\n", strerror(EINVAL));
+		return NULL;
+	}
+
+	struct FrameRing * const ring = calloc(1, sizeof(struct FrameRing));
+	if (!ring) {
+		printf("%s\n", strerror(errno));
+		return NULL;
+	}
+
+	if (pthread_mutex_init(&ring->mutex, NULL) != 0) {
+		printf("pthread_mutex_init failed\n");
+		free(ring);
+		return NULL;
+	}
+
+	// Readers wait with a deadline. We want it on the same clock as everything
+	// else in the ring so setting the wall clock doesn't make them spin or
+	// oversleep.
+	pthread_condattr_t cond_attr;
+	if (pthread_condattr_init(&cond_attr) != 0) {
+		printf("pthread_condattr_init failed\n");
+		pthread_mutex_destroy(&ring->mutex);
+		free(ring);
+		return NULL;
+	}
+
+	if (pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC) != 0 ||
+			pthread_cond_init(&ring->cond, &cond_attr) != 0) {
+		printf("pthread_cond_init failed\n");
+		pthread_condattr_destroy(&cond_attr);
+		pthread_mutex_destroy(&ring->mutex);
+		free(ring);
+		return NULL;
+	}
+
+	pthread_condattr_destroy(&cond_attr);
+
+	ring->frames = calloc(nb_frames, sizeof(struct RingFrame));
+	ring->data = calloc(nb_frames, frame_capacity);
+	ring->header = calloc(1, frame_capacity);
+	if (!ring->frames || !ring->data || !ring->header) {
+		printf("%s\n", strerror(errno));
+		as_frame_ring_free(ring);
+		return NULL;
+	}
+
+	for (size_t i = 0; i < nb_frames; i++) {
+		ring->frames[i].data = ring->data + i*frame_capacity;
+	}
+
+	ring->nb_frames = nb_frames;
+	ring->frame_capacity = frame_capacity;
+	ring->next_seq = 1;
+
+	return ring;
+}
+
+void
+as_frame_ring_free(struct FrameRing * const ring)
+{
+	if (!ring) {
+		return;
+	}
+
+	pthread_cond_destroy(&ring->cond);
+	pthread_mutex_destroy(&ring->mutex);
+
+	if (ring->frames) {
+		free(ring->frames);
+	}
+
+	if (ring->data) {
+		free(ring->data);
+	}
+
+	if (ring->header) {
+		free(ring->header);
+	}
+
+	if (ring->notify_fds) {
+		free(ring->notify_fds);
+	}
+
+	free(ring);
+}
+
+// Add a frame to the ring, overwriting the oldest if it is full, and wake up
+// any waiting readers.
+//
+// The caller must ensure size is at most frame_capacity.
+static void
+__frame_ring_write(struct FrameRing * const ring, const uint8_t * const data,
+		const size_t size, const int64_t pts, const int64_t capture_time)
+{
+	const int64_t now = __monotonic_ns();
+
+	pthread_mutex_lock(&ring->mutex);
+
+	struct RingFrame * const frame = &ring->frames[ring->next_seq%ring->nb_frames];
+	memcpy(frame->data, data, size);
+	// The fan-out server reads this without the mutex too.
+	__atomic_store_n(&frame->size, size, __ATOMIC_RELAXED);
+	frame->pts = pts;
+	frame->time = now;
+	frame->capture_time = capture_time;
+	frame->seq = ring->next_seq;
+
+	// The fan-out server reads this without the mutex. Once it sees the new
+	// value it sees the frame.
+	__atomic_store_n(&ring->next_seq, ring->next_seq+1, __ATOMIC_RELEASE);
+
+	pthread_cond_broadcast(&ring->cond);
+
+	const uint64_t one = 1;
+	for (size_t i = 0; i < ring->nb_notify_fds; i++) {
+		// If this fails the counter is full, so the thread will wake anyway.
+		const ssize_t res = write(ring->notify_fds[i], &one, sizeof(one));
+		(void) res;
+	}
+
+	pthread_mutex_unlock(&ring->mutex);
+}
+
+// Return the sequence number the next frame added to the ring will get.
+uint64_t
+as_frame_ring_next_seq(struct FrameRing * const ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	const uint64_t seq = ring->next_seq;
+	pthread_mutex_unlock(&ring->mutex);
+	return seq;
+}
+
+// Wait up to timeout_ms milliseconds for the frame with sequence number seq to
+// be added to the ring.
+//
+// Returns true if it has been added (it may have since been overwritten).
+bool
+as_frame_ring_wait(struct FrameRing * const ring, const uint64_t seq,
+		const int timeout_ms)
+{
+	// The ring's condition variable uses CLOCK_MONOTONIC.
+	struct timespec deadline;
+	if (clock_gettime(CLOCK_MONOTONIC, &deadline) != 0) {
+		printf("clock_gettime: %s\n", strerror(errno));
+		return false;
+	}
+
+	deadline.tv_sec += timeout_ms/1000;
+	deadline.tv_nsec += (long) (timeout_ms%1000)*1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&ring->mutex);
+
+	while (ring->next_seq <= seq) {
+		if (pthread_cond_timedwait(&ring->cond, &ring->mutex, &deadline) != 0) {
+			break;
+		}
+	}
+
+	const bool available = ring->next_seq > seq;
+
+	pthread_mutex_unlock(&ring->mutex);
+
+	return available;
+}
+
+// Copy the frame with sequence number seq into buf.
+//
+// We set time to when we added the frame to the ring, and capture_time to when
+// we read its first samples from the input (0 if we don't know). Both are
+// CLOCK_MONOTONIC in nanoseconds. See as_monotonic_ns().
+//
+// Returns:
+// 1 if we copied the frame. Its size, pts, and times are set.
+// 0 if the frame has not been added yet.
+// -1 if the frame was overwritten or does not fit in buf.
+int
+as_frame_ring_read(struct FrameRing * const ring, const uint64_t seq,
+		uint8_t * const buf, const size_t buf_size, size_t * const size,
+		int64_t * const pts, int64_t * const time, int64_t * const capture_time)
+{
+	pthread_mutex_lock(&ring->mutex);
+
+	if (seq >= ring->next_seq) {
+		pthread_mutex_unlock(&ring->mutex);
+		return 0;
+	}
+
+	const struct RingFrame * const frame = &ring->frames[seq%ring->nb_frames];
+	if (frame->seq != seq || frame->size > buf_size) {
+		pthread_mutex_unlock(&ring->mutex);
+		return -1;
+	}
+
+	memcpy(buf, frame->data, frame->size);
+	*size = frame->size;
+	*pts = frame->pts;
+	*time = frame->time;
+	*capture_time = frame->capture_time;
+
+	pthread_mutex_unlock(&ring->mutex);
+
+	return 1;
+}
+
+// Copy the stream header into buf.
+//
+// Returns the header's size. 0 if there is no header or it does not fit.
+size_t
+as_frame_ring_read_header(struct FrameRing * const ring, uint8_t * const buf,
+		const size_t buf_size)
+{
+	pthread_mutex_lock(&ring->mutex);
+
+	if (ring->header_size > buf_size) {
+		pthread_mutex_unlock(&ring->mutex);
+		return 0;
+	}
+
+	memcpy(buf, ring->header, ring->header_size);
+	const size_t sz = ring->header_size;
+
+	pthread_mutex_unlock(&ring->mutex);
+
+	return sz;
+}
+
+// Find out how many times the stream header has been set. If this changes, the
+// header as_frame_ring_read_header() gave us before no longer goes with the
+// frames.
+uint64_t
+as_frame_ring_header_generation(struct FrameRing * const ring)
+{
+	pthread_mutex_lock(&ring->mutex);
+	const uint64_t generation = ring->header_generation;
+	pthread_mutex_unlock(&ring->mutex);
+
+	return generation;
+}
+
+// Find the oldest frame in the ring that we added at most max_age_ms
+// milliseconds ago. A reader can start from it to give a new client a burst of
+// recent audio.
+//
+// Returns its sequence number. If there is no such frame, this is the sequence
+// number the next frame will get.
+uint64_t
+as_frame_ring_recent_seq(struct FrameRing * const ring, const int max_age_ms)
+{
+	const int64_t now = __monotonic_ns();
+
+	pthread_mutex_lock(&ring->mutex);
+
+	uint64_t seq = ring->next_seq;
+
+	// Walk back from the newest frame until we find one that is too old or was
+	// overwritten.
+	while (now != -1 && seq > 1) {
+		const struct RingFrame * const frame =
+			&ring->frames[(seq-1)%ring->nb_frames];
+		if (frame->seq != seq-1 ||
+				now - frame->time > (int64_t) max_age_ms*1000000) {
+			break;
+		}
+		seq--;
+	}
+
+	pthread_mutex_unlock(&ring->mutex);
+
+	return seq;
+}
+
+// Add (add true) or remove an eventfd we write to whenever we add a frame.
+static bool
+__frame_ring_notify(struct FrameRing * const ring, const int fd, const bool add)
+{
+	pthread_mutex_lock(&ring->mutex);
+
+	if (!add) {
+		for (size_t i = 0; i < ring->nb_notify_fds; i++) {
+			if (ring->notify_fds[i] == fd) {
+				ring->notify_fds[i] = ring->notify_fds[ring->nb_notify_fds-1];
+				ring->nb_notify_fds--;
+				break;
+			}
+		}
+
+		pthread_mutex_unlock(&ring->mutex);
+		return true;
+	}
+
+	int * const fds = realloc(ring->notify_fds,
+			(ring->nb_notify_fds+1)*sizeof(int));
+	if (!fds) {
+		printf("%s\n", strerror(errno));
+		pthread_mutex_unlock(&ring->mutex);
+		return false;
+	}
+
+	fds[ring->nb_notify_fds] = fd;
+	ring->notify_fds = fds;
+	ring->nb_notify_fds++;
+
+	pthread_mutex_unlock(&ring->mutex);
+
+	return true;
+}
+
+// Create a native fan-out server. It serves frames from FrameRings straight to
+// clients over HTTP, without going through Go.
+//
+// Each client costs a goroutine, a ResponseWriter and a channel the other way.
+// Here it costs a struct FanoutClient and a socket. Each thread runs an epoll
+// loop over its clients. When a ring gets a frame, the thread sends every
+// client of that ring whatever it hasn't sent it yet, in one sendmsg() with an
+// iovec per frame pointing into the ring. We never copy frames.
+//
+// burst_ms: Send new clients up to this much recent audio right away.
+//
+// Add the paths to serve with as_fanout_add_route(), then start it with
+// as_fanout_start().
+struct Fanout *
+as_fanout_alloc(const int burst_ms)
+{
+	if (burst_ms < 0) {
+		printf("%s\n", strerror(EINVAL));
+		return NULL;
+	}
+
+	struct Fanout * const fanout = calloc(1, sizeof(struct Fanout));
+	if (!fanout) {
+		printf("%s\n", strerror(errno));
+		return NULL;
+	}
+
+	fanout->burst_ms = burst_ms;
+	atomic_init(&fanout->stop, false);
+
+	return fanout;
+}
+
+// Serve the frames of ring at path. A client asking for it gets a response
+// with the given content type, then the ring's stream header, then frames from
+// up to burst_ms ago on.
+//
+// Call this before as_fanout_start(). Routes are numbered from 0 in the order
+// you add them. See as_fanout_get_stats().
+bool
+as_fanout_add_route(struct Fanout * const fanout, const char * const path,
+		struct FrameRing * const ring, const char * const content_type)
+{
+	if (!fanout || !path || !ring || !content_type || fanout->loops) {
+		printf("%s\n", strerror(EINVAL));
+		return false;
+	}
+
+	struct FanoutRoute * const routes = realloc(fanout->routes,
+			(fanout->nb_routes+1)*sizeof(struct FanoutRoute));
+	if (!routes) {
+		printf("%s\n", strerror(errno));
+		return false;
+	}
+	fanout->routes = routes;
+
+	struct FanoutRoute * const route = &routes[fanout->nb_routes];
+	memset(route, 0, sizeof(struct FanoutRoute));
+
+	const char * const before = "HTTP/1.1 200 OK\r\n"
+		"Content-Type: ";
+	const char * const after = "\r\n"
+		"Cache-Control: no-cache, no-store, must-revalidate\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+
+	const size_t size = strlen(before) + strlen(content_type) + strlen(after);
+
+	route->path = strdup(path);
+	route->response = malloc(size+1);
+	if (!route->path || !route->response) {
+		printf("%s\n", strerror(errno));
+		free(route->path);
+		free(route->response);
+		return false;
+	}
+
+	strcpy(route->response, before);
+	strcat(route->response, content_type);
+	strcat(route->response, after);
+	route->response_size = size;
+	route->ring = ring;
+
+	atomic_init(&route->clients, 0);
+	atomic_init(&route->accepted, 0);
+	atomic_init(&route->too_slow, 0);
+	atomic_init(&route->bytes_out, 0);
+	atomic_init(&route->writes, 0);
+
+	fanout->nb_routes++;
+
+	return true;
+}
+
+// Start serving. We start a thread for each listening socket in listen_fds.
+//
+// Give us sockets bound to the same address with SO_REUSEPORT, one per core
+// you want serving. The kernel spreads new connections across them, and so
+// across the threads. We take ownership of the sockets whether or not we
+// start. We close them in as_fanout_free(), or here if we can't keep track of
+// them.
+//
+// Returns true if every thread started. If not, call as_fanout_free().
+bool
+as_fanout_start(struct Fanout * const fanout, const int * const listen_fds,
+		const size_t nb_listen_fds)
+{
+	if (!fanout || !listen_fds || nb_listen_fds == 0 || fanout->loops) {
+		printf("%s\n", strerror(EINVAL));
+		for (size_t i = 0; listen_fds && i < nb_listen_fds; i++) {
+			close(listen_fds[i]);
+		}
+		return false;
+	}
+
+	fanout->loops = calloc(nb_listen_fds, sizeof(struct FanoutLoop));
+	if (!fanout->loops) {
+		printf("%s\n", strerror(errno));
+		for (size_t i = 0; i < nb_listen_fds; i++) {
+			close(listen_fds[i]);
+		}
+		return false;
+	}
+
+	for (size_t i = 0; i < nb_listen_fds; i++) {
+		struct FanoutLoop * const loop = &fanout->loops[i];
+		loop->fanout = fanout;
+		loop->listen_fd = listen_fds[i];
+		loop->epoll_fd = -1;
+		loop->event_fd = -1;
+	}
+	fanout->nb_loops = nb_listen_fds;
+
+	for (size_t i = 0; i < fanout->nb_loops; i++) {
+		struct FanoutLoop * const loop = &fanout->loops[i];
+
+		const int flags = fcntl(loop->listen_fd, F_GETFL);
+		if (flags == -1 ||
+				fcntl(loop->listen_fd, F_SETFL, flags|O_NONBLOCK) == -1) {
+			printf("fcntl: %s\n", strerror(errno));
+			return false;
+		}
+
+		loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (loop->epoll_fd == -1) {
+			printf("epoll_create1: %s\n", strerror(errno));
+			return false;
+		}
+
+		loop->event_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+		if (loop->event_fd == -1) {
+			printf("eventfd: %s\n", strerror(errno));
+			return false;
+		}
+
+		// We tell these apart from clients by their data.
+		struct epoll_event listen_event = {
+			.events = EPOLLIN,
+			.data.ptr = &loop->listen_fd,
+		};
+		struct epoll_event wake_event = {
+			.events = EPOLLIN,
+			.data.ptr = &loop->event_fd,
+		};
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->listen_fd,
+					&listen_event) == -1 ||
+				epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->event_fd,
+					&wake_event) == -1) {
+			printf("epoll_ctl: %s\n", strerror(errno));
+			return false;
+		}
+
+		for (size_t j = 0; j < fanout->nb_routes; j++) {
+			if (!__frame_ring_notify(fanout->routes[j].ring, loop->event_fd,
+						true)) {
+				return false;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < fanout->nb_loops; i++) {
+		struct FanoutLoop * const loop = &fanout->loops[i];
+
+		if (pthread_create(&loop->thread, NULL, __fanout_loop, loop) != 0) {
+			printf("pthread_create failed\n");
+			return false;
+		}
+		loop->started = true;
+	}
+
+	return true;
+}
+
+// Take a route's counters. route is its number (see as_fanout_add_route()).
+bool
+as_fanout_get_stats(struct Fanout * const fanout, const size_t route,
+		struct FanoutStats * const stats)
+{
+	if (!fanout || route >= fanout->nb_routes || !stats) {
+		printf("%s\n", strerror(EINVAL));
+		return false;
+	}
+
+	const struct FanoutRoute * const r = &fanout->routes[route];
+
+	stats->clients = atomic_load_explicit(&r->clients, memory_order_relaxed);
+	stats->accepted = atomic_load_explicit(&r->accepted, memory_order_relaxed);
+	stats->too_slow = atomic_load_explicit(&r->too_slow, memory_order_relaxed);
+	stats->bytes_out = atomic_load_explicit(&r->bytes_out,
+			memory_order_relaxed);
+	stats->writes = atomic_load_explicit(&r->writes, memory_order_relaxed);
+
+	return true;
+}
+
+// Stop the fan-out server, disconnect its clients, and free it.
+void
+as_fanout_free(struct Fanout * const fanout)
+{
+	if (!fanout) {
+		return;
+	}
+
+	atomic_store(&fanout->stop, true);
+
+	for (size_t i = 0; i < fanout->nb_loops; i++) {
+		struct FanoutLoop * const loop = &fanout->loops[i];
+
+		if (loop->event_fd != -1) {
+			for (size_t j = 0; j < fanout->nb_routes; j++) {
+				(void) __frame_ring_notify(fanout->routes[j].ring, loop->event_fd,
+						false);
+			}
+		}
+
+		if (loop->started) {
+			const uint64_t one = 1;
+			const ssize_t res = write(loop->event_fd, &one, sizeof(one));
+			(void) res;
+			pthread_join(loop->thread, NULL);
+		}
+
+		while (loop->nb_clients > 0) {
+			__fanout_drop(loop, loop->clients[0]);
+		}
+		free(loop->clients);
+
+		if (loop->event_fd != -1) {
+			close(loop->event_fd);
+		}
+		if (loop->epoll_fd != -1) {
+			close(loop->epoll_fd);
+		}
+		close(loop->listen_fd);
+	}
+	free(fanout->loops);
+
+	for (size_t i = 0; i < fanout->nb_routes; i++) {
+		free(fanout->routes[i].path);
+		free(fanout->routes[i].response);
+	}
+	free(fanout->routes);
+
+	free(fanout);
+}
+
+// A fan-out thread. We wait for new connections, for data from clients, for
+// clients' sockets to take more, and for frames.
+//
+// Frames can arrive while we handle other events. We send them once we've
+// handled every event, since sending may drop clients we have events for.
+static void *
+__fanout_loop(void * const arg)
+{
+	struct FanoutLoop * const loop = arg;
+
+	struct epoll_event events[64];
+
+	while (!atomic_load(&loop->fanout->stop)) {
+		// Wake up now and then even without frames so we drop clients that never
+		// send a request.
+		const int n = epoll_wait(loop->epoll_fd, events, 64, 1000);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			printf("epoll_wait: %s\n", strerror(errno));
+			break;
+		}
+
+		bool send = n == 0;
+
+		for (int i = 0; i < n; i++) {
+			void * const ptr = events[i].data.ptr;
+
+			if (ptr == &loop->event_fd) {
+				uint64_t count = 0;
+				const ssize_t res = read(loop->event_fd, &count, sizeof(count));
+				(void) res;
+				send = true;
+				continue;
+			}
+
+			if (ptr == &loop->listen_fd) {
+				__fanout_accept(loop);
+				continue;
+			}
+
+			struct FanoutClient * const client = ptr;
+
+			if (events[i].events & (EPOLLERR|EPOLLHUP)) {
+				__fanout_drop(loop, client);
+				continue;
+			}
+
+			if ((events[i].events & (EPOLLIN|EPOLLRDHUP)) &&
+					!__fanout_read(loop, client)) {
+				continue;
+			}
+
+			if ((events[i].events & EPOLLOUT) && client->route) {
+				client->blocked = false;
+				(void) __fanout_send(loop, client);
+			}
+		}
+
+		if (send) {
+			__fanout_send_all(loop);
+		}
+	}
+
+	return NULL;
+}
+
+// Accept every connection waiting on the loop's listening socket.
+static void
+__fanout_accept(struct FanoutLoop * const loop)
+{
+	while (1) {
+		const int fd = accept(loop->listen_fd, NULL, NULL);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				printf("accept: %s\n", strerror(errno));
+			}
+			return;
+		}
+
+		const int flags = fcntl(fd, F_GETFL);
+		if (flags == -1 || fcntl(fd, F_SETFL, flags|O_NONBLOCK) == -1) {
+			printf("fcntl: %s\n", strerror(errno));
+			close(fd);
+			continue;
+		}
+
+		if (loop->nb_clients == loop->clients_capacity) {
+			const size_t capacity = loop->clients_capacity == 0 ? 64 :
+				loop->clients_capacity*2;
+			struct FanoutClient * * const clients = realloc(loop->clients,
+					capacity*sizeof(struct FanoutClient *));
+			if (!clients) {
+				printf("%s\n", strerror(errno));
+				close(fd);
+				continue;
+			}
+			loop->clients = clients;
+			loop->clients_capacity = capacity;
+		}
+
+		struct FanoutClient * const client = calloc(1,
+				sizeof(struct FanoutClient));
+		if (!client) {
+			printf("%s\n", strerror(errno));
+			close(fd);
+			continue;
+		}
+
+		client->fd = fd;
+		client->accepted = __monotonic_ns();
+		client->buf = malloc(AS_FANOUT_REQUEST_MAX);
+		if (!client->buf) {
+			printf("%s\n", strerror(errno));
+			close(fd);
+			free(client);
+			continue;
+		}
+
+		// Edge triggered, so we hear that the socket can take more once each
+		// time it fills up, not all the time.
+		struct epoll_event event = {
+			.events = EPOLLIN|EPOLLOUT|EPOLLRDHUP|EPOLLET,
+			.data.ptr = client,
+		};
+		if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+			printf("epoll_ctl: %s\n", strerror(errno));
+			close(fd);
+			free(client->buf);
+			free(client);
+			continue;
+		}
+
+		client->index = loop->nb_clients;
+		loop->clients[loop->nb_clients] = client;
+		loop->nb_clients++;
+	}
+}
+
+// Read what the client sent. Until we have its request we keep it. After
+// that we throw it away.
+//
+// Returns false if we dropped the client.
+static bool
+__fanout_read(struct FanoutLoop * const loop,
+		struct FanoutClient * const client)
+{
+	while (1) {
+		uint8_t discard[512];
+
+		uint8_t * const buf = client->route ? discard :
+			client->buf + client->buf_size;
+		const size_t size = client->route ? sizeof(discard) :
+			AS_FANOUT_REQUEST_MAX - client->buf_size;
+
+		if (size == 0) {
+			// The request is too large.
+			__fanout_drop(loop, client);
+			return false;
+		}
+
+		const ssize_t n = read(client->fd, buf, size);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				return true;
+			}
+			__fanout_drop(loop, client);
+			return false;
+		}
+
+		if (n == 0) {
+			__fanout_drop(loop, client);
+			return false;
+		}
+
+		if (client->route) {
+			continue;
+		}
+
+		client->buf_size += (size_t) n;
+
+		// Look for the end of the headers. We need not look at the headers.
+		for (size_t i = 3; i < client->buf_size; i++) {
+			if (memcmp(client->buf+i-3, "\r\n\r\n", 4) == 0) {
+				return __fanout_route(loop, client);
+			}
+		}
+	}
+}
+
+// Find the route the client asked for. Set it up to be sent the response and
+// stream header, then frames.
+//
+// Returns false if we dropped the client.
+static bool
+__fanout_route(struct FanoutLoop * const loop,
+		struct FanoutClient * const client)
+{
+	const char * const request = (const char *) client->buf;
+	const size_t request_size = client->buf_size;
+
+	// GET <path>[?<query>] HTTP/1.x
+	struct FanoutRoute * route = NULL;
+	if (request_size > 4 && memcmp(request, "GET ", 4) == 0) {
+		const char * const path = request+4;
+		size_t path_size = 0;
+		while (4+path_size < request_size && path[path_size] != ' ' &&
+				path[path_size] != '?') {
+			path_size++;
+		}
+
+		// Serving live audio to a client that asked for something else (say a
+		// recording with from=) would be wrong without it noticing, so we refuse.
+		if (4+path_size < request_size && path[path_size] == '?') {
+			const char * const query = path+path_size+1;
+			size_t query_size = 0;
+			while (4+path_size+1+query_size < request_size &&
+					query[query_size] != ' ') {
+				query_size++;
+			}
+
+			if (!__fanout_query_ok(query, query_size)) {
+				__fanout_reject(loop, client, "HTTP/1.1 400 Bad Request\r\n"
+						"Content-Length: 0\r\n"
+						"Connection: close\r\n"
+						"\r\n");
+				return false;
+			}
+		}
+
+		for (size_t i = 0; i < loop->fanout->nb_routes; i++) {
+			struct FanoutRoute * const r = &loop->fanout->routes[i];
+			if (strlen(r->path) == path_size &&
+					memcmp(r->path, path, path_size) == 0) {
+				route = r;
+				break;
+			}
+		}
+	}
+
+	if (!route) {
+		__fanout_reject(loop, client, "HTTP/1.1 404 Not Found\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n"
+				"\r\n");
+		return false;
+	}
+
+	struct FrameRing * const ring = route->ring;
+
+	// Start with recent frames, as long as they're not about to be overwritten.
+	uint64_t seq = as_frame_ring_recent_seq(ring, loop->fanout->burst_ms);
+
+	const uint64_t next_seq = as_frame_ring_next_seq(ring);
+	const uint64_t limit = ring->nb_frames > AS_FANOUT_GUARD_FRAMES*2 ?
+		ring->nb_frames/2 : 0;
+	if (next_seq - seq > limit) {
+		seq = next_seq - limit;
+	}
+
+	uint8_t * const buf = route->response_size > AS_FANOUT_REQUEST_MAX ?
+		realloc(client->buf, route->response_size) : client->buf;
+	if (!buf) {
+		printf("%s\n", strerror(errno));
+		__fanout_drop(loop, client);
+		return false;
+	}
+
+	memcpy(buf, route->response, route->response_size);
+
+	client->buf = buf;
+	client->buf_size = route->response_size;
+	client->buf_offset = 0;
+	client->seq = seq;
+	client->frame_offset = 0;
+	client->route = route;
+
+	atomic_fetch_add_explicit(&route->clients, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&route->accepted, 1, memory_order_relaxed);
+
+	return __fanout_send(loop, client);
+}
+
+// Say whether we can serve a request with this query string (without the
+// '?'). The only parameter we know is latency, which asks for every frame as
+// soon as we have it. We always do that. Anything else (from=, for one) we
+// can't do.
+static bool
+__fanout_query_ok(const char * const query, const size_t query_size)
+{
+	size_t i = 0;
+	while (i < query_size) {
+		size_t end = i;
+		while (end < query_size && query[end] != '&') {
+			end++;
+		}
+
+		size_t key_size = 0;
+		while (i+key_size < end && query[i+key_size] != '=') {
+			key_size++;
+		}
+
+		if (key_size > 0 && !(key_size == strlen("latency") &&
+					memcmp(query+i, "latency", key_size) == 0)) {
+			return false;
+		}
+
+		i = end+1;
+	}
+
+	return true;
+}
+
+// Send the client an error response and drop it.
+static void
+__fanout_reject(struct FanoutLoop * const loop,
+		struct FanoutClient * const client, const char * const response)
+{
+	// The socket is new, so this fits in its buffer.
+	const ssize_t res = send(client->fd, response, strlen(response),
+			MSG_NOSIGNAL);
+	(void) res;
+	__fanout_drop(loop, client);
+}
+
+// Send the client what it hasn't had yet, until it has everything or its
+// socket is full.
+//
+// We point an iovec at each frame in the ring rather than copying it. We read
+// the ring without its mutex: the encoder only writes to the slot after the
+// newest frame, and we cut off clients that get within AS_FANOUT_GUARD_FRAMES
+// of it. next_seq and each frame's size are atomic, so we never read a half
+// written one. After sending we check that the oldest frame we sent is still
+// there. If not, we sent a frame while it was overwritten, so we drop the
+// client.
+//
+// Returns false if we dropped the client.
+static bool
+__fanout_send(struct FanoutLoop * const loop,
+		struct FanoutClient * const client)
+{
+	struct FanoutRoute * const route = client->route;
+	struct FrameRing * const ring = route->ring;
+
+	while (!client->blocked) {
+		struct iovec iov[AS_FANOUT_IOV];
+		size_t nb_iov = 0;
+		size_t total = 0;
+
+		const uint64_t next_seq = __atomic_load_n(&ring->next_seq,
+				__ATOMIC_ACQUIRE);
+
+		if (__fanout_too_slow(loop, client, AS_FANOUT_GUARD_FRAMES)) {
+			return false;
+		}
+
+		if (!client->header_added && client->seq < next_seq &&
+				!__fanout_add_header(client)) {
+			__fanout_drop(loop, client);
+			return false;
+		}
+
+		if (client->buf) {
+			iov[0].iov_base = client->buf + client->buf_offset;
+			iov[0].iov_len = client->buf_size - client->buf_offset;
+			total += iov[0].iov_len;
+			nb_iov++;
+		}
+
+		for (uint64_t seq = client->seq; seq < next_seq && nb_iov < AS_FANOUT_IOV;
+				seq++) {
+			struct RingFrame * const frame = &ring->frames[seq%ring->nb_frames];
+			const size_t offset = seq == client->seq ? client->frame_offset : 0;
+
+			iov[nb_iov].iov_base = frame->data + offset;
+			iov[nb_iov].iov_len = __atomic_load_n(&frame->size, __ATOMIC_RELAXED) -
+				offset;
+			total += iov[nb_iov].iov_len;
+			nb_iov++;
+		}
+
+		if (nb_iov == 0) {
+			return true;
+		}
+
+		// sendmsg() is writev() that can tell the kernel not to raise SIGPIPE.
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = nb_iov;
+
+		const ssize_t sent = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+		if (sent == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN) {
+				client->blocked = true;
+				return true;
+			}
+			__fanout_drop(loop, client);
+			return false;
+		}
+
+		if (__fanout_too_slow(loop, client, 0)) {
+			return false;
+		}
+
+		atomic_fetch_add_explicit(&route->bytes_out, (uint64_t) sent,
+				memory_order_relaxed);
+		atomic_fetch_add_explicit(&route->writes, 1, memory_order_relaxed);
+
+		// Move past what we sent. We go by the iovecs rather than looking at the
+		// ring again.
+		size_t left = (size_t) sent;
+		size_t i = 0;
+
+		if (client->buf) {
+			if (left < iov[0].iov_len) {
+				client->buf_offset += left;
+				left = 0;
+			} else {
+				left -= iov[0].iov_len;
+				free(client->buf);
+				client->buf = NULL;
+			}
+			i++;
+		}
+
+		for (; left > 0 && i < nb_iov; i++) {
+			if (left < iov[i].iov_len) {
+				client->frame_offset += left;
+				break;
+			}
+			left -= iov[i].iov_len;
+			client->seq++;
+			client->frame_offset = 0;
+		}
+
+		if ((size_t) sent < total) {
+			client->blocked = true;
+		}
+	}
+
+	return true;
+}
+
+// Add the ring's stream header to what we send the client before frames.
+static bool
+__fanout_add_header(struct FanoutClient * const client)
+{
+	struct FrameRing * const ring = client->route->ring;
+
+	pthread_mutex_lock(&ring->mutex);
+
+	const size_t pending = client->buf ? client->buf_size - client->buf_offset :
+		0;
+	const size_t size = pending + ring->header_size;
+
+	uint8_t * const buf = size > 0 ? malloc(size) : NULL;
+	if (size > 0 && !buf) {
+		pthread_mutex_unlock(&ring->mutex);
+		printf("%s\n", strerror(errno));
+		return false;
+	}
+
+	if (pending > 0) {
+		memcpy(buf, client->buf + client->buf_offset, pending);
+	}
+	if (ring->header_size > 0) {
+		memcpy(buf + pending, ring->header, ring->header_size);
+	}
+
+	pthread_mutex_unlock(&ring->mutex);
+
+	free(client->buf);
+	client->buf = buf;
+	client->buf_size = size;
+	client->buf_offset = 0;
+	client->header_added = true;
+
+	return true;
+}
+
+// Send every client what it hasn't had yet. Drop clients that have not sent a
+// request in time.
+static void
+__fanout_send_all(struct FanoutLoop * const loop)
+{
+	const int64_t now = __monotonic_ns();
+
+	// Dropping a client moves the last client into its place, so we go from the
+	// end.
+	for (size_t i = loop->nb_clients; i > 0; i--) {
+		struct FanoutClient * const client = loop->clients[i-1];
+
+		if (!client->route) {
+			if (now - client->accepted > AS_FANOUT_REQUEST_TIMEOUT_NS) {
+				__fanout_drop(loop, client);
+			}
+			continue;
+		}
+
+		// A client whose socket is full waits for epoll to say it can take more.
+		// If it falls too far behind meanwhile we cut it off.
+		if (client->blocked) {
+			(void) __fanout_too_slow(loop, client, AS_FANOUT_GUARD_FRAMES);
+			continue;
+		}
+
+		(void) __fanout_send(loop, client);
+	}
+}
+
+// Drop the client if the frame it wants next is gone or within guard frames of
+// being overwritten.
+//
+// Returns true if we dropped it.
+static bool
+__fanout_too_slow(struct FanoutLoop * const loop,
+		struct FanoutClient * const client, const uint64_t guard)
+{
+	struct FanoutRoute * const route = client->route;
+	struct FrameRing * const ring = route->ring;
+
+	const uint64_t next_seq = __atomic_load_n(&ring->next_seq, __ATOMIC_ACQUIRE);
+	if (next_seq - client->seq + guard < ring->nb_frames) {
+		return false;
+	}
+
+	atomic_fetch_add_explicit(&route->too_slow, 1, memory_order_relaxed);
+	__fanout_drop(loop, client);
+	return true;
+}
+
+// Disconnect a client and free it.
+static void
+__fanout_drop(struct FanoutLoop * const loop,
+		struct FanoutClient * const client)
+{
+	if (client->route) {
+		atomic_fetch_sub_explicit(&client->route->clients, 1,
+				memory_order_relaxed);
+	}
+
+	// Closing it takes it out of epoll.
+	close(client->fd);
+
+	loop->nb_clients--;
+	struct FanoutClient * const last = loop->clients[loop->nb_clients];
+	loop->clients[client->index] = last;
+	last->index = client->index;
+
+	free(client->buf);
+	free(client);
+}
+
+// Start decoding and encoding on separate threads.
+//
+// One thread reads, decodes, and converts samples. It hands them to one thread
+// per output through a lock-free ring of nb_blocks sample blocks. Each output's
+// thread encodes and writes frames. This only makes sense with outputs writing
+// to FrameRings.
+//
+// drop_when_full: If an output's thread falls behind and its ring fills up,
+// drop samples for it (true) rather than making the decode thread wait
+// (false). When capturing live audio you probably want to drop so that
+// capture never stalls. When reading a file you want to wait.
+//
+// While the pipeline runs, do not call as_read_write(). Use
+// as_pipeline_status() to find out if it is still running, and
+// as_pipeline_stop() to stop it.
+//
+// Returns true if the pipeline started.
+bool
+as_pipeline_start(struct Audiostreamer * const as, const size_t nb_blocks,
+		const bool drop_when_full)
+{
+	if (!as || as->pipeline || nb_blocks == 0) {
 		printf("%s\n", strerror(EINVAL));
 		return false;
 	}
 
-	// Enter draining mode for decoder.
-	if (avcodec_send_packet(as->input->codec_ctx, NULL) != 0) {
-		printf("send_packet failed (draining mode)\n");
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		if (!as->outputs[i]->ring) {
+			printf("pipeline outputs must write to a ring\n");
+			return false;
+		}
+	}
+
+	struct Pipeline * const pipeline = calloc(1, sizeof(struct Pipeline));
+	if (!pipeline) {
+		printf("%s\n", strerror(errno));
 		return false;
 	}
 
-	// Drain the decoder. All frames/samples end up in the FIFO.
-	while (1) {
-		const int res = __decode_and_store_samples(as->input, as->output, as->af);
-		if (res == -1) {
+	pipeline->as = as;
+	pipeline->drop_when_full = drop_when_full;
+	atomic_init(&pipeline->stop, false);
+	atomic_init(&pipeline->input_done, false);
+	atomic_init(&pipeline->failed, false);
+	atomic_init(&pipeline->running, 0);
+
+	pipeline->rings = calloc(as->nb_outputs, sizeof(struct BlockRing));
+	pipeline->encoders = calloc(as->nb_outputs, sizeof(struct PipelineEncoder));
+	if (!pipeline->rings || !pipeline->encoders) {
+		printf("%s\n", strerror(errno));
+		__pipeline_free(pipeline);
+		return false;
+	}
+
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		pipeline->rings[i].data_fd = -1;
+		pipeline->rings[i].space_fd = -1;
+	}
+
+	// Allocate every block up front. The threads never allocate blocks.
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		const struct Output * const output = as->outputs[i];
+		struct BlockRing * const ring = &pipeline->rings[i];
+
+		atomic_init(&ring->head, 0);
+		atomic_init(&ring->tail, 0);
+		atomic_init(&ring->consumer_parked, false);
+		atomic_init(&ring->producer_parked, false);
+
+		ring->data_fd = eventfd(0, EFD_CLOEXEC);
+		ring->space_fd = eventfd(0, EFD_CLOEXEC);
+		if (ring->data_fd == -1 || ring->space_fd == -1) {
+			printf("eventfd: %s\n", strerror(errno));
+			__pipeline_free(pipeline);
 			return false;
 		}
 
-		// Decoder said EOF.
-		if (res == 0) {
-			break;
+		atomic_init(&ring->nb_pushed, 0);
+		atomic_init(&ring->stalls, 0);
+		atomic_init(&ring->drops, 0);
+		atomic_init(&ring->high_water, 0);
+
+		ring->blocks = calloc(nb_blocks, sizeof(struct SampleBlock));
+		if (!ring->blocks) {
+			printf("%s\n", strerror(errno));
+			__pipeline_free(pipeline);
+			return false;
+		}
+		ring->nb_blocks = nb_blocks;
+
+		for (size_t j = 0; j < nb_blocks; j++) {
+			struct SampleBlock * const block = &ring->blocks[j];
+
+			block->samples = calloc((size_t) output->codec_ctx->channels,
+					sizeof(uint8_t *));
+			if (!block->samples) {
+				printf("%s\n", strerror(errno));
+				__pipeline_free(pipeline);
+				return false;
+			}
+
+			if (av_samples_alloc(block->samples, NULL, output->codec_ctx->channels,
+						AS_CONVERTED_SAMPLES_MIN, output->codec_ctx->sample_fmt, 0) < 0) {
+				printf("av_samples_alloc\n");
+				__pipeline_free(pipeline);
+				return false;
+			}
 		}
 	}
 
-	// Enter draining mode for encoder.
-	if (avcodec_send_frame(as->output->codec_ctx, NULL) != 0) {
-		printf("send_frame failed (draining mode)\n");
+	// The decode thread looks at as->pipeline to know to push blocks rather
+	// than writing FIFOs, so set it before starting any threads.
+	as->pipeline = pipeline;
+
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		struct PipelineEncoder * const encoder = &pipeline->encoders[i];
+		encoder->pipeline = pipeline;
+		encoder->index = i;
+
+		atomic_fetch_add(&pipeline->running, 1);
+
+		if (pthread_create(&encoder->thread, NULL, __pipeline_encode,
+					encoder) != 0) {
+			printf("pthread_create failed\n");
+			atomic_fetch_sub(&pipeline->running, 1);
+			as_pipeline_stop(as);
+			return false;
+		}
+
+		encoder->started = true;
+	}
+
+	atomic_fetch_add(&pipeline->running, 1);
+
+	if (pthread_create(&pipeline->decode_thread, NULL, __pipeline_decode,
+				pipeline) != 0) {
+		printf("pthread_create failed\n");
+		atomic_fetch_sub(&pipeline->running, 1);
+		as_pipeline_stop(as);
 		return false;
 	}
 
-	while (1) {
-		const int res = __read_and_write_packet(as);
-		if (res == -1) {
+	pipeline->decode_started = true;
+
+	return true;
+}
+
+// Returns:
+// 1 if the pipeline is running
+// 0 if it finished (the input hit EOF and we wrote everything)
+// -1 if it failed or is not running
+int
+as_pipeline_status(struct Audiostreamer * const as)
+{
+	if (!as || !as->pipeline) {
+		return -1;
+	}
+
+	if (atomic_load(&as->pipeline->failed)) {
+		return -1;
+	}
+
+	if (atomic_load(&as->pipeline->running) > 0) {
+		return 1;
+	}
+
+	return 0;
+}
+
+// Stop the pipeline and wait for its threads to exit.
+//
+// Afterwards you may call as_read_write() again. Samples that were waiting in
+// the pipeline are discarded.
+void
+as_pipeline_stop(struct Audiostreamer * const as)
+{
+	if (!as || !as->pipeline) {
+		return;
+	}
+
+	struct Pipeline * const pipeline = as->pipeline;
+
+	atomic_store(&pipeline->stop, true);
+	__pipeline_wake_all(pipeline);
+
+	if (pipeline->decode_started) {
+		pthread_join(pipeline->decode_thread, NULL);
+	}
+
+	for (size_t i = 0; i < as->nb_outputs; i++) {
+		if (pipeline->encoders[i].started) {
+			pthread_join(pipeline->encoders[i].thread, NULL);
+		}
+	}
+
+	as->pipeline = NULL;
+
+	__pipeline_free(pipeline);
+}
+
+// Retrieve back-pressure accounting for the output at the given index.
+//
+// Returns false if there is no pipeline running.
+bool
+as_pipeline_get_stats(struct Audiostreamer * const as, const size_t index,
+		struct PipelineStats * const stats)
+{
+	if (!as || !as->pipeline || index >= as->nb_outputs || !stats) {
+		return false;
+	}
+
+	struct BlockRing * const ring = &as->pipeline->rings[index];
+
+	stats->blocks = atomic_load(&ring->nb_pushed);
+	stats->stalls = atomic_load(&ring->stalls);
+	stats->drops = atomic_load(&ring->drops);
+	stats->high_water = atomic_load(&ring->high_water);
+	stats->depth = atomic_load(&ring->head) - atomic_load(&ring->tail);
+
+	return true;
+}
+
+// Retrieve counters and timings for the output at the given index. This
+// includes the input's, which are the same for every output.
+//
+// This is cheap, and it is safe to call while a pipeline is running.
+bool
+as_get_stats(struct Audiostreamer * const as, const size_t index,
+		struct Stats * const stats)
+{
+	if (!as || index >= as->nb_outputs || !stats) {
+		printf("%s\n", strerror(EINVAL));
+		return false;
+	}
+
+	const struct Output * const output = as->outputs[index];
+
+	__stage_load(&as->stats.read, &stats->read);
+	__stage_load(&as->stats.decode, &stats->decode);
+	__stage_load(&output->stats.resample, &stats->resample);
+	__stage_load(&output->stats.fifo, &stats->fifo);
+	__stage_load(&output->stats.encode, &stats->encode);
+	__stage_load(&output->stats.mux, &stats->mux);
+
+	stats->fifo_high_water = __atomic_load_n(&output->stats.fifo_high_water,
+			__ATOMIC_RELAXED);
+	stats->frames_written = __atomic_load_n(&output->frames_written,
+			__ATOMIC_RELAXED);
+	stats->bytes_out = __atomic_load_n(&output->stats.bytes_out,
+			__ATOMIC_RELAXED);
+	stats->samples_written = __atomic_load_n(&output->stats.samples_written,
+			__ATOMIC_RELAXED);
+	stats->sample_rate = output->codec_ctx->sample_rate;
+	stats->errors = __atomic_load_n(&as->stats.errors, __ATOMIC_RELAXED);
+	stats->cpu_ns = __atomic_load_n(&as->stats.cpu_ns, __ATOMIC_RELAXED);
+	stats->worker_wait_ns = __atomic_load_n(&as->stats.worker_wait_ns,
+			__ATOMIC_RELAXED);
+	stats->silent_frames = __atomic_load_n(&output->stats.silent_frames,
+			__ATOMIC_RELAXED);
+
+	return true;
+}
+
+// Limit how many threads may encode at once across every Audiostreamer in the
+// process. Each frame we encode takes one of max workers, waiting for one if
+// they're all busy. 0 means no limit, which is the default.
+//
+// When running many inputs in one process (each with its own
+// Audiostreamer), this keeps encoding from oversubscribing the CPUs. Reading
+// input isn't limited, so a thread waiting on a live input doesn't hold up
+// anyone else. Set this before starting any work.
+void
+as_set_max_workers(const int max)
+{
+	pthread_mutex_lock(&__workers_mutex);
+	__workers_max = max < 0 ? 0 : max;
+	pthread_cond_broadcast(&__workers_cond);
+	pthread_mutex_unlock(&__workers_mutex);
+}
+
+// Wait for a worker to be free and take it. We count the time we wait.
+static void
+__worker_acquire(struct Audiostreamer * const as)
+{
+	if (__atomic_load_n(&__workers_max, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&__workers_mutex);
+
+	if (__workers_max > 0 && __workers_busy >= __workers_max) {
+		const int64_t start = __monotonic_ns();
+
+		while (__workers_max > 0 && __workers_busy >= __workers_max) {
+			pthread_cond_wait(&__workers_cond, &__workers_mutex);
+		}
+
+		const int64_t now = __monotonic_ns();
+		if (start != -1 && now != -1) {
+			__atomic_fetch_add(&as->stats.worker_wait_ns, (uint64_t) (now-start),
+					__ATOMIC_RELAXED);
+		}
+	}
+
+	__workers_busy++;
+
+	pthread_mutex_unlock(&__workers_mutex);
+}
+
+static void
+__worker_release(void)
+{
+	if (__atomic_load_n(&__workers_max, __ATOMIC_RELAXED) == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&__workers_mutex);
+	__workers_busy--;
+	pthread_cond_signal(&__workers_cond);
+	pthread_mutex_unlock(&__workers_mutex);
+}
+
+// CPU time the calling thread has used. -1 if we can't tell.
+static int64_t
+__thread_cpu_ns(void)
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+		return -1;
+	}
+
+	return ts.tv_sec*INT64_C(1000000000) + ts.tv_nsec;
+}
+
+// Count the CPU time the calling thread used since start (from
+// __thread_cpu_ns()) against the Audiostreamer.
+static void
+__add_cpu(struct Audiostreamer * const as, const int64_t start)
+{
+	const int64_t now = __thread_cpu_ns();
+	if (start == -1 || now == -1 || now < start) {
+		return;
+	}
+
+	__atomic_fetch_add(&as->stats.cpu_ns, (uint64_t) (now-start),
+			__ATOMIC_RELAXED);
+}
+
+static void
+__pipeline_free(struct Pipeline * const pipeline)
+{
+	if (!pipeline) {
+		return;
+	}
+
+	if (pipeline->rings) {
+		for (size_t i = 0; i < pipeline->as->nb_outputs; i++) {
+			struct BlockRing * const ring = &pipeline->rings[i];
+
+			if (ring->data_fd != -1) {
+				close(ring->data_fd);
+			}
+			if (ring->space_fd != -1) {
+				close(ring->space_fd);
+			}
+
+			if (!ring->blocks) {
+				continue;
+			}
+
+			for (size_t j = 0; j < ring->nb_blocks; j++) {
+				if (ring->blocks[j].samples) {
+					av_freep(&ring->blocks[j].samples[0]);
+					free(ring->blocks[j].samples);
+				}
+			}
+
+			free(ring->blocks);
+		}
+
+		free(pipeline->rings);
+	}
+
+	if (pipeline->encoders) {
+		free(pipeline->encoders);
+	}
+
+	free(pipeline);
+}
+
+// Hand converted samples from src to the encode thread of the output at the
+// given index. Called by the decode thread.
+//
+// If the samples do not fit in one block we split them up.
+static bool
+__pipeline_push(struct Pipeline * const pipeline, const size_t index,
+		const struct Output * const src)
+{
+	struct BlockRing * const ring = &pipeline->rings[index];
+	const struct Output * const output = pipeline->as->outputs[index];
+
+	int offset = 0;
+	while (offset < src->nb_converted_samples) {
+		size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+		// Wait for room or drop the rest.
+		bool stalled = false;
+		while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) ==
+				ring->nb_blocks) {
+			if (pipeline->drop_when_full) {
+				atomic_fetch_add(&ring->drops, 1);
+				return true;
+			}
+
+			if (atomic_load(&pipeline->stop)) {
+				return true;
+			}
+
+			if (!stalled) {
+				atomic_fetch_add(&ring->stalls, 1);
+				stalled = true;
+			}
+
+			// Park, then look once more so we can't miss the consumer taking a
+			// block before it saw we were parked.
+			atomic_store(&ring->producer_parked, true);
+			if (head - atomic_load(&ring->tail) == ring->nb_blocks &&
+					!atomic_load(&pipeline->stop)) {
+				__block_ring_wait(ring->space_fd);
+			}
+			atomic_store(&ring->producer_parked, false);
+		}
+
+		struct SampleBlock * const block = &ring->blocks[head%ring->nb_blocks];
+
+		int nb_samples = src->nb_converted_samples - offset;
+		if (nb_samples > AS_CONVERTED_SAMPLES_MIN) {
+			nb_samples = AS_CONVERTED_SAMPLES_MIN;
+		}
+
+		if (av_samples_copy(block->samples, src->converted_samples, 0, offset,
+					nb_samples, output->codec_ctx->channels,
+					output->codec_ctx->sample_fmt) < 0) {
+			printf("av_samples_copy\n");
 			return false;
 		}
+		block->nb_samples = nb_samples;
+		block->capture_time = pipeline->as->input_time;
+		offset += nb_samples;
+
+		// Sequentially consistent so it's ordered before our look at
+		// consumer_parked. See struct BlockRing.
+		atomic_store(&ring->head, head+1);
+		if (atomic_load(&ring->consumer_parked)) {
+			__block_ring_wake(ring->data_fd);
+		}
+		atomic_fetch_add(&ring->nb_pushed, 1);
 
-		// Encoder said EOF.
+		const size_t depth = head + 1 -
+			atomic_load_explicit(&ring->tail, memory_order_relaxed);
+		if (depth > atomic_load_explicit(&ring->high_water, memory_order_relaxed)) {
+			atomic_store_explicit(&ring->high_water, depth, memory_order_relaxed);
+		}
+	}
+
+	return true;
+}
+
+// The decode thread. It reads, decodes, and converts samples until EOF or we
+// are told to stop.
+static void *
+__pipeline_decode(void * const arg)
+{
+	struct Pipeline * const pipeline = arg;
+	struct Audiostreamer * const as = pipeline->as;
+
+	while (!atomic_load(&pipeline->stop)) {
+		const int64_t cpu_start = __thread_cpu_ns();
+		const int res = __decode_and_store_frame(as);
+		__add_cpu(as, cpu_start);
+		if (res == -1) {
+			printf("__decode_and_store_frame error\n");
+			__count_error(as);
+			atomic_store(&pipeline->failed, true);
+			break;
+		}
+
+		// EOF from input.
 		if (res == 0) {
+			if (!__drain_decoder(as)) {
+				printf("unable to drain decoder\n");
+				__count_error(as);
+				atomic_store(&pipeline->failed, true);
+			}
 			break;
 		}
 	}
 
-	return true;
+	// Encode threads waiting for blocks need to hear there won't be any more.
+	atomic_store(&pipeline->input_done, true);
+	__pipeline_wake_all(pipeline);
+	atomic_fetch_sub(&pipeline->running, 1);
+
+	return NULL;
+}
+
+// An output's encode thread. It takes blocks of samples from the decode thread,
+// and encodes and writes frames.
+static void *
+__pipeline_encode(void * const arg)
+{
+	struct PipelineEncoder * const encoder = arg;
+	struct Pipeline * const pipeline = encoder->pipeline;
+	struct Audiostreamer * const as = pipeline->as;
+	struct Output * const output = as->outputs[encoder->index];
+	struct BlockRing * const ring = &pipeline->rings[encoder->index];
+
+	while (!atomic_load(&pipeline->stop)) {
+		const size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+		if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+			// Nothing to do. If the decoder is done and we took everything it gave
+			// us, finish up. We check input_done before head so that we can't miss
+			// a block pushed in between.
+			if (atomic_load(&pipeline->input_done) &&
+					tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+				if (!__drain_encoder(as, output)) {
+					printf("unable to drain encoder\n");
+					__count_error(as);
+					atomic_store(&pipeline->failed, true);
+				}
+				break;
+			}
+
+			// Park, then look once more so we can't miss a block pushed before the
+			// decode thread saw we were parked.
+			atomic_store(&ring->consumer_parked, true);
+			if (tail == atomic_load(&ring->head) &&
+					!atomic_load(&pipeline->input_done) &&
+					!atomic_load(&pipeline->stop)) {
+				__block_ring_wait(ring->data_fd);
+			}
+			atomic_store(&ring->consumer_parked, false);
+			continue;
+		}
+
+		const int64_t cpu_start = __thread_cpu_ns();
+		const int res = __pipeline_encode_block(as, output,
+				&ring->blocks[tail%ring->nb_blocks]);
+		__add_cpu(as, cpu_start);
+
+		// Sequentially consistent so it's ordered before our look at
+		// producer_parked. See struct BlockRing.
+		atomic_store(&ring->tail, tail+1);
+		if (atomic_load(&ring->producer_parked)) {
+			__block_ring_wake(ring->space_fd);
+		}
+
+		if (res == -1) {
+			__count_error(as);
+			atomic_store(&pipeline->failed, true);
+			break;
+		}
+	}
+
+	// If we failed, make everyone stop.
+	if (atomic_load(&pipeline->failed)) {
+		atomic_store(&pipeline->stop, true);
+		__pipeline_wake_all(pipeline);
+	}
+
+	atomic_fetch_sub(&pipeline->running, 1);
+
+	return NULL;
+}
+
+// Add a block of samples to the output's FIFO and encode and write every full
+// frame we have.
+//
+// Returns -1 if error, 1 otherwise.
+static int
+__pipeline_encode_block(struct Audiostreamer * const as,
+		struct Output * const output, const struct SampleBlock * const block)
+{
+	const int64_t start = __monotonic_ns();
+
+	__mark_capture(output, block->capture_time);
+	__track_loudness(output, block->samples, block->nb_samples);
+
+	if (!__grow_fifo(as, output, block->nb_samples)) {
+		return -1;
+	}
+
+	if (av_audio_fifo_write(output->af, (void * *) block->samples,
+				block->nb_samples) != block->nb_samples) {
+		printf("could not write all samples to fifo\n");
+		return -1;
+	}
+
+	__stage_add(&output->stats.fifo, start, 1);
+	__fifo_high_water(output);
+
+	while (av_audio_fifo_size(output->af) >= output->codec_ctx->frame_size) {
+		const int res = __write_frame(as, output);
+		if (res == -1) {
+			return -1;
+		}
+
+		if (res > 0) {
+			__count_frame_written(as, output, res);
+		}
+	}
+
+	return 1;
+}
+
+// Block until someone writes the eventfd. The caller checks again why it was
+// waiting, so it doesn't matter if we return early (a stale count or EINTR).
+static void
+__block_ring_wait(const int fd)
+{
+	uint64_t count = 0;
+	const ssize_t res = read(fd, &count, sizeof(count));
+	(void) res;
+}
+
+static void
+__block_ring_wake(const int fd)
+{
+	// If this fails the counter is full, so the other side will wake anyway.
+	const uint64_t one = 1;
+	const ssize_t res = write(fd, &one, sizeof(one));
+	(void) res;
+}
+
+// Wake every thread waiting on a ring, whether or not it's parked. We do this
+// when stop or input_done changes, which each thread checks after waking.
+static void
+__pipeline_wake_all(struct Pipeline * const pipeline)
+{
+	for (size_t i = 0; i < pipeline->as->nb_outputs; i++) {
+		__block_ring_wake(pipeline->rings[i].data_fd);
+		__block_ring_wake(pipeline->rings[i].space_fd);
+	}
 }
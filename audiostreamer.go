@@ -1,52 +1,342 @@
 package main
 
 import (
-	"bufio"
+	"encoding/json"
 	"flag"
 	"fmt"
+	"io"
 	"log"
+	"math"
 	"net"
 	"net/http"
 	"net/http/fcgi"
 	"os"
+	"path/filepath"
+	"regexp"
+	"runtime"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
 	"unsafe"
 )
 
 // #include "audiostreamer.h"
 // #include <stdlib.h>
-// #cgo LDFLAGS: -lavformat -lavdevice -lavcodec -lavutil -lswresample
+// #cgo LDFLAGS: -lavformat -lavdevice -lavcodec -lavutil -lswresample -lpthread
 import "C"
 
 // Args holds command line arguments.
 type Args struct {
-	ListenHost  string
-	ListenPort  int
-	InputFormat string
-	InputURL    string
-	Verbose     bool
+	ListenHost string
+	ListenPort int
+	Verbose    bool
 	// Serve with FCGI protocol (true) or HTTP (false).
 	FCGI bool
+	// Each input we serve. From -config, or else the one input given by flags.
+	Mounts []*Mount
+	// How many threads may encode at once across every mount. 0 for no limit.
+	Workers int
+	// Keep encoding a rendition this long after its last client leaves.
+	Linger time.Duration
+	// Keep the input and encoders open while there are no clients.
+	Standby bool
+	// How much recent audio to send new clients right away.
+	Burst time.Duration
+	// How we flush audio out to clients.
+	Flush FlushPolicy
+	// What we do with clients that fall behind.
+	Lag LagPolicy
+	// If set, POSTs to /metadata must carry it. See metadataRequest().
+	MetadataToken string
+	// Duration of HLS segments in seconds. 0 if we don't serve HLS.
+	HLSSegmentDuration float64
+	// How many HLS segments we keep.
+	HLSWindow int
+	// Directory to record renditions to. Empty if we don't record.
+	DVRDir string
+	// How much audio each recording segment holds, and how long we keep them.
+	DVRSegmentDuration time.Duration
+	DVRRetention       time.Duration
+	// Port to serve audio on natively (from C). 0 if we don't.
+	NativePort int
+	// How many threads serve natively.
+	NativeThreads int
+}
+
+// A Mount is an input we serve, with its own renditions, encoder and clients.
+// We serve a mount's renditions under /<name>/, e.g. /kitchen/audio/96.mp3. A
+// mount with no name is served at the root, e.g. /audio/96.mp3.
+type Mount struct {
+	Name string `json:"name"`
+
+	// Input format and URL, and options for the format. See -format, -input and
+	// -input-options.
+	InputFormat  string `json:"format"`
+	InputURL     string `json:"input"`
+	InputOptions string `json:"input_options"`
+
+	// Renditions to encode, as given to -renditions.
+	RenditionsString string `json:"renditions"`
+
+	// Decode and encode on separate threads.
+	Pipeline bool `json:"pipeline"`
+
+	// If the input is a file, encode it no faster than real time and loop it.
+	Realtime bool `json:"realtime"`
+
+	// If set, we take the title of what's playing from the first line of this
+	// file whenever it changes.
+	MetadataFile string `json:"metadata_file"`
+
+	// Whether we stop encoding while the input is silent. If we do, we send MP3
+	// renditions silent frames we encoded up front instead.
+	SilenceGate bool `json:"silence_gate"`
+
+	// Audio at or below this level (dBFS, so at most 0) is silence.
+	SilenceThreshold float64 `json:"silence_threshold"`
+
+	// What's playing.
+	Metadata *Metadata `json:"-"`
+
+	Renditions []*Rendition `json:"-"`
+
+	// Changes in the mount's clients announce on this channel to its encoder
+	// supervisor.
+	ClientChangeChan chan ClientChange `json:"-"`
+
+	// CPU time spent decoding and encoding the mount, and waiting for a worker
+	// to encode with, over every time its encoder ran. We update these
+	// atomically.
+	cpuNS        uint64
+	workerWaitNS uint64
+}
+
+// Prefix is the start of the paths we serve the mount at.
+func (m *Mount) Prefix() string {
+	if m.Name == "" {
+		return ""
+	}
+	return "/" + m.Name
+}
+
+// Mount names become part of paths. They can't be ones we use at the root.
+var mountNameRE = regexp.MustCompile(`^[a-z0-9_-]+$`)
+
+var reservedMountNames = map[string]struct{}{
+	"audio":    {},
+	"hls":      {},
+	"metadata": {},
+	"metrics":  {},
+}
+
+// A Rendition is one encoding of the input. We decode the input once and
+// encode it to every rendition.
+type Rendition struct {
+	Codec Codec
+
+	// Kb/s
+	BitRate int
+
+	// Path we serve it at. e.g. /audio/128.mp3
+	Path string
+
+	// Options for the encoder, e.g. frame_duration=20. May be empty.
+	EncoderOptions string
+
+	// The encoder writes frames for this rendition into this ring.
+	Ring *C.struct_FrameRing
+
+	// The reader publishes the ring's frames here for clients to read.
+	Broadcast *Broadcast
+
+	// The reader reads frames into memory from this pool.
+	FramePool *framePool
+
+	// Whether the encoder should encode this rendition (1) or not (0). The
+	// encoder supervisor sets this depending on whether it has clients.
+	Active int32
+
+	// What we report at /metrics.
+	Metrics RenditionMetrics
+
+	// If we serve the rendition with HLS, this packages it into segments.
+	Segmenter *Segmenter
+
+	// If we record the rendition, this keeps it on disk.
+	Recorder *Recorder
+}
+
+// RenditionMetrics holds what we know about a rendition for /metrics. The
+// encoder and the rendition's reader update it and the HTTP handler reads it.
+type RenditionMetrics struct {
+	mutex sync.Mutex
+
+	// The library's counters and timings as of the encoder's last batch of
+	// work. They start over each time the encoder starts.
+	stats C.struct_Stats
+
+	// Time from receiving a request until we wrote the first byte, and until we
+	// wrote the first audio frame (after the header), summed over clients.
+	firstByte       time.Duration
+	firstByteCount  uint64
+	firstAudio      time.Duration
+	firstAudioCount uint64
+
+	// Time the encoder took to open the input and outputs, and the input alone,
+	// summed over the times it started.
+	encoderStart      time.Duration
+	inputOpen         time.Duration
+	encoderStartCount uint64
+
+	// Frames written to clients and times we flushed them out, summed over
+	// clients. We update these atomically rather than with the mutex.
+	writes  uint64
+	flushes uint64
+
+	// How long frames take to get through each stage. These are atomic too.
+	latency latencyHistograms
+}
+
+// A Codec describes how to encode a rendition.
+type Codec struct {
+	// Output (muxer) format.
+	Format string
+
+	// Encoder name.
+	Encoder string
+
+	ContentType string
+
+	// File extension in the rendition's path.
+	Extension string
+}
+
+// Codecs we can encode to.
+var codecs = map[string]Codec{
+	"mp3": {
+		Format:      "mp3",
+		Encoder:     "libmp3lame",
+		ContentType: "audio/mpeg",
+		Extension:   "mp3",
+	},
+	// Opus in Ogg. The library flushes a page per packet, so a client can start
+	// with any frame after the header.
+	"opus": {
+		Format:      "ogg",
+		Encoder:     "libopus",
+		ContentType: "audio/ogg",
+		Extension:   "opus",
+	},
+	// Opus in WebM. The library closes a cluster per packet.
+	"webm": {
+		Format:      "webm",
+		Encoder:     "libopus",
+		ContentType: "audio/webm",
+		Extension:   "webm",
+	},
+}
+
+// Opus frame durations (milliseconds) we allow. Shorter frames mean lower
+// latency but a little more overhead.
+var opusFrameDurations = map[int]struct{}{
+	5: {}, 10: {}, 20: {}, 40: {}, 60: {},
 }
 
 // HTTPHandler allows us to pass information to our request handlers.
 type HTTPHandler struct {
-	Verbose          bool
-	ClientChangeChan chan<- int
-	ClientChan       chan<- Client
+	Verbose bool
+	Mounts  []*Mount
+
+	// How much recent audio we send new clients right away.
+	Burst time.Duration
+
+	// How we flush audio out to clients.
+	Flush FlushPolicy
+
+	// What we do with clients that fall behind.
+	Lag LagPolicy
+
+	// How many threads may encode at once. 0 for no limit.
+	Workers int
+
+	// Serves audio natively as well, if we do.
+	Native *NativeServer
+
+	// If set, POSTs to /metadata must carry it. Otherwise we take them only
+	// from the local machine.
+	MetadataToken string
+}
+
+// FlushPolicy says when we flush audio written to a client out to the network.
+//
+// We write frames to the client as we get them, but each flush is a syscall
+// (and a FastCGI record) so we'd rather do a few per second than one per
+// frame. We flush once we've caught up with the newest frame, no sooner than
+// Interval after the last flush, or once we have Bytes to send. The zero value
+// flushes as soon as we've caught up, which means every frame for a client that
+// is keeping up.
+type FlushPolicy struct {
+	Interval time.Duration
+	Bytes    int
 }
 
-// A Client is servicing one HTTP client. It receives audio data from the
-// reader.
-type Client struct {
-	Audio chan Frame
-	Done  chan struct{}
+// ClientChange announces a change in the clients of a rendition.
+type ClientChange struct {
+	// Index of the rendition.
+	Rendition int
+
+	// +1 for a new client, -1 for losing a client.
+	Change int
 }
 
 // Frame is an audio frame (compressed and encoded).
 type Frame struct {
 	Audio []byte
+
+	// Whether this is the stream header rather than a frame.
+	Header bool
+
+	// The slab holding Audio if it came from a framePool.
+	slab *frameSlab
+
+	// When the library read the frame's audio from the input, when it added
+	// the frame to its ring, and when our reader published it. See latency.go.
+	captured int64
+	encoded  int64
+	read     int64
+
+	// PTS in the output's time base.
+	pts int64
 }
 
+// The encoder writes frames into a ring in memory. These set its size.
+// ringFrames frames of MP3 at 96 Kb/s is roughly 25 seconds. Each frame must
+// fit in ringFrameCapacity bytes.
+const (
+	ringFrames        = 1024
+	ringFrameCapacity = 8192
+)
+
+// The reader publishes frames to clients through a broadcast ring of this many
+// frames. A client that falls further behind than this is cut off. With MP3
+// this is about 25 seconds.
+const broadcastFrames = 1024
+
+// When decoding and encoding on separate threads, the decoder hands each
+// encoder blocks of samples through a ring of this many blocks.
+const pipelineBlocks = 64
+
+// The encoder asks the library to do a batch of work per call rather than a
+// single unit of work. Calling into C is expensive. A call returns after it
+// writes encodeBatchFrames frames or encodeBatchTimeoutMS milliseconds pass,
+// so we still notice being told to stop soon enough.
+const (
+	encodeBatchFrames    = 16
+	encodeBatchTimeoutMS = 50
+)
+
 func main() {
 	args, err := getArgs()
 	if err != nil {
@@ -54,44 +344,37 @@ func main() {
 	}
 
 	C.as_setup()
+	C.as_set_max_workers(C.int(args.Workers))
 
-	// Encoder writes to out pipe. Reader reads from in pipe.
-	in, out, err := os.Pipe()
-	if err != nil {
-		log.Fatalf("pipe: %s", err)
+	for _, mount := range args.Mounts {
+		startMount(args, mount)
 	}
 
-	// Changes in clients announce on this channel. +1 for new client, -1 for
-	// losing a client.
-	clientChangeChan := make(chan int)
-
-	// Clients provide reader a channel to receive on.
-	//
-	// The reader acts as a publisher and clients act as subscribers. One
-	// publisher, potentially many subscribers.
-	clientChan := make(chan Client)
-
-	// When encoder writes a frame, we know how large it is by a message on this
-	// channel. The encoder sends messages on this channel to the reader to
-	// inform it of this. The reader then knows how much to read and allows it to
-	// always read a single frame at a time, which is valid for a client to
-	// receive. Otherwise if it reads without knowing frame boundaries, it is
-	// difficult for it to know when it is valid to start sending data to a
-	// client that enters mid-encoding.
-	frameChan := make(chan int)
-
-	go encoderSupervisor(out, args.InputFormat, args.InputURL, args.Verbose,
-		clientChangeChan, frameChan)
-	go reader(args.Verbose, in, clientChan, frameChan)
+	var native *NativeServer
+	if args.NativePort > 0 {
+		native, err = startNativeServer(args.ListenHost, args.NativePort,
+			args.NativeThreads, args.Burst, args.Mounts)
+		if err != nil {
+			log.Fatalf("Unable to start native server: %s", err)
+		}
+		log.Printf("Serving audio natively on %s:%d with %d threads",
+			args.ListenHost, args.NativePort, args.NativeThreads)
+	}
 
 	// Start serving either with HTTP or FastCGI.
 
 	hostPort := fmt.Sprintf("%s:%d", args.ListenHost, args.ListenPort)
 
 	handler := HTTPHandler{
-		Verbose:          args.Verbose,
-		ClientChangeChan: clientChangeChan,
-		ClientChan:       clientChan,
+		Verbose: args.Verbose,
+		Mounts:  args.Mounts,
+		Burst:   args.Burst,
+		Flush:   args.Flush,
+		Lag:     args.Lag,
+		Workers: args.Workers,
+		Native:  native,
+
+		MetadataToken: args.MetadataToken,
 	}
 
 	if args.FCGI {
@@ -121,14 +404,110 @@ func main() {
 	}
 }
 
+// startMount sets up a mount's renditions and starts its encoder supervisor,
+// readers, and segmenters.
+func startMount(args Args, mount *Mount) {
+	// Encoder writes frames to each rendition's ring. Reader reads them from it
+	// by sequence number. The rings live as long as we do. The encoder reuses
+	// them each time it starts.
+	for _, rendition := range mount.Renditions {
+		rendition.Ring = C.as_frame_ring_alloc(ringFrames, ringFrameCapacity)
+		if rendition.Ring == nil {
+			log.Fatalf("Unable to allocate frame ring")
+		}
+
+		// The reader acts as a publisher and clients act as subscribers. One
+		// publisher, potentially many subscribers. Each client reads frames at its
+		// own pace.
+		rendition.Broadcast = NewBroadcast(broadcastFrames)
+		rendition.FramePool = newFramePool(framePoolSlabSize)
+	}
+
+	// Changes in clients announce on this channel.
+	mount.ClientChangeChan = make(chan ClientChange)
+
+	mount.Metadata = NewMetadata()
+	if mount.MetadataFile != "" {
+		go watchMetadataFile(mount.MetadataFile, mount.Metadata)
+	}
+
+	// The ring keeps frame boundaries for us. The reader always reads a single
+	// frame at a time, which is valid for a client to receive. Otherwise if it
+	// read without knowing frame boundaries, it would be difficult for it to
+	// know when it is valid to start sending data to a client that enters
+	// mid-encoding.
+	go encoderSupervisor(mount, args.Verbose, args.Linger, args.Standby)
+
+	for _, rendition := range mount.Renditions {
+		go reader(args.Verbose, rendition)
+	}
+
+	if args.HLSSegmentDuration > 0 {
+		for i, rendition := range mount.Renditions {
+			if rendition.Codec.Format != "mp3" {
+				continue
+			}
+
+			rendition.Segmenter = NewSegmenter(args.HLSSegmentDuration,
+				args.HLSWindow)
+			go runSegmenter(args.Verbose, rendition.Segmenter, rendition, i,
+				mount.ClientChangeChan)
+		}
+	}
+
+	if args.DVRDir != "" {
+		for i, rendition := range mount.Renditions {
+			ring := rendition.Ring
+			dir := filepath.Join(args.DVRDir, filepath.FromSlash(rendition.Path))
+
+			recorder, err := NewRecorder(dir, rendition.BitRate,
+				args.DVRSegmentDuration, args.DVRRetention,
+				func() []byte { return readHeader(ring).Audio },
+				func() uint64 { return uint64(C.as_frame_ring_header_generation(ring)) })
+			if err != nil {
+				log.Fatalf("Unable to start recording %s: %s", rendition.Path, err)
+			}
+
+			rendition.Recorder = recorder
+			go runRecorder(args.Verbose, recorder, rendition, i,
+				mount.ClientChangeChan)
+		}
+	}
+}
+
 // getArgs retrieves and validates command line arguments.
 func getArgs() (Args, error) {
 	listenHost := flag.String("host", "0.0.0.0", "Host to listen on.")
 	listenPort := flag.Int("port", 8080, "Port to listen on.")
 	format := flag.String("format", "pulse", "Input format. pulse for PulseAudio or mp3 for MP3.")
 	input := flag.String("input", "", "Input URL valid for the given format. For MP3 you can give this as a path to a file. For PulseAudio you can give a value such as alsa_output.pci-0000_00_1f.3.analog-stereo.monitor to take input from a monitor. Use 'pactl list sources' to show the available PulseAudio sources.")
+	inputOptions := flag.String("input-options", "", "Options for the input format separated by ':'. For pulse: sample_rate, channels, fragment_size. For any format: probesize, analyzeduration. If you give sample_rate and channels we don't read the input to find out what's in it, so it opens faster. For pulse we default to sample_rate=48000:channels=2 (PulseAudio's own default).")
 	verbose := flag.Bool("verbose", false, "Enable verbose logging output.")
 	fcgi := flag.Bool("fcgi", true, "Serve using FastCGI (true) or as a regular HTTP server.")
+	pipeline := flag.Bool("pipeline", false, "Decode and encode on separate threads. Each rendition gets its own encoding thread. This spreads work across cores and keeps capture going while an encoder is busy.")
+	realtime := flag.Bool("realtime", true, "If the input is a file (a format other than pulse), encode it no faster than real time and loop it forever. We encode it once and loop from memory after that. Not used with -pipeline.")
+	renditionsString := flag.String("renditions", "mp3:96", "Comma separated list of renditions to encode, each given as codec:kbps. Codecs are mp3, opus (Ogg), and webm (Opus in WebM). For example mp3:128,opus:64. We serve each at /audio/<kbps>.<ext>. /audio serves the first. We decode the input once for all of them.")
+	hlsSegmentDuration := flag.Float64("hls-segment-duration", 0, "Also serve MP3 renditions with HLS in segments of about this many seconds at /hls/live.m3u8. 0 to not serve HLS. A proxy in front of us can cache the segments. While on, the renditions are always encoded.")
+	hlsWindow := flag.Int("hls-window", 6, "How many HLS segments to keep and list in the playlist.")
+	linger := flag.Duration("linger", 30*time.Second, "Keep encoding a rendition for this long after its last client leaves so the next client doesn't wait for the encoder to start. Without -standby we stop the encoder once there have been no clients for this long.")
+	standby := flag.Bool("standby", false, "Keep the input open and decoding and the encoders open while there are no clients, encoding nothing. Clients get audio without waiting for the input and encoders to start.")
+	burst := flag.Duration("burst", 5*time.Second, "Send new clients up to this much recent audio as fast as they'll take it so they can start playing right away. 0 to only send audio encoded after they connect.")
+	flushInterval := flag.Duration("flush-interval", 100*time.Millisecond, "Flush audio out to each client at most this often, writing what arrived in between all at once. Fewer flushes take less CPU. 0 to flush every frame as soon as we have it. Clients can ask for that anyway with ?latency=low.")
+	flushBytes := flag.Int("flush-bytes", 4096, "Flush audio out to a client once we have this many bytes for it, even if -flush-interval has not passed. 0 for no limit.")
+	maxLag := flag.Duration("max-lag", 10*time.Second, "If a client falls this far behind, drop what it hasn't read and skip it ahead to live audio. Must be more than -burst. 0 to instead cut it off once the audio it wants is gone.")
+	maxLagSkips := flag.Int("max-lag-skips", 3, "Cut off a client that needs to skip ahead more than this many times in a minute.")
+	opusFrameDuration := flag.Int("opus-frame-duration", 20, "Duration of each Opus frame in milliseconds. One of 5, 10, 20, 40, or 60.")
+	config := flag.String("config", "", "Path to a JSON file listing inputs to serve (mounts). For example {\"mounts\": [{\"name\": \"kitchen\", \"format\": \"pulse\", \"input\": \"...\", \"renditions\": \"mp3:96\"}]}. Each mount takes the keys format, input, input_options, renditions, pipeline, realtime, metadata_file, silence_gate, and silence_threshold, which default to the flags of the same names. We serve a mount at /<name>/audio and so on. If given, we ignore -input.")
+	metadataToken := flag.String("metadata-token", "", "Take POSTs to /metadata from anywhere, but only with the header Authorization: Bearer <token>. Without it we take them only from this machine, so set it if a proxy on this machine forwards clients to us over HTTP, as they'd all look local.")
+	metadataFile := flag.String("metadata-file", "", "Take the title of what's playing from the first line of this file whenever it changes. You can also POST it to /metadata from this machine (see -metadata-token). We send it to clients as ICY metadata and to pages watching /metadata.")
+	silenceGate := flag.Bool("silence-gate", true, "While the input is silent (see -silence-threshold), send MP3 renditions frames of silence we encoded once rather than encoding it. This saves most of the CPU an idle input costs. Set -silence-gate=false to always encode.")
+	silenceThreshold := flag.Float64("silence-threshold", -90, "Treat audio at or below this level in dBFS as silence. It can't be above 0 dBFS, full scale.")
+	dvrDir := flag.String("dvr-dir", "", "Record every rendition to segment files in this directory so clients can listen from a time in the past with ?from=, e.g. /audio?from=-300s, or an RFC 3339 time, or seconds since the epoch. Empty to not record. While on, the renditions are always encoded.")
+	dvrSegmentDuration := flag.Duration("dvr-segment-duration", 5*time.Minute, "How much audio each recording segment file holds.")
+	dvrRetention := flag.Duration("dvr-retention", 24*time.Hour, "Delete recording segments once their newest audio is older than this.")
+	nativePort := flag.Int("native-port", 0, "Also serve audio on this port from a native (C) server: the same paths as /audio, over plain HTTP. It always sends frames as soon as it has them, and answers 400 to any other query (such as from=) rather than serving live audio instead. It doesn't send ICY metadata. Each client costs far less than one we serve from Go, so use this for many listeners. 0 to not.")
+	nativeThreads := flag.Int("native-threads", runtime.NumCPU(), "How many threads serve audio natively. Each has its own listening socket.")
+	workers := flag.Int("workers", runtime.NumCPU(), "How many threads may encode at once across every mount. 0 for no limit.")
 
 	flag.Parse()
 
@@ -142,168 +521,514 @@ func getArgs() (Args, error) {
 		return Args{}, fmt.Errorf("you must provide an input format")
 	}
 
-	if len(*input) == 0 {
+	if len(*input) == 0 && len(*config) == 0 {
 		flag.PrintDefaults()
 		return Args{}, fmt.Errorf("you must provide an input URL")
 	}
 
+	if _, ok := opusFrameDurations[*opusFrameDuration]; !ok {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid opus frame duration: %d",
+			*opusFrameDuration)
+	}
+
+	// What a mount has unless its config says otherwise.
+	defaults := Mount{
+		InputFormat:      *format,
+		InputURL:         *input,
+		InputOptions:     *inputOptions,
+		RenditionsString: *renditionsString,
+		Pipeline:         *pipeline,
+		Realtime:         *realtime,
+		MetadataFile:     *metadataFile,
+		SilenceGate:      *silenceGate,
+		SilenceThreshold: *silenceThreshold,
+	}
+
+	mounts := []*Mount{&defaults}
+	if len(*config) > 0 {
+		var err error
+		mounts, err = readConfig(*config, defaults)
+		if err != nil {
+			return Args{}, err
+		}
+	}
+
+	for _, mount := range mounts {
+		if len(mount.InputFormat) == 0 || len(mount.InputURL) == 0 {
+			return Args{}, fmt.Errorf("mount %q: you must provide an input format and URL",
+				mount.Name)
+		}
+
+		// Written this way to catch NaN too.
+		if !(mount.SilenceThreshold <= 0) {
+			return Args{}, fmt.Errorf(
+				"mount %q: silence threshold must be at most 0 dBFS, not %g",
+				mount.Name, mount.SilenceThreshold)
+		}
+
+		// We know what PulseAudio gives us, so we don't need to probe it.
+		if mount.InputFormat == "pulse" && mount.InputOptions == "" {
+			mount.InputOptions = "sample_rate=48000:channels=2"
+		}
+
+		renditions, err := parseRenditions(mount.RenditionsString, mount.Prefix(),
+			*opusFrameDuration)
+		if err != nil {
+			flag.PrintDefaults()
+			return Args{}, fmt.Errorf("mount %q: %s", mount.Name, err)
+		}
+		mount.Renditions = renditions
+	}
+
+	if *workers < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid workers: %d", *workers)
+	}
+
+	if *burst < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid burst: %s", *burst)
+	}
+
+	if *linger < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid linger: %s", *linger)
+	}
+
+	if *maxLag < 0 || *maxLagSkips < 0 || (*maxLag > 0 && *maxLag <= *burst) {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid max lag or skips")
+	}
+
+	if *flushInterval < 0 || *flushBytes < 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid flush interval or bytes")
+	}
+
+	if *hlsSegmentDuration < 0 || *hlsWindow < 1 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid HLS segment duration or window")
+	}
+
+	if *nativePort < 0 || *nativePort > 65535 || *nativeThreads < 1 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid native port or threads")
+	}
+
+	if *dvrDir != "" && (*dvrSegmentDuration < time.Second ||
+		*dvrRetention < *dvrSegmentDuration) {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid DVR segment duration or retention")
+	}
+
 	return Args{
-		ListenHost:  *listenHost,
-		ListenPort:  *listenPort,
-		InputFormat: *format,
-		InputURL:    *input,
-		Verbose:     *verbose,
-		FCGI:        *fcgi,
+		ListenHost: *listenHost,
+		ListenPort: *listenPort,
+		Verbose:    *verbose,
+		FCGI:       *fcgi,
+		Mounts:     mounts,
+		Workers:    *workers,
+		Linger:     *linger,
+		Standby:    *standby,
+		Burst:      *burst,
+		Flush: FlushPolicy{
+			Interval: *flushInterval,
+			Bytes:    *flushBytes,
+		},
+		Lag: LagPolicy{
+			MaxLag:   *maxLag,
+			MaxSkips: *maxLagSkips,
+		},
+		MetadataToken: *metadataToken,
+
+		HLSSegmentDuration: *hlsSegmentDuration,
+		HLSWindow:          *hlsWindow,
+		DVRDir:             *dvrDir,
+		DVRSegmentDuration: *dvrSegmentDuration,
+		DVRRetention:       *dvrRetention,
+		NativePort:         *nativePort,
+		NativeThreads:      *nativeThreads,
 	}, nil
 }
 
+// readConfig reads mounts from a JSON config file. Anything a mount leaves out
+// it takes from defaults.
+func readConfig(path string, defaults Mount) ([]*Mount, error) {
+	data, err := os.ReadFile(path)
+	if err != nil {
+		return nil, fmt.Errorf("unable to read config: %s", err)
+	}
+
+	var config struct {
+		Mounts []json.RawMessage `json:"mounts"`
+	}
+	if err := json.Unmarshal(data, &config); err != nil {
+		return nil, fmt.Errorf("invalid config: %s", err)
+	}
+
+	if len(config.Mounts) == 0 {
+		return nil, fmt.Errorf("config has no mounts")
+	}
+
+	mounts := []*Mount{}
+	names := map[string]struct{}{}
+
+	for _, raw := range config.Mounts {
+		mount := defaults
+		if err := json.Unmarshal(raw, &mount); err != nil {
+			return nil, fmt.Errorf("invalid mount: %s", err)
+		}
+
+		if mount.Name != "" {
+			if !mountNameRE.MatchString(mount.Name) {
+				return nil, fmt.Errorf("invalid mount name: %q", mount.Name)
+			}
+			if _, ok := reservedMountNames[mount.Name]; ok {
+				return nil, fmt.Errorf("mount name is reserved: %q", mount.Name)
+			}
+		}
+
+		if _, exists := names[mount.Name]; exists {
+			return nil, fmt.Errorf("duplicate mount: %q", mount.Name)
+		}
+		names[mount.Name] = struct{}{}
+
+		mounts = append(mounts, &mount)
+	}
+
+	return mounts, nil
+}
+
+// parseRenditions parses a comma separated list of codec:kbps. We serve them
+// under prefix.
+func parseRenditions(s, prefix string,
+	opusFrameDuration int) ([]*Rendition, error) {
+	renditions := []*Rendition{}
+	paths := map[string]struct{}{}
+
+	for _, spec := range strings.Split(s, ",") {
+		pieces := strings.Split(strings.TrimSpace(spec), ":")
+		if len(pieces) != 2 {
+			return nil, fmt.Errorf("invalid rendition: %s", spec)
+		}
+
+		codec, ok := codecs[pieces[0]]
+		if !ok {
+			return nil, fmt.Errorf("unknown codec: %s", pieces[0])
+		}
+
+		bitRate, err := strconv.Atoi(pieces[1])
+		if err != nil || bitRate <= 0 {
+			return nil, fmt.Errorf("invalid bit rate: %s", pieces[1])
+		}
+
+		path := fmt.Sprintf("%s/audio/%d.%s", prefix, bitRate, codec.Extension)
+		if _, exists := paths[path]; exists {
+			return nil, fmt.Errorf("duplicate rendition: %s", spec)
+		}
+		paths[path] = struct{}{}
+
+		encoderOptions := ""
+		if codec.Encoder == "libopus" {
+			encoderOptions = fmt.Sprintf("frame_duration=%d", opusFrameDuration)
+		}
+
+		renditions = append(renditions, &Rendition{
+			Codec:          codec,
+			BitRate:        bitRate,
+			Path:           path,
+			EncoderOptions: encoderOptions,
+		})
+	}
+
+	return renditions, nil
+}
+
 // The encoder supervisor deals with stopping and starting the encoder.
 //
 // We want there to be at most a single encoder goroutine active at any one
 // time no matter how many clients there are. If there are zero clients, there
 // should not be any encoding going on.
-func encoderSupervisor(outPipe *os.File, inputFormat, inputURL string,
-	verbose bool, clientChangeChan <-chan int, frameChan chan<- int) {
-	// A count of how many clients are actively subscribed listening for audio.
-	// We start the encoder when this goes above zero, and stop it if it goes to
-	// zero.
+//
+// The encoder encodes each rendition only while the rendition has clients.
+//
+// Starting is slow though. Opening the input (and probing it), and setting up
+// the encoders, can take hundreds of milliseconds before a new client hears
+// anything. So we keep encoding a rendition for linger after its last client
+// leaves, in case another comes along. With standby we never stop the encoder.
+// It keeps reading and decoding the input with every rendition inactive, which
+// costs little, and a rendition starts encoding again as soon as it gets a
+// client.
+func encoderSupervisor(mount *Mount, verbose bool, linger time.Duration,
+	standby bool) {
+	renditions := mount.Renditions
+	clientChangeChan := mount.ClientChangeChan
+
+	// A count of how many clients are actively subscribed listening for audio,
+	// in total and to each rendition. We start the encoder when the total goes
+	// above zero, and stop it once it's been zero for linger.
 	clients := 0
+	renditionClients := make([]int, len(renditions))
+
+	// When each rendition lost its last client. Zero if it has clients or we
+	// stopped encoding it already. Likewise for the encoder as a whole.
+	renditionIdleSince := make([]time.Time, len(renditions))
+	var idleSince time.Time
 
 	// We close this channel to tell the encoder to stop. It receives no values.
 	var encoderStopChan chan struct{}
 
+	// Whether an encoder goroutine exists, and whether we told it to stop. We
+	// don't start another until it tells us it stopped.
+	running := false
+	stopping := false
+
 	// The encoder tells us when it stops by sending a message on this channel.
 	// Note I use sending a message as if this channel closes then the below loop
 	// will be busy until it is re-opened.
 	encoderDoneChan := make(chan struct{})
 
-	for {
-		select {
-		// A change in the number of clients.
-		case change := <-clientChangeChan:
-			// Gaining a client.
-			if change == 1 {
-				clients++
+	// Fires when something has lingered long enough.
+	var lingerTimer *time.Timer
+	var lingerChan <-chan time.Time
 
-				if verbose {
-					log.Printf("encoder supervisor: new client. %d clients connected",
-						clients)
-				}
+	startEncoder := func() {
+		if verbose {
+			log.Printf("encoder supervisor: starting encoder for mount %q",
+				mount.Name)
+		}
 
-				if clients == 1 {
-					if verbose {
-						log.Printf("encoder supervisor: starting encoder")
-					}
+		encoderStopChan = make(chan struct{})
+		running = true
+		stopping = false
 
-					encoderStopChan = make(chan struct{})
+		go encoder(mount, encoderStopChan, encoderDoneChan)
+	}
 
-					go encoder(outPipe, inputFormat, inputURL, encoderStopChan,
-						encoderDoneChan, frameChan)
-				}
+	if standby {
+		startEncoder()
+	}
 
-				continue
+	for {
+		select {
+		// A change in the number of clients.
+		case change := <-clientChangeChan:
+			rendition := renditions[change.Rendition]
+			renditionClients[change.Rendition] += change.Change
+			clients += change.Change
+
+			if renditionClients[change.Rendition] > 0 {
+				atomic.StoreInt32(&rendition.Active, 1)
+				renditionIdleSince[change.Rendition] = time.Time{}
+			} else {
+				renditionIdleSince[change.Rendition] = time.Now()
 			}
 
-			// Losing a client.
-			clients--
-
 			if verbose {
-				log.Printf("encoder supervisor: lost client. %d clients connected",
-					clients)
+				verb := "new"
+				if change.Change < 0 {
+					verb = "lost"
+				}
+				log.Printf("encoder supervisor: %s client for %s. %d clients connected",
+					verb, rendition.Path, clients)
 			}
 
-			if clients == 0 {
-				// Tell encoder to stop.
-				close(encoderStopChan)
-				if verbose {
-					log.Printf("encoder supervisor: stopping encoder")
+			if clients > 0 {
+				idleSince = time.Time{}
+				if !running {
+					startEncoder()
 				}
-				continue
+			} else {
+				idleSince = time.Now()
 			}
 
 		// Encoder stopped for some reason. Restart it if appropriate.
 		case <-encoderDoneChan:
 			if verbose {
-				log.Printf("encoder supervisor: encoder stopped")
+				log.Printf("encoder supervisor: encoder for mount %q stopped",
+					mount.Name)
 			}
 
-			if clients == 0 {
-				// No clients. We don't need to restart it.
-				continue
+			running = false
+
+			if clients > 0 || standby {
+				startEncoder()
 			}
 
-			if verbose {
-				log.Printf("encoder supervisor: starting encoder")
+		case <-lingerChan:
+		}
+
+		// Stop what lingered long enough, and work out when to look again.
+		now := time.Now()
+		var next time.Time
+
+		expired := func(since time.Time) bool {
+			deadline := since.Add(linger)
+			if now.Before(deadline) {
+				if next.IsZero() || deadline.Before(next) {
+					next = deadline
+				}
+				return false
+			}
+			return true
+		}
+
+		for i, rendition := range renditions {
+			if !renditionIdleSince[i].IsZero() && expired(renditionIdleSince[i]) {
+				atomic.StoreInt32(&rendition.Active, 0)
+				renditionIdleSince[i] = time.Time{}
 			}
+		}
 
-			encoderStopChan = make(chan struct{})
+		if !standby && running && !stopping && !idleSince.IsZero() &&
+			expired(idleSince) {
+			// Tell encoder to stop.
+			close(encoderStopChan)
+			stopping = true
+			idleSince = time.Time{}
+			if verbose {
+				log.Printf("encoder supervisor: stopping encoder for mount %q",
+					mount.Name)
+			}
+		}
 
-			go encoder(outPipe, inputFormat, inputURL, encoderStopChan,
-				encoderDoneChan, frameChan)
+		if lingerTimer != nil {
+			lingerTimer.Stop()
+		}
+		lingerTimer, lingerChan = nil, nil
+		if !next.IsZero() {
+			lingerTimer = time.NewTimer(next.Sub(now))
+			lingerChan = lingerTimer.C
 		}
 	}
 }
 
 // encoder opens an audio input and begins decoding. It re-encodes the audio
-// out and writes it to a pipe. It informs the reader goroutine how large each
-// audio frame it writes is.
-func encoder(outPipe *os.File, inputFormat, inputURL string,
-	stopChan <-chan struct{}, doneChan chan<- struct{}, frameChan chan<- int) {
+// out to each active rendition and writes each frame to the rendition's ring.
+//
+// If the mount has Pipeline set, the library decodes and encodes on its own
+// threads and we only supervise.
+//
+// If it has Realtime set and the input is a file, the library paces encoding
+// to real time and loops the file.
+func encoder(mount *Mount, stopChan <-chan struct{},
+	doneChan chan<- struct{}) {
+	renditions := mount.Renditions
+	inputFormat := mount.InputFormat
+
+	// We measure how long it takes to open everything.
+	start := time.Now()
+
 	inputFormatC := C.CString(inputFormat)
-	inputURLC := C.CString(inputURL)
+	inputURLC := C.CString(mount.InputURL)
+	inputOptionsC := C.CString(mount.InputOptions)
 	verbose := C.bool(false)
 
-	input := C.as_open_input(inputFormatC, inputURLC, verbose)
+	input := C.as_open_input(inputFormatC, inputURLC, inputOptionsC, verbose)
+	C.free(unsafe.Pointer(inputFormatC))
+	C.free(unsafe.Pointer(inputURLC))
+	C.free(unsafe.Pointer(inputOptionsC))
 	if input == nil {
-		log.Printf("Unable to open input")
-		C.free(unsafe.Pointer(inputFormatC))
-		C.free(unsafe.Pointer(inputURLC))
+		log.Printf("Unable to open input for mount %q", mount.Name)
 		doneChan <- struct{}{}
 		return
 	}
-	C.free(unsafe.Pointer(inputFormatC))
-	C.free(unsafe.Pointer(inputURLC))
 
-	outputFormat := C.CString("mp3")
-	outputURL := C.CString(fmt.Sprintf("pipe:%d", outPipe.Fd()))
-	outputEncoder := C.CString("libmp3lame")
+	inputOpenTime := time.Duration(input.open_ns)
 
-	output := C.as_open_output(input, outputFormat, outputURL, outputEncoder)
-	if output == nil {
-		log.Printf("Unable to open output")
-		C.as_destroy_input(input)
+	outputs := make([]*C.struct_Output, len(renditions))
+
+	for i, rendition := range renditions {
+		outputFormat := C.CString(rendition.Codec.Format)
+		outputEncoder := C.CString(rendition.Codec.Encoder)
+		encoderOptions := C.CString(rendition.EncoderOptions)
+
+		outputs[i] = C.as_open_output(input, outputFormat, nil, outputEncoder,
+			encoderOptions, C.int(rendition.BitRate*1000), rendition.Ring)
 		C.free(unsafe.Pointer(outputFormat))
-		C.free(unsafe.Pointer(outputURL))
 		C.free(unsafe.Pointer(outputEncoder))
-		doneChan <- struct{}{}
-		return
+		C.free(unsafe.Pointer(encoderOptions))
+
+		if outputs[i] == nil {
+			log.Printf("Unable to open output for %s", rendition.Path)
+			for j := 0; j < i; j++ {
+				C.as_destroy_output(outputs[j])
+			}
+			C.as_destroy_input(input)
+			doneChan <- struct{}{}
+			return
+		}
 	}
-	C.free(unsafe.Pointer(outputFormat))
-	C.free(unsafe.Pointer(outputURL))
-	C.free(unsafe.Pointer(outputEncoder))
 
-	audiostreamer := C.as_init_audiostreamer(input, output)
+	audiostreamer := C.as_init_audiostreamer(input, &outputs[0],
+		C.size_t(len(outputs)))
 	if audiostreamer == nil {
 		log.Printf("Unable to initialize audiostreamer")
-		C.as_destroy_output(output)
+		for _, output := range outputs {
+			C.as_destroy_output(output)
+		}
 		C.as_destroy_input(input)
 		doneChan <- struct{}{}
 		return
 	}
 	defer C.as_destroy_audiostreamer(audiostreamer)
 
+	startTime := time.Since(start)
+	log.Printf("Encoder for mount %q started in %s (opening input took %s)",
+		mount.Name, startTime, inputOpenTime)
+	for _, rendition := range renditions {
+		rendition.Metrics.recordEncoderStart(startTime, inputOpenTime)
+	}
+
+	// Which renditions we're encoding. All outputs start active.
+	active := make([]int32, len(renditions))
+	for i := range active {
+		active[i] = 1
+	}
+
+	// A live input such as PulseAudio paces us already.
+	if mount.Realtime && inputFormat != "pulse" {
+		C.as_set_realtime(audiostreamer, true)
+	}
+
+	if mount.SilenceGate {
+		threshold := math.Pow(10, mount.SilenceThreshold/20)
+		if !C.as_set_silence_gate(audiostreamer, C.double(threshold)) {
+			log.Printf("Unable to set up silence gate for mount %q, we'll encode silence",
+				mount.Name)
+		}
+	}
+
+	// The library's CPU counters start over each time. We add what they gained
+	// to the mount's.
+	var usage mountUsage
+	defer updateStats(audiostreamer, mount, &usage)
+
+	if mount.Pipeline {
+		runPipeline(audiostreamer, mount, active, stopChan, &usage)
+		doneChan <- struct{}{}
+		return
+	}
+
+	frames := make([]C.struct_FrameInfo, encodeBatchFrames)
+
 	for {
 		select {
 		// If stop channel is closed then we stop what we're doing.
 		case <-stopChan:
-			log.Printf("Stopping encoder")
+			log.Printf("Stopping encoder (%d frames written, %d allocations)",
+				audiostreamer.frames_written, audiostreamer.allocations)
 			doneChan <- struct{}{}
 			return
 		default:
 		}
 
-		frameSize := C.int(0)
-		res := C.as_read_write(audiostreamer, &frameSize)
+		updateActiveRenditions(audiostreamer, renditions, active)
+
+		nbFrames := C.int(0)
+		res := C.as_read_write_n(audiostreamer, &frames[0], C.int(len(frames)),
+			encodeBatchTimeoutMS, &nbFrames)
 		if res == -1 {
 			log.Printf("Failure decoding/encoding")
 			doneChan <- struct{}{}
@@ -317,113 +1042,186 @@ func encoder(outPipe *os.File, inputFormat, inputURL string,
 			return
 		}
 
-		// We did some work.
+		// We did some work. Any frames we wrote are in the rings.
 
-		if frameSize > 0 {
-			frameChan <- int(frameSize)
-		}
+		updateStats(audiostreamer, mount, &usage)
 	}
 }
 
-// reader reads the pipe containing the re-encoded audio.
-//
-// We send the audio to each client.
-//
-// We hear about new clients on the clients channel.
-//
-// We expect the pipe to never close. The encoder may stop sending for a while
-// but when a new client appears, it starts again.
-func reader(verbose bool, inPipe *os.File, clientChan <-chan Client,
-	frameChan <-chan int) {
-	reader := bufio.NewReader(inPipe)
-	clients := []Client{}
+// runPipeline starts the library decoding and encoding on its own threads and
+// waits until it finishes or we're told to stop.
+func runPipeline(audiostreamer *C.struct_Audiostreamer, mount *Mount,
+	active []int32, stopChan <-chan struct{}, usage *mountUsage) {
+	renditions := mount.Renditions
 
-	for {
-		select {
-		case client := <-clientChan:
-			if verbose {
-				log.Printf("reader: accepted new client")
-			}
+	// When capturing live audio we'd rather drop samples for a rendition whose
+	// encoder falls behind than stall capture. For a file we want everything.
+	dropWhenFull := mount.InputFormat == "pulse"
+
+	if !C.as_pipeline_start(audiostreamer, pipelineBlocks,
+		C.bool(dropWhenFull)) {
+		log.Printf("Unable to start pipeline")
+		return
+	}
 
-			clients = append(clients, client)
+	ticker := time.NewTicker(100 * time.Millisecond)
+	defer ticker.Stop()
 
-		case frameSize := <-frameChan:
-			if verbose {
-				//log.Printf("reader: reading new audio frame (%d bytes)", frameSize)
-			}
+	for {
+		select {
+		case <-stopChan:
+			C.as_pipeline_stop(audiostreamer)
+			log.Printf("Stopping encoder (%d frames written, %d allocations)",
+				audiostreamer.frames_written, audiostreamer.allocations)
+			return
+		case <-ticker.C:
+		}
 
-			frame, err := readFrame(reader, frameSize)
-			if err != nil {
-				log.Printf("reader: %s", err)
-				return
-			}
+		updateActiveRenditions(audiostreamer, renditions, active)
+		updateStats(audiostreamer, mount, usage)
 
-			if verbose {
-				//log.Printf("reader: read audio frame (%d bytes)", frameSize)
-			}
+		status := C.as_pipeline_status(audiostreamer)
+		if status == -1 {
+			log.Printf("Failure decoding/encoding")
+			return
+		}
 
-			clients = sendFrameToClients(clients, frame)
+		// EOF.
+		if status == 0 {
+			return
 		}
 	}
 }
 
-// Read an audio frame.
-func readFrame(reader *bufio.Reader, size int) (Frame, error) {
-	buf := []byte{}
-	bytesNeeded := size
-
-	for {
-		if bytesNeeded == 0 {
-			return Frame{Audio: buf}, nil
+// updateActiveRenditions starts or stops encoding renditions depending on
+// whether they have clients. active holds what we last told the library.
+func updateActiveRenditions(audiostreamer *C.struct_Audiostreamer,
+	renditions []*Rendition, active []int32) {
+	for i, rendition := range renditions {
+		wantActive := atomic.LoadInt32(&rendition.Active)
+		if wantActive != active[i] {
+			C.as_set_output_active(audiostreamer, C.size_t(i), wantActive == 1)
+			active[i] = wantActive
 		}
+	}
+}
 
-		readBuf := make([]byte, bytesNeeded)
+// mountUsage is how much of the library's CPU counters for a run of the
+// encoder we've added to the mount's already.
+type mountUsage struct {
+	cpuNS        uint64
+	workerWaitNS uint64
+}
 
-		n, err := reader.Read(readBuf)
-		if err != nil {
-			return Frame{}, fmt.Errorf("read: %s", err)
+// updateStats takes the library's counters and timings for each rendition so
+// we can report them at /metrics. We add CPU time used since the last call to
+// the mount's.
+func updateStats(audiostreamer *C.struct_Audiostreamer, mount *Mount,
+	usage *mountUsage) {
+	for i, rendition := range mount.Renditions {
+		var stats C.struct_Stats
+		if !C.as_get_stats(audiostreamer, C.size_t(i), &stats) {
+			continue
 		}
 
-		buf = append(buf, readBuf[0:n]...)
+		rendition.Metrics.mutex.Lock()
+		rendition.Metrics.stats = stats
+		rendition.Metrics.mutex.Unlock()
 
-		bytesNeeded -= n
+		// These are the same for every rendition.
+		if i == 0 {
+			cpuNS, workerWaitNS := uint64(stats.cpu_ns), uint64(stats.worker_wait_ns)
+			atomic.AddUint64(&mount.cpuNS, cpuNS-usage.cpuNS)
+			atomic.AddUint64(&mount.workerWaitNS, workerWaitNS-usage.workerWaitNS)
+			usage.cpuNS, usage.workerWaitNS = cpuNS, workerWaitNS
+		}
 	}
 }
 
-// Try to send the given block of audio to each client.
+// reader reads the re-encoded audio from the ring and publishes it for clients
+// to read.
 //
-// If sending would block, cut the client off.
-func sendFrameToClients(clients []Client, frame Frame) []Client {
-	clients2 := []Client{}
+// The ring lives forever. The encoder may stop adding frames for a while but
+// when a new client appears, it starts again.
+func reader(verbose bool, rendition *Rendition) {
+	ring := rendition.Ring
 
-	for _, client := range clients {
-		err := sendFrameToClient(client, frame)
+	// The sequence number of the next frame we want.
+	seq := uint64(C.as_frame_ring_next_seq(ring))
+
+	for {
+		// Wait a short time at most so that a blocked call into C doesn't hold on
+		// to a thread for long.
+		if !C.as_frame_ring_wait(ring, C.uint64_t(seq), 100) {
+			continue
+		}
+
+		frame, err := readFrame(ring, seq, rendition.FramePool)
 		if err != nil {
+			// We fell so far behind the encoder that it overwrote the frame. Skip
+			// ahead to the newest frames.
+			next := uint64(C.as_frame_ring_next_seq(ring))
+			log.Printf("reader: %s, skipping %d frames", err, next-seq)
+			seq = next
 			continue
 		}
+		seq++
+
+		frame.read = monoNow()
+		rendition.Metrics.latency.observe(latencyEncode, frame.captured,
+			frame.encoded)
+		rendition.Metrics.latency.observe(latencyRing, frame.encoded, frame.read)
 
-		// Keep it around.
-		clients2 = append(clients2, client)
+		rendition.Broadcast.Publish(frame)
 	}
+}
 
-	return clients2
+// readHeader reads the stream header from the ring. Each client gets it
+// first.
+func readHeader(ring *C.struct_FrameRing) Frame {
+	buf := make([]byte, ringFrameCapacity)
+	sz := C.as_frame_ring_read_header(ring, (*C.uint8_t)(&buf[0]),
+		C.size_t(len(buf)))
+	return Frame{Audio: buf[:sz], Header: true}
 }
 
-// Send a frame to a client. Don't block. If we would block, return an error.
-// This lets us know if we should consider the client dead.
+// Read the audio frame with the given sequence number from the ring.
 //
-// Close the client's audio channel if we fail to send so it knows to go away.
-func sendFrameToClient(client Client, frame Frame) error {
-	select {
-	case client.Audio <- frame:
-		return nil
-	case <-client.Done:
-		close(client.Audio)
-		return fmt.Errorf("client went away")
-	default:
-		close(client.Audio)
-		return fmt.Errorf("client is too slow")
+// We read it straight into memory from the pool, so this doesn't allocate
+// unless the pool needs another slab. The frame holds a reference to the slab
+// which the Broadcast takes over.
+func readFrame(ring *C.struct_FrameRing, seq uint64, pool *framePool) (Frame,
+	error) {
+	buf := pool.buffer(ringFrameCapacity)
+	size := C.size_t(0)
+	pts := C.int64_t(0)
+	encoded := C.int64_t(0)
+	captured := C.int64_t(0)
+
+	res := C.as_frame_ring_read(ring, C.uint64_t(seq), (*C.uint8_t)(&buf[0]),
+		C.size_t(len(buf)), &size, &pts, &encoded, &captured)
+	if res != 1 {
+		return Frame{}, fmt.Errorf("frame %d is not in the ring", seq)
 	}
+
+	frame := pool.commit(int(size))
+	frame.captured = int64(captured)
+	frame.encoded = int64(encoded)
+	frame.pts = int64(pts)
+	return frame, nil
+}
+
+// The library timestamps frames with CLOCK_MONOTONIC. Go's clock reads the
+// same one on Linux but doesn't tell us its value, so we line the two up once.
+var (
+	monoBase   = time.Now()
+	monoBaseNS = int64(C.as_monotonic_ns())
+)
+
+// monoNow returns the time in the library's terms (CLOCK_MONOTONIC
+// nanoseconds) without calling into C.
+func monoNow() int64 {
+	return monoBaseNS + int64(time.Since(monoBase))
 }
 
 // ServeHTTP handles an HTTP request.
@@ -431,9 +1229,47 @@ func (h HTTPHandler) ServeHTTP(rw http.ResponseWriter, r *http.Request) {
 	log.Printf("Serving [%s] request from [%s] to path [%s] (%d bytes)",
 		r.Method, r.RemoteAddr, r.URL.Path, r.ContentLength)
 
-	if r.Method == "GET" && r.URL.Path == "/audio" {
-		h.audioRequest(rw, r)
-		return
+	if r.Method == "POST" {
+		for _, mount := range h.Mounts {
+			if r.URL.Path == mount.Prefix()+"/metadata" {
+				h.metadataRequest(rw, r, mount)
+				return
+			}
+		}
+	}
+
+	if r.Method == "GET" {
+		if r.URL.Path == "/metrics" {
+			h.metricsRequest(rw)
+			return
+		}
+
+		for _, mount := range h.Mounts {
+			prefix := mount.Prefix()
+
+			if r.URL.Path == prefix+"/metadata" {
+				h.metadataRequest(rw, r, mount)
+				return
+			}
+
+			if strings.HasPrefix(r.URL.Path, prefix+"/hls/") {
+				h.hlsRequest(rw, r, mount)
+				return
+			}
+
+			// /audio is the first rendition.
+			if r.URL.Path == prefix+"/audio" {
+				h.audioRequest(rw, r, mount, 0)
+				return
+			}
+
+			for i, rendition := range mount.Renditions {
+				if r.URL.Path == rendition.Path {
+					h.audioRequest(rw, r, mount, i)
+					return
+				}
+			}
+		}
 	}
 
 	log.Printf("Unknown request.")
@@ -441,65 +1277,478 @@ func (h HTTPHandler) ServeHTTP(rw http.ResponseWriter, r *http.Request) {
 	_, _ = rw.Write([]byte("<h1>404 Not found</h1>"))
 }
 
-func (h HTTPHandler) audioRequest(rw http.ResponseWriter, r *http.Request) {
-	c := Client{
-		// We receive audio data on this channel from the reader.
-		Audio: make(chan Frame, 1024),
+func (h HTTPHandler) audioRequest(rw http.ResponseWriter, r *http.Request,
+	mount *Mount, renditionIndex int) {
+	rendition := mount.Renditions[renditionIndex]
+
+	// Clients can listen from the recording instead.
+	if from := r.URL.Query().Get("from"); from != "" {
+		t, err := parseFrom(from)
+		if err != nil || rendition.Recorder == nil {
+			rw.WriteHeader(http.StatusBadRequest)
+			_, _ = rw.Write([]byte("<h1>400 Bad request</h1>"))
+			return
+		}
 
-		// We close this channel to indicate to reader we're done. This is necessary
-		// if we terminate, otherwise the reader can't know to stop sending us audio.
-		Done: make(chan struct{}),
+		h.recordingRequest(rw, r, mount, rendition, t)
+		return
 	}
 
-	// Tell the reader we're here.
-	h.ClientChan <- c
+	// We measure how long until the client gets its first byte and its first
+	// audio.
+	start := time.Now()
+	wroteByte := false
+	wroteAudio := false
+
+	// We read frames published after we subscribe, and up to h.Burst of recent
+	// ones. We write those out as fast as the client takes them so a browser can
+	// fill its buffer and start playing right away.
+	subscriber := rendition.Broadcast.Subscribe(r.RemoteAddr, h.Burst, h.Lag)
+	subscribed := monoNow()
 
 	// Tell the encoder we're here.
-	h.ClientChangeChan <- 1
+	mount.ClientChangeChan <- ClientChange{Rendition: renditionIndex, Change: 1}
 
-	rw.Header().Set("Content-Type", "audio/mpeg")
+	rw.Header().Set("Content-Type", rendition.Codec.ContentType)
 	rw.Header().Set("Cache-Control", "no-cache, no-store, must-revalidate")
 
+	// MP3 clients may ask for what's playing in the stream. We write the audio
+	// through out.
+	var out io.Writer = rw
+	if r.Header.Get("Icy-MetaData") == "1" && rendition.Codec.Format == "mp3" {
+		rw.Header().Set("icy-metaint", strconv.Itoa(icyMetaInt))
+		out = newICYWriter(rw, mount.Metadata)
+	}
+
 	// We send chunked by default
 
-	for {
-		frame, ok := <-c.Audio
+	// Clients that want audio as soon as possible can ask us to flush each frame
+	// as we get it.
+	policy := h.Flush
+	if r.URL.Query().Get("latency") == "low" {
+		policy = FlushPolicy{}
+	}
 
-		// Reader may have cut us off.
-		if !ok {
-			log.Printf("reader closed audio channel")
-			break
-		}
+	// Bytes written since we last flushed, and when that was.
+	pending := 0
+	var lastFlush time.Time
+
+	// When we wrote each frame we have not flushed yet, for latency.
+	var unflushed []int64
 
-		n, err := rw.Write(frame.Audio)
+	// Write a frame to the client. Returns false if we can't.
+	//
+	// ResponseWriter buffers what we write. We flush it out in flush().
+	write := func(frame Frame) bool {
+		n, err := out.Write(frame.Audio)
 		if err != nil {
 			log.Printf("write: %s", err)
-			break
+			return false
 		}
 
 		if n != len(frame.Audio) {
 			log.Printf("short write")
-			break
+			return false
 		}
 
-		// ResponseWriter buffers chunks. Flush them out asap to reduce time client
-		// waits.
+		pending += n
+		atomic.AddUint64(&rendition.Metrics.writes, 1)
+
+		if !wroteByte || (!wroteAudio && !frame.Header) {
+			rendition.Metrics.recordFirstWrite(time.Since(start), !wroteByte,
+				!frame.Header)
+			if h.Verbose && !frame.Header {
+				log.Printf("%s: first audio after %s", r.RemoteAddr,
+					time.Since(start))
+			}
+			wroteByte = true
+			wroteAudio = wroteAudio || !frame.Header
+		}
+
+		return true
+	}
+
+	flush := func() {
 		if flusher, ok := rw.(http.Flusher); ok {
 			flusher.Flush()
 		}
+		atomic.AddUint64(&rendition.Metrics.flushes, 1)
+		pending = 0
+		lastFlush = time.Now()
 
-		if h.Verbose {
-			//log.Printf("%s: Sent %d bytes to client", r.RemoteAddr, n)
+		flushed := monoNow()
+		for _, written := range unflushed {
+			rendition.Metrics.latency.observe(latencyFlush, written, flushed)
 		}
+		unflushed = unflushed[:0]
 	}
 
-	h.ClientChangeChan <- -1
+	// While we hold unflushed audio we wait for the next frame only until it's
+	// time to flush.
+	timer := time.NewTimer(time.Hour)
+	timer.Stop()
+	defer timer.Stop()
 
-	close(c.Done)
+	for {
+		var timeout <-chan time.Time
+		if pending > 0 {
+			timer.Reset(time.Until(lastFlush.Add(policy.Interval)))
+			timeout = timer.C
+		}
 
-	// Drain audio channel.
-	for range c.Audio {
+		frame, err := subscriber.Next(r.Context().Done(), timeout)
+		if timeout != nil && err != errTimeout && !timer.Stop() {
+			<-timer.C
+		}
+		if err == errTimeout {
+			flush()
+			continue
+		}
+		if err != nil {
+			log.Printf("%s: %s", r.RemoteAddr, err)
+			break
+		}
+
+		// The client starts with the stream header. We read it once we have a
+		// frame, as if the encoder was not running it may not have written it
+		// yet.
+		if !wroteByte {
+			if header := readHeader(rendition.Ring); len(header.Audio) > 0 &&
+				!write(header) {
+				frame.Release()
+				break
+			}
+		}
+
+		taken := monoNow()
+		ok := write(frame)
+		frame.Release()
+		if !ok {
+			break
+		}
+
+		// Frames from the burst were waiting before the client came. We only
+		// trace ones published since.
+		if frame.read >= subscribed {
+			written := monoNow()
+			latency := &rendition.Metrics.latency
+			latency.observe(latencyQueue, frame.read, taken)
+			latency.observe(latencyWrite, taken, written)
+			latency.observe(latencyEndToEnd, frame.captured, written)
+			unflushed = append(unflushed, written)
+		}
+
+		// Flush once we've caught up if it's been long enough. If we have a lot
+		// to send, flush anyway.
+		if (!subscriber.Ready() && time.Since(lastFlush) >= policy.Interval) ||
+			(policy.Bytes > 0 && pending >= policy.Bytes) {
+			flush()
+		}
 	}
 
+	subscriber.Close()
+
+	mount.ClientChangeChan <- ClientChange{Rendition: renditionIndex, Change: -1}
+
 	log.Printf("%s: Client cleaned up", r.RemoteAddr)
 }
+
+// recordFirstWrite records how long a client waited for its first byte and/or
+// its first audio.
+func (m *RenditionMetrics) recordFirstWrite(d time.Duration, firstByte,
+	firstAudio bool) {
+	m.mutex.Lock()
+	defer m.mutex.Unlock()
+
+	if firstByte {
+		m.firstByte += d
+		m.firstByteCount++
+	}
+
+	if firstAudio {
+		m.firstAudio += d
+		m.firstAudioCount++
+	}
+}
+
+// recordEncoderStart records how long the encoder took to start, and how much
+// of that was opening the input.
+func (m *RenditionMetrics) recordEncoderStart(d, inputOpen time.Duration) {
+	m.mutex.Lock()
+	defer m.mutex.Unlock()
+
+	m.encoderStart += d
+	m.inputOpen += inputOpen
+	m.encoderStartCount++
+}
+
+// metricsRequest reports counters and timings in the Prometheus text format.
+//
+// The library's are as of the encoder's last batch of work and start over each
+// time the encoder starts. Stage seconds divided by seconds of audio written
+// tells how much of real time each stage takes. If the total approaches 1, the
+// encoder can't keep up.
+func (h HTTPHandler) metricsRequest(rw http.ResponseWriter) {
+	families := newMetricFamilies()
+	families.declare("audiostreamer_stage_calls_total", "counter")
+	families.declare("audiostreamer_stage_seconds_total", "counter")
+	families.declare("audiostreamer_fifo_high_water_samples", "gauge")
+	families.declare("audiostreamer_frames_written_total", "counter")
+	families.declare("audiostreamer_bytes_out_total", "counter")
+	families.declare("audiostreamer_audio_seconds_total", "counter")
+	families.declare("audiostreamer_errors_total", "counter")
+	families.declare("audiostreamer_clients", "gauge")
+	families.declare("audiostreamer_clients_too_slow_total", "counter")
+	families.declare("audiostreamer_client_queue_depth", "gauge")
+	families.declare("audiostreamer_client_lag_seconds", "gauge")
+	families.declare("audiostreamer_client_skips_total", "counter")
+	families.declare("audiostreamer_skips_total", "counter")
+	families.declare("audiostreamer_latency_seconds", "histogram")
+	families.declare("audiostreamer_frames_skipped_total", "counter")
+	families.declare("audiostreamer_client_writes_total", "counter")
+	families.declare("audiostreamer_client_flushes_total", "counter")
+	families.declare("audiostreamer_time_to_first_byte_seconds", "summary")
+	families.declare("audiostreamer_time_to_first_audio_seconds", "summary")
+	families.declare("audiostreamer_encoder_start_seconds", "summary")
+	families.declare("audiostreamer_input_open_seconds", "summary")
+	families.declare("audiostreamer_frames_published_total", "counter")
+	families.declare("audiostreamer_frame_pool_slabs_total", "counter")
+	families.declare("audiostreamer_frame_pool_bytes_total", "counter")
+	families.declare("audiostreamer_go_mallocs_total", "counter")
+	families.declare("audiostreamer_go_alloc_bytes_total", "counter")
+	families.declare("audiostreamer_workers", "gauge")
+	families.declare("audiostreamer_mount_cpu_seconds_total", "counter")
+	families.declare("audiostreamer_mount_worker_wait_seconds_total", "counter")
+	families.declare("audiostreamer_metadata_updates_total", "counter")
+	families.declare("audiostreamer_silent_frames_total", "counter")
+	families.declare("audiostreamer_silence_saved_seconds_total", "counter")
+	families.declare("audiostreamer_dvr_segments", "gauge")
+	families.declare("audiostreamer_dvr_bytes", "gauge")
+	families.declare("audiostreamer_dvr_span_seconds", "gauge")
+	families.declare("audiostreamer_native_clients", "gauge")
+	families.declare("audiostreamer_native_clients_total", "counter")
+	families.declare("audiostreamer_native_clients_too_slow_total", "counter")
+	families.declare("audiostreamer_native_bytes_out_total", "counter")
+	families.declare("audiostreamer_native_writes_total", "counter")
+
+	// Allocations across the whole process. Divide their rate by the rate of
+	// frames published to get allocations and bytes per frame.
+	var memStats runtime.MemStats
+	runtime.ReadMemStats(&memStats)
+	families.add("audiostreamer_go_mallocs_total %d\n", memStats.Mallocs)
+	families.add("audiostreamer_go_alloc_bytes_total %d\n",
+		memStats.TotalAlloc)
+
+	families.add("audiostreamer_workers %d\n", h.Workers)
+
+	for _, mount := range h.Mounts {
+		families.add("audiostreamer_mount_cpu_seconds_total{mount=%q} %.6f\n",
+			mount.Name, float64(atomic.LoadUint64(&mount.cpuNS))/1e9)
+		families.add("audiostreamer_mount_worker_wait_seconds_total{mount=%q} %.6f\n",
+			mount.Name, float64(atomic.LoadUint64(&mount.workerWaitNS))/1e9)
+		families.add("audiostreamer_metadata_updates_total{mount=%q} %d\n",
+			mount.Name, mount.Metadata.Updates())
+
+		for i, rendition := range mount.Renditions {
+			m := &rendition.Metrics
+			m.mutex.Lock()
+			stats := m.stats
+			subscribers := rendition.Broadcast.Subscribers()
+			tooSlow := rendition.Broadcast.TooSlow()
+			skips, skipped := rendition.Broadcast.Skips()
+			published := rendition.Broadcast.Published()
+			slabs := rendition.FramePool.Slabs()
+			firstByte, firstByteCount := m.firstByte, m.firstByteCount
+			firstAudio, firstAudioCount := m.firstAudio, m.firstAudioCount
+			encoderStart, encoderStartCount := m.encoderStart, m.encoderStartCount
+			inputOpen := m.inputOpen
+			m.mutex.Unlock()
+
+			label := fmt.Sprintf("mount=%q,rendition=%q", mount.Name,
+				rendition.Path)
+
+			stages := []struct {
+				name  string
+				stage C.struct_StageStats
+			}{
+				{"read", stats.read},
+				{"decode", stats.decode},
+				{"resample", stats.resample},
+				{"fifo", stats.fifo},
+				{"encode", stats.encode},
+				{"mux", stats.mux},
+			}
+			for _, s := range stages {
+				families.add("audiostreamer_stage_calls_total{%s,stage=%q} %d\n",
+					label, s.name, uint64(s.stage.count))
+				families.add("audiostreamer_stage_seconds_total{%s,stage=%q} %.9f\n",
+					label, s.name, float64(s.stage.ns)/1e9)
+			}
+
+			audioSeconds := 0.0
+			if stats.sample_rate > 0 {
+				audioSeconds = float64(stats.samples_written) / float64(stats.sample_rate)
+			}
+
+			families.add("audiostreamer_fifo_high_water_samples{%s} %d\n", label,
+				uint64(stats.fifo_high_water))
+			families.add("audiostreamer_frames_written_total{%s} %d\n", label,
+				uint64(stats.frames_written))
+			families.add("audiostreamer_bytes_out_total{%s} %d\n", label,
+				uint64(stats.bytes_out))
+			families.add("audiostreamer_audio_seconds_total{%s} %.3f\n", label,
+				audioSeconds)
+			families.add("audiostreamer_errors_total{%s} %d\n", label,
+				uint64(stats.errors))
+
+			// We don't know what encoding the silent frames would have cost. Guess
+			// it was the mean cost of the frames we did encode.
+			silentFrames := uint64(stats.silent_frames)
+			saved := 0.0
+			if stats.encode.count > 0 {
+				saved = float64(silentFrames) *
+					float64(stats.encode.ns+stats.mux.ns) / float64(stats.encode.count) / 1e9
+			}
+			families.add("audiostreamer_silent_frames_total{%s} %d\n", label,
+				silentFrames)
+			families.add("audiostreamer_silence_saved_seconds_total{%s} %.6f\n",
+				label, saved)
+
+			if h.Native != nil {
+				native := h.Native.Stats(mount, i)
+				families.add("audiostreamer_native_clients{%s} %d\n", label,
+					uint64(native.clients))
+				families.add("audiostreamer_native_clients_total{%s} %d\n", label,
+					uint64(native.accepted))
+				families.add("audiostreamer_native_clients_too_slow_total{%s} %d\n",
+					label, uint64(native.too_slow))
+				families.add("audiostreamer_native_bytes_out_total{%s} %d\n", label,
+					uint64(native.bytes_out))
+				families.add("audiostreamer_native_writes_total{%s} %d\n", label,
+					uint64(native.writes))
+			}
+
+			if rendition.Recorder != nil {
+				segments, bytes, span := rendition.Recorder.Stats()
+				families.add("audiostreamer_dvr_segments{%s} %d\n", label, segments)
+				families.add("audiostreamer_dvr_bytes{%s} %d\n", label, bytes)
+				families.add("audiostreamer_dvr_span_seconds{%s} %.3f\n", label,
+					span.Seconds())
+			}
+			families.add("audiostreamer_clients{%s} %d\n", label,
+				len(subscribers))
+			families.add("audiostreamer_clients_too_slow_total{%s} %d\n", label,
+				tooSlow)
+			families.add("audiostreamer_time_to_first_byte_seconds_sum{%s} %.6f\n",
+				label, firstByte.Seconds())
+			families.add("audiostreamer_time_to_first_byte_seconds_count{%s} %d\n",
+				label, firstByteCount)
+			families.add("audiostreamer_time_to_first_audio_seconds_sum{%s} %.6f\n",
+				label, firstAudio.Seconds())
+			families.add("audiostreamer_time_to_first_audio_seconds_count{%s} %d\n",
+				label, firstAudioCount)
+			families.add("audiostreamer_encoder_start_seconds_sum{%s} %.6f\n",
+				label, encoderStart.Seconds())
+			families.add("audiostreamer_encoder_start_seconds_count{%s} %d\n",
+				label, encoderStartCount)
+			families.add("audiostreamer_input_open_seconds_sum{%s} %.6f\n",
+				label, inputOpen.Seconds())
+			families.add("audiostreamer_input_open_seconds_count{%s} %d\n",
+				label, encoderStartCount)
+
+			families.add("audiostreamer_skips_total{%s} %d\n", label, skips)
+			families.add("audiostreamer_frames_skipped_total{%s} %d\n", label,
+				skipped)
+			families.add("audiostreamer_client_writes_total{%s} %d\n", label,
+				atomic.LoadUint64(&m.writes))
+			families.add("audiostreamer_client_flushes_total{%s} %d\n", label,
+				atomic.LoadUint64(&m.flushes))
+			families.add("audiostreamer_frames_published_total{%s} %d\n", label,
+				published)
+			families.add("audiostreamer_frame_pool_slabs_total{%s} %d\n", label,
+				slabs)
+			families.add("audiostreamer_frame_pool_bytes_total{%s} %d\n", label,
+				slabs*uint64(framePoolSlabSize))
+
+			m.latency.write(families.family("audiostreamer_latency_seconds"),
+				label)
+
+			for _, subscriber := range subscribers {
+				families.add("audiostreamer_client_queue_depth{%s,client=%q} %d\n",
+					label, subscriber.Addr, subscriber.Behind())
+				families.add("audiostreamer_client_lag_seconds{%s,client=%q} %.3f\n",
+					label, subscriber.Addr, subscriber.Lag().Seconds())
+				families.add("audiostreamer_client_skips_total{%s,client=%q} %d\n",
+					label, subscriber.Addr, subscriber.Skips())
+			}
+		}
+	}
+
+	var b strings.Builder
+	families.write(&b)
+
+	rw.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	_, _ = rw.Write([]byte(b.String()))
+}
+
+// metricFamilies collects samples by metric family. The text format wants all
+// of a family's samples together under its TYPE line, but we gather them
+// mount by mount and rendition by rendition.
+type metricFamilies struct {
+	// In the order we write them.
+	names []string
+
+	types   map[string]string
+	samples map[string]*strings.Builder
+}
+
+func newMetricFamilies() *metricFamilies {
+	return &metricFamilies{
+		types:   map[string]string{},
+		samples: map[string]*strings.Builder{},
+	}
+}
+
+// declare adds a family of the given type (counter, gauge, and so on).
+func (f *metricFamilies) declare(name, kind string) {
+	f.names = append(f.names, name)
+	f.types[name] = kind
+	f.samples[name] = &strings.Builder{}
+}
+
+// family returns where to write the named family's samples.
+func (f *metricFamilies) family(name string) *strings.Builder {
+	if _, ok := f.samples[name]; !ok {
+		f.declare(name, "untyped")
+	}
+	return f.samples[name]
+}
+
+// add writes a sample. format starts with the sample's name, which tells us
+// its family. A summary's _sum and _count go with the summary.
+func (f *metricFamilies) add(format string, args ...interface{}) {
+	name := format
+	if i := strings.IndexAny(name, "{ "); i != -1 {
+		name = name[:i]
+	}
+
+	if _, ok := f.samples[name]; !ok {
+		for _, suffix := range []string{"_sum", "_count", "_bucket"} {
+			base := strings.TrimSuffix(name, suffix)
+			if _, ok := f.samples[base]; ok && base != name {
+				name = base
+				break
+			}
+		}
+	}
+
+	fmt.Fprintf(f.family(name), format, args...)
+}
+
+// write writes each family as one group.
+func (f *metricFamilies) write(b *strings.Builder) {
+	for _, name := range f.names {
+		fmt.Fprintf(b, "# TYPE %s %s\n", name, f.types[name])
+		b.WriteString(f.samples[name].String())
+	}
+}
@@ -1,27 +1,250 @@
 //
-// Read PulseAudio input and encode to MP3.
+// Read audio input (PulseAudio, a file, or anything libavformat opens) and
+// encode it to one or more outputs (MP3, or Opus in Ogg or WebM), each at its
+// own bit rate. Outputs write frames to a file or to a FrameRing, which a
+// native fan-out server can serve to clients directly.
 //
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/audio_fifo.h>
 #include <libswresample/swresample.h>
+#include <pthread.h>
 #include <stdbool.h>
 
+// How many encoder frames worth of samples the FIFO holds initially.
+#define AS_FIFO_FRAMES 8
+
+// How many samples per channel the conversion buffer holds initially. This is
+// larger than what decoders typically give us in a single frame.
+#define AS_CONVERTED_SAMPLES_MIN 8192
+
+// Size of the buffer for the IO context we use when writing to a FrameRing.
+#define AS_AVIO_BUFFER_SIZE 4096
+
+// Most bytes of encoded frames we cache per output when looping a file. If a
+// file needs more, we loop by decoding it again instead.
+#define AS_LOOP_CACHE_MAX (64*1024*1024)
+
+// When pacing to real time, if we fall this far behind (e.g. because an output
+// was inactive), we start pacing again from now rather than catching up.
+#define AS_PACE_MAX_LAG_NS INT64_C(500000000)
+
+// How many capture marks each output remembers. We need marks for the samples
+// in its FIFO and the encoder's lookahead, which is only a few input frames.
+#define AS_CAPTURE_MARKS 64
+
+// How many frames of silence in a row we give the encoder before we write
+// pre-encoded silent frames instead. By then its lookahead holds only silence.
+#define AS_SILENCE_HOLD_FRAMES 4
+
+// The native fan-out server writes at most this many pieces (frames, and what
+// goes before them) to a client per call. See as_fanout_start().
+#define AS_FANOUT_IOV 64
+
+// The fan-out server cuts off a client once the frame it wants next is this
+// close to being overwritten in its ring. The encoder would have to write this
+// many frames while we write to a single client to overwrite what we're
+// writing.
+#define AS_FANOUT_GUARD_FRAMES 64
+
+// Most bytes of a request we read from a fan-out client, and how long we wait
+// for it.
+#define AS_FANOUT_REQUEST_MAX 2048
+#define AS_FANOUT_REQUEST_TIMEOUT_NS INT64_C(10000000000)
+
 struct Input {
 	AVFormatContext * format_ctx;
 	AVCodecContext * codec_ctx;
+
+	// Index of the audio stream we decode.
+	int stream_index;
+
+	// How long as_open_input() took.
+	int64_t open_ns;
+};
+
+// A slot in a FrameRing.
+struct RingFrame {
+	// Sequence number of the frame in this slot. 0 if the slot is empty.
+	uint64_t seq;
+
+	// Presentation timestamp of the frame.
+	int64_t pts;
+
+	// When we added the frame (CLOCK_MONOTONIC, nanoseconds).
+	int64_t time;
+
+	// When we read the frame's first samples from the input (CLOCK_MONOTONIC,
+	// nanoseconds).
+	int64_t capture_time;
+
+	// Encoded data. It points into the ring's storage.
+	uint8_t * data;
+
+	// The fan-out server reads this without the mutex, so we access it with
+	// __atomic builtins.
+	size_t size;
+};
+
+// A FrameRing holds the most recent encoded frames in memory. The encoder
+// writes each frame into it and readers read frames out by sequence number.
+// When it is full we overwrite the oldest frame. This means the encoder never
+// waits for readers.
+//
+// It is safe to use from multiple threads.
+struct FrameRing {
+	pthread_mutex_t mutex;
+
+	// Signalled whenever we add a frame.
+	pthread_cond_t cond;
+
+	struct RingFrame * frames;
+	size_t nb_frames;
+
+	// Storage for frame data. Each slot can hold frame_capacity bytes.
+	uint8_t * data;
+	size_t frame_capacity;
+
+	// Sequence number the next frame will get. Sequence numbers start at 1.
+	uint64_t next_seq;
+
+	// Bytes the muxer wrote before the first frame (the stream header). A
+	// reader joining the stream should send this before any frames. It can hold
+	// up to frame_capacity bytes.
+	uint8_t * header;
+	size_t header_size;
+
+	// How many times we've set the header. An encoder restart sets a new one
+	// (Ogg gets a new serial number, for one), so a reader holding on to the old
+	// header can tell that frames no longer go with it.
+	uint64_t header_generation;
+
+	// eventfds we write to whenever we add a frame. The fan-out server's
+	// threads wait on these. See as_fanout_start().
+	int * notify_fds;
+	size_t nb_notify_fds;
+};
+
+// A frame in a FrameCache.
+struct CachedFrame {
+	size_t offset;
+	size_t size;
+};
+
+// Encoded frames of an entire file. When looping a file we encode it once into
+// this, and from then on write frames from it rather than decoding and
+// encoding again.
+struct FrameCache {
+	uint8_t * data;
+	size_t size;
+	size_t capacity;
+
+	struct CachedFrame * frames;
+	size_t nb_frames;
+	size_t frames_capacity;
+
+	// The frame we write next when replaying.
+	size_t next;
+
+	// If the file did not fit. We can't use the cache.
+	bool overflow;
+};
+
+// How many times we did something in a stage of decoding/encoding, and how long
+// we spent doing it in total.
+struct StageStats {
+	uint64_t count;
+	uint64_t ns;
+};
+
+// Counters and timings. These are cumulative since we initialized the
+// audiostreamer. See as_get_stats().
+struct Stats {
+	// Reading packets from the input and decoding them. count is the number of
+	// packets read and frames decoded respectively. These are shared by every
+	// output.
+	struct StageStats read;
+	struct StageStats decode;
+
+	// Converting decoded samples to the output's format. If an output shares
+	// another output's conversion, that output counts it.
+	struct StageStats resample;
+
+	// Adding samples to and taking them from the FIFO.
+	struct StageStats fifo;
+
+	// Encoding frames. count is the number of packets the encoder gave us.
+	struct StageStats encode;
+
+	// Muxing packets and writing them out.
+	struct StageStats mux;
+
+	// Most samples (per channel) ever waiting in the FIFO.
+	uint64_t fifo_high_water;
+
+	// Frames and bytes we wrote, and how many samples (per channel) they hold.
+	uint64_t frames_written;
+	uint64_t bytes_out;
+	uint64_t samples_written;
+
+	// Sample rate of the output. Divide samples_written by this to know how many
+	// seconds of audio we wrote.
+	int sample_rate;
+
+	// Number of times decoding/encoding failed. This is shared by every output.
+	uint64_t errors;
+
+	// CPU time spent decoding and encoding, on every thread. This is shared by
+	// every output.
+	uint64_t cpu_ns;
+
+	// Time spent waiting for a worker to encode with. See as_set_max_workers().
+	// This is shared by every output.
+	uint64_t worker_wait_ns;
+
+	// Frames of silence we wrote without encoding. See as_set_silence_gate().
+	uint64_t silent_frames;
+};
+
+// Samples from PTS pts on (until the next mark) were read from the input at
+// time (CLOCK_MONOTONIC, nanoseconds).
+struct CaptureMark {
+	int64_t pts;
+	int64_t time;
 };
 
 struct Output {
 	AVFormatContext * format_ctx;
 	AVCodecContext * codec_ctx;
 	SwrContext * resample_ctx;
-};
 
-struct Audiostreamer {
-	struct Input * input;
-	struct Output * output;
+	// If the output has the same sample rate and channels as the input, all
+	// converting samples does is change their format. For common formats we do
+	// that ourselves rather than with the resampler. This is set if we can. It
+	// converts interleaved samples in the format convert_from. If a decoded
+	// frame is in some other format we fall back to the resampler.
+	void (* convert)(const uint8_t * const, uint8_t * const * const,
+			const int, const int);
+	enum AVSampleFormat convert_from;
+
+	// If we are writing to a FrameRing rather than a URL, this is set.
+	struct FrameRing * ring;
+
+	// Data the muxer wrote since we last committed a frame to the ring. Our
+	// AVIOContext write callback appends here.
+	uint8_t * pending;
+	size_t pending_size;
+
+	// If the muxer tried to write more than we could hold.
+	bool pending_overflow;
+
+	// Whether we flush the muxer after each packet. See as_open_output().
+	bool flush_packets;
+
+	// Whether we are encoding for this output. If not, we skip converting and
+	// encoding samples for it. It starts out active.
+	bool active;
 
 	// Audio samples FIFO. Because decoder/encoder may provide/expect differing
 	// numbers of samples, we buffer samples here.
@@ -32,14 +255,180 @@ struct Audiostreamer {
 
 	// Number of frames written.
 	uint64_t frames_written;
+
+	// Reusable frame and packet for encoding/writing. We allocate these once so
+	// that steady state encoding does not need to allocate anything per frame.
+	AVFrame * frame;
+	AVPacket * pkt;
+
+	// Buffer we convert input samples into before adding them to the FIFO. It
+	// can hold converted_samples_capacity samples per channel.
+	uint8_t * * converted_samples;
+	int converted_samples_capacity;
+	int nb_converted_samples;
+
+	// If another output wants samples in the same format, rate, and channels as
+	// this one, we convert once and both take samples from the first output's
+	// buffer. This points to that output (or to ourself).
+	struct Output * samples_from;
+
+	// The decoded frame we last converted samples for.
+	uint64_t converted_frame;
+
+	// PTS of the last packet we wrote.
+	int64_t last_pts;
+
+	// When we read the samples we added to the FIFO recently. We use these to
+	// tell when each frame we encode was captured. Mark i is at
+	// i%AS_CAPTURE_MARKS.
+	struct CaptureMark capture_marks[AS_CAPTURE_MARKS];
+	uint64_t nb_capture_marks;
+
+	// Encoded frames of the file we're looping. We add to it while caching is
+	// set. See as_set_realtime().
+	struct FrameCache cache;
+	bool caching;
+
+	// Whether we can loop from cached frames at all. Only if each frame is
+	// valid on its own.
+	bool cacheable;
+
+	// When pacing to real time, the frame with PTS pace_base_pts is due at
+	// pace_base_ns (CLOCK_MONOTONIC). Later frames are due relative to it.
+	int64_t pace_base_ns;
+	int64_t pace_base_pts;
+
+	// Silence gate. See as_set_silence_gate(). If silent_frame is set, it is a
+	// frame of silence we encoded up front. A sample counts as silent if its
+	// absolute value is at most silence_threshold (for float formats) or
+	// silence_threshold_int (for integer formats).
+	uint8_t * silent_frame;
+	size_t silent_frame_size;
+	double silence_threshold;
+	int64_t silence_threshold_int;
+
+	// PTS just after the last sample we added to the FIFO that was not silent.
+	int64_t loud_until;
+
+	// How many silent frames in a row we gave the encoder.
+	int quiet_frames;
+
+	// Counters and timings of the output's stages. See as_get_stats().
+	struct Stats stats;
+};
+
+// Describes a frame we wrote. See as_read_write_n().
+struct FrameInfo {
+	// Index of the output we wrote it to.
+	size_t output;
+
+	// Compressed size.
+	int size;
+
+	int64_t pts;
+};
+
+// The pipeline for decoding and encoding on separate threads. See
+// as_pipeline_start().
+struct Pipeline;
+
+// The native fan-out server. See as_fanout_alloc().
+struct Fanout;
+
+// Counters for one of the fan-out server's routes. See as_fanout_get_stats().
+struct FanoutStats {
+	// Clients we're sending frames to now.
+	uint64_t clients;
+
+	// Clients that asked for the route, ever.
+	uint64_t accepted;
+
+	// Clients we cut off because they fell too far behind.
+	uint64_t too_slow;
+
+	// Bytes we sent, and the calls we made to send them.
+	uint64_t bytes_out;
+	uint64_t writes;
+};
+
+// Back-pressure accounting for one output of a pipeline.
+struct PipelineStats {
+	// Blocks of samples the decode thread handed to the output's encode thread.
+	uint64_t blocks;
+
+	// Times the decode thread had to wait for the encode thread.
+	uint64_t stalls;
+
+	// Blocks the decode thread dropped because the encode thread fell behind.
+	uint64_t drops;
+
+	// Most blocks ever waiting for the encode thread, and how many are waiting
+	// right now.
+	uint64_t high_water;
+	uint64_t depth;
+};
+
+struct Audiostreamer {
+	struct Input * input;
+
+	// We decode the input once and encode it to each output.
+	struct Output * * outputs;
+	size_t nb_outputs;
+
+	// Number of frames written to all outputs.
+	uint64_t frames_written;
+
+	// Number of frames decoded from the input.
+	uint64_t frames_decoded;
+
+	// Reusable packet and frame for reading/decoding.
+	AVPacket * input_pkt;
+	AVFrame * input_frame;
+
+	// When we read the last packet from the input (CLOCK_MONOTONIC,
+	// nanoseconds).
+	int64_t input_time;
+
+	// Pointers to the decoded input samples (one per channel) in the form
+	// swr_convert() wants.
+	const uint8_t * * input_samples;
+
+	// Number of heap allocations we made after initialization. This happens
+	// only when we must grow a buffer or a FIFO, or when an encoder is still
+	// holding on to its output frame's buffer. In steady state it should not
+	// change.
+	uint64_t allocations;
+
+	// Set while a pipeline is running.
+	struct Pipeline * pipeline;
+
+	// Whether we write frames no faster than real time. We need this when the
+	// input is a file rather than a live source.
+	bool realtime;
+
+	// Whether we loop the input forever rather than stopping at EOF.
+	bool loop;
+
+	// Set once we reached EOF while looping and have every output's frames
+	// cached. From then on we write frames from the caches.
+	bool replaying;
+
+	// Counters and timings of the input's stages. See as_get_stats().
+	struct Stats stats;
 };
 
 void
 as_setup(void);
 
+void
+as_set_max_workers(const int);
+
+int64_t
+as_monotonic_ns(void);
+
 struct Input *
 as_open_input(const char * const,
-		const char * const, const bool);
+		const char * const, const char * const, const bool);
 
 void
 as_destroy_input(struct Input * const);
@@ -47,16 +436,92 @@ as_destroy_input(struct Input * const);
 struct Output *
 as_open_output(const struct Input * const,
 		const char * const, const char * const,
-		const char * const);
+		const char * const, const char * const, const int,
+		struct FrameRing * const);
 
 void
 as_destroy_output(struct Output * const);
 
 struct Audiostreamer *
-as_init_audiostreamer(struct Input * const, struct Output * const);
+as_init_audiostreamer(struct Input * const, struct Output * * const,
+		const size_t);
+
+void
+as_set_output_active(struct Audiostreamer * const, const size_t, const bool);
 
 int
 as_read_write(struct Audiostreamer * const, int * const);
 
+void
+as_set_realtime(struct Audiostreamer * const, const bool);
+
+bool
+as_set_silence_gate(struct Audiostreamer * const, const double);
+
+int
+as_read_write_n(struct Audiostreamer * const, struct FrameInfo * const,
+		const int, const int, int * const);
+
 void
 as_destroy_audiostreamer(struct Audiostreamer * const);
+
+bool
+as_pipeline_start(struct Audiostreamer * const, const size_t, const bool);
+
+int
+as_pipeline_status(struct Audiostreamer * const);
+
+void
+as_pipeline_stop(struct Audiostreamer * const);
+
+bool
+as_pipeline_get_stats(struct Audiostreamer * const, const size_t,
+		struct PipelineStats * const);
+
+bool
+as_get_stats(struct Audiostreamer * const, const size_t,
+		struct Stats * const);
+
+struct FrameRing *
+as_frame_ring_alloc(const size_t, const size_t);
+
+void
+as_frame_ring_free(struct FrameRing * const);
+
+uint64_t
+as_frame_ring_next_seq(struct FrameRing * const);
+
+bool
+as_frame_ring_wait(struct FrameRing * const, const uint64_t, const int);
+
+int
+as_frame_ring_read(struct FrameRing * const, const uint64_t,
+		uint8_t * const, const size_t, size_t * const, int64_t * const,
+		int64_t * const, int64_t * const);
+
+size_t
+as_frame_ring_read_header(struct FrameRing * const, uint8_t * const,
+		const size_t);
+
+uint64_t
+as_frame_ring_header_generation(struct FrameRing * const);
+
+uint64_t
+as_frame_ring_recent_seq(struct FrameRing * const, const int);
+
+struct Fanout *
+as_fanout_alloc(const int);
+
+bool
+as_fanout_add_route(struct Fanout * const, const char * const,
+		struct FrameRing * const, const char * const);
+
+bool
+as_fanout_start(struct Fanout * const, const int * const, const size_t);
+
+bool
+as_fanout_get_stats(struct Fanout * const, const size_t,
+		struct FanoutStats * const);
+
+void
+as_fanout_free(struct Fanout * const);
@@ -0,0 +1,344 @@
+package main
+
+import (
+	"fmt"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// A Broadcast holds a rendition's most recent frames. The reader publishes
+// each frame to it once. Each client reads frames from it at its own pace by
+// sequence number.
+//
+// Publishing does not depend on how many clients there are. We store the
+// frame in a slot and wake anyone waiting by closing a channel. Frames are
+// never changed after we publish them, so every client shares them.
+//
+// A slot holds a reference to its frame (see framePool). We drop it when we
+// overwrite the slot.
+type Broadcast struct {
+	mutex sync.RWMutex
+
+	// Frame with sequence number seq is at seq%len(frames).
+	frames []broadcastFrame
+
+	// Sequence number the next frame will get. Sequence numbers start at 1.
+	next uint64
+
+	// We close this when we publish a frame and replace it with a new one.
+	notify chan struct{}
+
+	subscribersMutex sync.Mutex
+	subscribers      map[*Subscriber]struct{}
+
+	// Number of subscribers that fell so far behind that we overwrote the frame
+	// they wanted, or that lagged too often.
+	tooSlow uint64
+
+	// Number of times subscribers skipped ahead to live, and how many frames
+	// they skipped in total.
+	skips   uint64
+	skipped uint64
+}
+
+type broadcastFrame struct {
+	frame Frame
+
+	// When we published it.
+	time time.Time
+}
+
+// A Subscriber reads frames from a Broadcast.
+type Subscriber struct {
+	broadcast *Broadcast
+
+	// Remote address. We use it to tell subscribers apart in /metrics.
+	Addr string
+
+	// Sequence number of the next frame we want. Only the subscriber changes
+	// it. Others may read it.
+	cursor uint64
+
+	lag LagPolicy
+
+	// When we skipped ahead recently. Only the subscriber touches this.
+	skipTimes []time.Time
+
+	// Number of times we skipped ahead. Others may read it.
+	skips uint64
+}
+
+// LagPolicy says what to do with a subscriber that falls behind.
+//
+// If the frame it wants is older than MaxLag, or is gone, we skip it ahead to
+// the newest frame rather than cutting it off. An MP3 frame doesn't depend on
+// earlier ones (we don't use the bit reservoir), so the client can play on
+// from there. Ogg and WebM clients can too as each packet is in its own
+// page/cluster. If it needs to skip more than MaxSkips times within
+// lagSkipWindow, it can't keep up, so we cut it off.
+//
+// The zero value never skips. The subscriber is cut off once the frame it
+// wants is gone.
+type LagPolicy struct {
+	MaxLag   time.Duration
+	MaxSkips int
+}
+
+// We count a subscriber's skips over this long.
+const lagSkipWindow = time.Minute
+
+// errClientTooSlow means a subscriber did not keep up. The frame it wanted is
+// gone, or it had to skip ahead too often.
+var errClientTooSlow = fmt.Errorf("client is too slow")
+
+// errClientDone means the subscriber stopped waiting.
+var errClientDone = fmt.Errorf("client went away")
+
+// errTimeout means no frame came before the timeout.
+var errTimeout = fmt.Errorf("timed out waiting for a frame")
+
+// NewBroadcast creates a Broadcast holding up to size frames.
+func NewBroadcast(size int) *Broadcast {
+	return &Broadcast{
+		frames:      make([]broadcastFrame, size),
+		next:        1,
+		notify:      make(chan struct{}),
+		subscribers: map[*Subscriber]struct{}{},
+	}
+}
+
+// Publish adds a frame, overwriting the oldest if we're full, and wakes up
+// waiting subscribers.
+func (b *Broadcast) Publish(frame Frame) {
+	b.mutex.Lock()
+
+	slot := &b.frames[b.next%uint64(len(b.frames))]
+	old := slot.frame
+	*slot = broadcastFrame{
+		frame: frame,
+		time:  time.Now(),
+	}
+	b.next++
+
+	notify := b.notify
+	b.notify = make(chan struct{})
+
+	b.mutex.Unlock()
+
+	old.Release()
+	close(notify)
+}
+
+// Subscribe starts reading frames.
+//
+// The subscriber starts with frames published up to burst ago, if we still
+// have them, so it can send a burst of recent audio. We give it at most half
+// of what we hold so it doesn't start out about to fall behind.
+//
+// lag says what to do if it falls behind.
+func (b *Broadcast) Subscribe(addr string, burst time.Duration,
+	lag LagPolicy) *Subscriber {
+	b.mutex.RLock()
+
+	start := b.next
+	if burst > 0 {
+		since := time.Now().Add(-burst)
+		max := uint64(len(b.frames) / 2)
+
+		for start > 1 && b.next-(start-1) <= max {
+			f := &b.frames[(start-1)%uint64(len(b.frames))]
+			if f.time.Before(since) {
+				break
+			}
+			start--
+		}
+	}
+
+	b.mutex.RUnlock()
+
+	s := &Subscriber{
+		broadcast: b,
+		Addr:      addr,
+		cursor:    start,
+		lag:       lag,
+	}
+
+	b.subscribersMutex.Lock()
+	b.subscribers[s] = struct{}{}
+	b.subscribersMutex.Unlock()
+
+	return s
+}
+
+// Close stops the subscriber from counting as one.
+func (s *Subscriber) Close() {
+	b := s.broadcast
+	b.subscribersMutex.Lock()
+	delete(b.subscribers, s)
+	b.subscribersMutex.Unlock()
+}
+
+// Next returns the next frame, waiting for one if needed. Call Release on the
+// frame when you're done with it.
+//
+// If done closes while we wait, we return errClientDone. If timeout fires
+// first, we return errTimeout. Either may be nil. If we fall behind we skip
+// ahead or return errClientTooSlow depending on our LagPolicy.
+func (s *Subscriber) Next(done <-chan struct{},
+	timeout <-chan time.Time) (Frame, error) {
+	b := s.broadcast
+	cursor := atomic.LoadUint64(&s.cursor)
+
+	for {
+		b.mutex.RLock()
+
+		if cursor < b.next {
+			size := uint64(len(b.frames))
+
+			// If we want the newest frame we can't be lagging, so we only look at
+			// the time if we're further behind.
+			gone := b.next-cursor > size
+			lagging := gone || (s.lag.MaxLag > 0 && b.next-cursor > 1 &&
+				time.Since(b.frames[cursor%size].time) > s.lag.MaxLag)
+
+			if lagging {
+				newest := b.next - 1
+				b.mutex.RUnlock()
+
+				if !s.skip() {
+					atomic.AddUint64(&b.tooSlow, 1)
+					return Frame{}, errClientTooSlow
+				}
+
+				atomic.AddUint64(&b.skipped, newest-cursor)
+				cursor = newest
+				atomic.StoreUint64(&s.cursor, cursor)
+				continue
+			}
+
+			// Take our reference while the slot still holds one.
+			frame := b.frames[cursor%size].frame
+			frame.retain()
+			b.mutex.RUnlock()
+
+			atomic.StoreUint64(&s.cursor, cursor+1)
+			return frame, nil
+		}
+
+		wait := b.notify
+		b.mutex.RUnlock()
+
+		select {
+		case <-wait:
+		case <-done:
+			return Frame{}, errClientDone
+		case <-timeout:
+			return Frame{}, errTimeout
+		}
+	}
+}
+
+// skip records that we're skipping ahead. It returns false if our policy
+// says to cut us off instead.
+func (s *Subscriber) skip() bool {
+	if s.lag.MaxLag == 0 {
+		return false
+	}
+
+	now := time.Now()
+
+	recent := s.skipTimes[:0]
+	for _, t := range s.skipTimes {
+		if now.Sub(t) < lagSkipWindow {
+			recent = append(recent, t)
+		}
+	}
+	s.skipTimes = recent
+
+	if len(s.skipTimes) >= s.lag.MaxSkips {
+		return false
+	}
+
+	s.skipTimes = append(s.skipTimes, now)
+	atomic.AddUint64(&s.skips, 1)
+	atomic.AddUint64(&s.broadcast.skips, 1)
+	return true
+}
+
+// Skips tells how many times we skipped ahead.
+func (s *Subscriber) Skips() uint64 {
+	return atomic.LoadUint64(&s.skips)
+}
+
+// Lag tells how long ago the frame we want next was published. If we've read
+// every frame, it's 0.
+func (s *Subscriber) Lag() time.Duration {
+	b := s.broadcast
+	cursor := atomic.LoadUint64(&s.cursor)
+
+	b.mutex.RLock()
+	defer b.mutex.RUnlock()
+
+	if cursor >= b.next {
+		return 0
+	}
+
+	// If it's gone, the oldest we have is a lower bound.
+	size := uint64(len(b.frames))
+	if b.next-cursor > size {
+		cursor = b.next - size
+	}
+
+	return time.Since(b.frames[cursor%size].time)
+}
+
+// Ready tells whether there is a frame we can read without waiting.
+func (s *Subscriber) Ready() bool {
+	return s.Behind() > 0
+}
+
+// Behind tells how many published frames the subscriber has yet to read.
+func (s *Subscriber) Behind() uint64 {
+	b := s.broadcast
+
+	b.mutex.RLock()
+	next := b.next
+	b.mutex.RUnlock()
+
+	cursor := atomic.LoadUint64(&s.cursor)
+	if cursor >= next {
+		return 0
+	}
+	return next - cursor
+}
+
+// Subscribers returns the current subscribers.
+func (b *Broadcast) Subscribers() []*Subscriber {
+	b.subscribersMutex.Lock()
+	defer b.subscribersMutex.Unlock()
+
+	subscribers := make([]*Subscriber, 0, len(b.subscribers))
+	for s := range b.subscribers {
+		subscribers = append(subscribers, s)
+	}
+	return subscribers
+}
+
+// Published tells how many frames we published.
+func (b *Broadcast) Published() uint64 {
+	b.mutex.RLock()
+	defer b.mutex.RUnlock()
+	return b.next - 1
+}
+
+// TooSlow tells how many subscribers fell too far behind.
+func (b *Broadcast) TooSlow() uint64 {
+	return atomic.LoadUint64(&b.tooSlow)
+}
+
+// Skips tells how many times subscribers skipped ahead to live and how many
+// frames they skipped.
+func (b *Broadcast) Skips() (uint64, uint64) {
+	return atomic.LoadUint64(&b.skips), atomic.LoadUint64(&b.skipped)
+}
@@ -0,0 +1,256 @@
+package main
+
+import (
+	"runtime"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+// Clients in BenchmarkPublish.
+const benchSubscribers = 10000
+
+// BenchmarkPublish publishes MP3 sized frames to 10k subscribers, each in its
+// own goroutine as a client's would be, and waits for every subscriber to take
+// each frame. Time per op is what it costs to get one frame to all of them.
+//
+// Real clients are paced by the encoder, so we don't let the publisher get so
+// far ahead that it overwrites frames they haven't taken. too_slow should be 0.
+//
+//	go test -run '^$' -bench Publish -cpu 1,4
+func BenchmarkPublish(b *testing.B) {
+	broadcast := NewBroadcast(broadcastFrames)
+	pool := newFramePool(framePoolSlabSize)
+
+	// A subscriber is done once it took the last frame or was cut off.
+	last := uint64(b.N)
+	var wg sync.WaitGroup
+
+	subscribers := make([]*Subscriber, benchSubscribers)
+	for i := range subscribers {
+		s := broadcast.Subscribe("bench", 0, LagPolicy{})
+		subscribers[i] = s
+		wg.Add(1)
+
+		go func() {
+			defer wg.Done()
+			defer s.Close()
+
+			for atomic.LoadUint64(&s.cursor) <= last {
+				frame, err := s.Next(nil, nil)
+				if err != nil {
+					return
+				}
+				frame.Release()
+			}
+		}()
+	}
+
+	b.ReportAllocs()
+	b.ResetTimer()
+
+	for i := 0; i < b.N; i++ {
+		if i%(broadcastFrames/4) == 0 {
+			for _, s := range subscribers {
+				// We've published i frames, so s wants frame i+1 if it's caught up.
+				for int64(i)+1-int64(atomic.LoadUint64(&s.cursor)) >=
+					broadcastFrames/2 {
+					runtime.Gosched()
+				}
+			}
+		}
+
+		// A 128 Kb/s 44.1 kHz MP3 frame.
+		buf := pool.buffer(417)
+		buf[0] = byte(i)
+		broadcast.Publish(pool.commit(len(buf)))
+	}
+
+	wg.Wait()
+
+	b.StopTimer()
+
+	b.ReportMetric(float64(broadcast.TooSlow()), "too_slow")
+}
+
+// publishFrames publishes n one byte frames from pool. Each frame's byte is
+// its sequence number, so we can tell which one a subscriber got.
+func publishFrames(b *Broadcast, pool *framePool, n int) {
+	for i := 0; i < n; i++ {
+		buf := pool.buffer(1)
+		buf[0] = byte(b.Published() + 1)
+		b.Publish(pool.commit(1))
+	}
+}
+
+func TestSubscriberNextLag(t *testing.T) {
+	const maxLag = time.Second
+
+	tests := []struct {
+		name string
+
+		// Frames the broadcast holds, and how many we publish.
+		size      int
+		published int
+
+		// How many of the oldest frames we make older than maxLag.
+		aged int
+
+		lag LagPolicy
+
+		// How long ago the subscriber skipped before.
+		priorSkips []time.Duration
+
+		want      byte
+		wantErr   error
+		wantSkips uint64
+	}{
+		{
+			name:      "caught up",
+			size:      16,
+			published: 10,
+			lag:       LagPolicy{MaxLag: maxLag, MaxSkips: 3},
+			want:      1,
+		},
+		{
+			name:      "lagging skips to live",
+			size:      16,
+			published: 10,
+			aged:      9,
+			lag:       LagPolicy{MaxLag: maxLag, MaxSkips: 3},
+			want:      10,
+			wantSkips: 1,
+		},
+		{
+			name:      "lagging without a policy reads on",
+			size:      16,
+			published: 10,
+			aged:      9,
+			want:      1,
+		},
+		{
+			name:      "gone without a policy is cut off",
+			size:      4,
+			published: 6,
+			wantErr:   errClientTooSlow,
+		},
+		{
+			name:      "gone skips to live",
+			size:      4,
+			published: 6,
+			lag:       LagPolicy{MaxLag: maxLag, MaxSkips: 3},
+			want:      6,
+			wantSkips: 1,
+		},
+		{
+			name:       "too many skips in the window is cut off",
+			size:       16,
+			published:  10,
+			aged:       9,
+			lag:        LagPolicy{MaxLag: maxLag, MaxSkips: 2},
+			priorSkips: []time.Duration{10 * time.Second, 20 * time.Second},
+			wantErr:    errClientTooSlow,
+		},
+		{
+			name:       "skips before the window don't count",
+			size:       16,
+			published:  10,
+			aged:       9,
+			lag:        LagPolicy{MaxLag: maxLag, MaxSkips: 2},
+			priorSkips: []time.Duration{2 * time.Minute, 3 * time.Minute},
+			want:       10,
+			wantSkips:  1,
+		},
+	}
+
+	for _, test := range tests {
+		t.Run(test.name, func(t *testing.T) {
+			b := NewBroadcast(test.size)
+			pool := newFramePool(1)
+
+			s := b.Subscribe("test", 0, test.lag)
+			defer s.Close()
+			for _, ago := range test.priorSkips {
+				s.skipTimes = append(s.skipTimes, time.Now().Add(-ago))
+			}
+
+			publishFrames(b, pool, test.published)
+			for seq := 1; seq <= test.aged; seq++ {
+				b.frames[seq%test.size].time = time.Now().Add(-2 * maxLag)
+			}
+
+			frame, err := s.Next(nil, nil)
+			if err != test.wantErr {
+				t.Fatalf("Next() error = %v, wanted %v", err, test.wantErr)
+			}
+			if err == nil {
+				if frame.Audio[0] != test.want {
+					t.Errorf("Next() = frame %d, wanted %d", frame.Audio[0], test.want)
+				}
+				frame.Release()
+			}
+
+			if s.Skips() != test.wantSkips {
+				t.Errorf("Skips() = %d, wanted %d", s.Skips(), test.wantSkips)
+			}
+
+			wantTooSlow := uint64(0)
+			if test.wantErr == errClientTooSlow {
+				wantTooSlow = 1
+			}
+			if b.TooSlow() != wantTooSlow {
+				t.Errorf("TooSlow() = %d, wanted %d", b.TooSlow(), wantTooSlow)
+			}
+		})
+	}
+}
+
+// When a subscriber skips it takes no reference to the frames it skipped, so
+// they go back to the pool once the broadcast overwrites them.
+func TestSubscriberSkipReleasesFrames(t *testing.T) {
+	const size = 8
+
+	b := NewBroadcast(size)
+	// One frame per slab, so each frame's slab counts its references.
+	pool := newFramePool(1)
+
+	s := b.Subscribe("test", 0, LagPolicy{MaxLag: time.Second, MaxSkips: 3})
+	defer s.Close()
+
+	publishFrames(b, pool, size)
+	for seq := 1; seq < size; seq++ {
+		b.frames[seq%size].time = time.Now().Add(-time.Minute)
+	}
+
+	frame, err := s.Next(nil, nil)
+	if err != nil {
+		t.Fatalf("Next() error = %v", err)
+	}
+	if frame.Audio[0] != size {
+		t.Fatalf("Next() = frame %d, wanted %d", frame.Audio[0], size)
+	}
+	frame.Release()
+
+	// Only the broadcast holds the frames now. The newest is also the pool's
+	// current slab.
+	for seq := 1; seq <= size; seq++ {
+		want := int32(1)
+		if seq == size {
+			want = 2
+		}
+		slab := b.frames[seq%size].frame.slab
+		if refs := atomic.LoadInt32(&slab.refs); refs != want {
+			t.Errorf("frame %d has %d references, wanted %d", seq, refs, want)
+		}
+	}
+
+	// Overwriting the skipped frames frees their slabs, so publishing as many
+	// again reuses them. Only the first new frame needs a new slab, since
+	// nothing is free until it overwrites frame 1.
+	publishFrames(b, pool, size)
+
+	if slabs := pool.Slabs(); slabs != size+1 {
+		t.Errorf("pool allocated %d slabs, wanted %d", slabs, size+1)
+	}
+}
@@ -0,0 +1,383 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "audiostreamer.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// End-to-end encoding benchmark.
+//
+// For each input and each encoder/bit rate we encode a fixed duration of audio
+// into a FrameRing, as the daemon does, and report:
+//
+// - Realtime factor (seconds of audio encoded per second of wall time)
+// - Frames per second
+// - Per-frame latency percentiles (wall time between consecutive frames)
+// - Allocations after initialization
+//
+// We also compare calling as_read_write() once per unit of work with calling
+// as_read_write_n() once per batch.
+//
+// Inputs are generated (lavfi) so results are deterministic and we don't need
+// PulseAudio. You can add a file with -f.
+//
+// Output is a JSON array with one object per run.
+
+// A combination of encoder and bit rate to measure.
+struct Encoding {
+	const char * format;
+	const char * encoder;
+	const char * encoder_options;
+	int bit_rate;
+};
+
+struct BenchInput {
+	const char * name;
+	const char * format;
+	// For lavfi the source filter, which we give the duration. Otherwise a URL.
+	const char * url;
+};
+
+struct Result {
+	uint64_t frames;
+	uint64_t calls;
+	uint64_t allocations;
+	double open_seconds;
+	double seconds;
+	double audio_seconds;
+	double * latencies;
+	size_t nb_latencies;
+};
+
+static const struct Encoding encodings[] = {
+	{"mp3", "libmp3lame", NULL, 64000},
+	{"mp3", "libmp3lame", NULL, 128000},
+	{"mp3", "libmp3lame", NULL, 320000},
+	{"ogg", "libopus", "frame_duration=20", 64000},
+	{"ogg", "libopus", "frame_duration=10", 64000},
+};
+
+static const struct BenchInput generated_inputs[] = {
+	{
+		"sine",
+		"lavfi",
+		"sine=frequency=440:sample_rate=44100",
+	},
+	{
+		"noise",
+		"lavfi",
+		"anoisesrc=sample_rate=44100:seed=1",
+	},
+};
+
+// Batch sizes to compare. 0 means as_read_write().
+static const int batch_sizes[] = {0, 1, 4, 16, 64};
+
+static bool
+__run(const struct BenchInput * const, const int,
+		const struct Encoding * const, const int, struct Result * const);
+static struct Audiostreamer *
+__open(const struct BenchInput * const, const int,
+		const struct Encoding * const, struct FrameRing * const);
+static bool
+__add_latency(struct Result * const, const double);
+static double
+__percentile(const double * const, const size_t, const double);
+static int
+__compare_doubles(const void * const, const void * const);
+static void
+__print_result(const struct BenchInput * const,
+		const struct Encoding * const, const int, struct Result * const,
+		const bool);
+static double
+__now(void);
+
+int
+main(int argc, char * * argv)
+{
+	int seconds = 60;
+	const char * file = NULL;
+
+	int opt = 0;
+	while ((opt = getopt(argc, argv, "s:f:")) != -1) {
+		switch (opt) {
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-s seconds] [-f file.mp3]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (seconds <= 0) {
+		fprintf(stderr, "seconds must be positive\n");
+		return 1;
+	}
+
+	as_setup();
+
+	struct BenchInput inputs[3];
+	size_t nb_inputs = 0;
+	for (size_t i = 0; i < sizeof(generated_inputs)/sizeof(generated_inputs[0]);
+			i++) {
+		inputs[nb_inputs++] = generated_inputs[i];
+	}
+
+	if (file) {
+		inputs[nb_inputs].name = file;
+		inputs[nb_inputs].format = "mp3";
+		inputs[nb_inputs].url = file;
+		nb_inputs++;
+	}
+
+	printf("[\n");
+	bool first = true;
+
+	// Each input with each encoding, one unit of work per call.
+	for (size_t i = 0; i < nb_inputs; i++) {
+		for (size_t j = 0; j < sizeof(encodings)/sizeof(encodings[0]); j++) {
+			struct Result result;
+			if (!__run(&inputs[i], seconds, &encodings[j], 0, &result)) {
+				return 1;
+			}
+
+			__print_result(&inputs[i], &encodings[j], 0, &result, first);
+			first = false;
+		}
+	}
+
+	// Batch sizes, with the first input and encoding.
+	for (size_t i = 0; i < sizeof(batch_sizes)/sizeof(batch_sizes[0]); i++) {
+		if (batch_sizes[i] == 0) {
+			continue;
+		}
+
+		struct Result result;
+		if (!__run(&inputs[0], seconds, &encodings[0], batch_sizes[i], &result)) {
+			return 1;
+		}
+
+		__print_result(&inputs[0], &encodings[0], batch_sizes[i], &result, first);
+	}
+
+	printf("]\n");
+
+	return 0;
+}
+
+// Encode the input to completion and measure it.
+static bool
+__run(const struct BenchInput * const input, const int seconds,
+		const struct Encoding * const encoding, const int batch_size,
+		struct Result * const result)
+{
+	memset(result, 0, sizeof(struct Result));
+
+	struct FrameRing * const ring = as_frame_ring_alloc(1024, 8192);
+	if (!ring) {
+		return false;
+	}
+
+	struct Audiostreamer * const as = __open(input, seconds, encoding, ring);
+	if (!as) {
+		as_frame_ring_free(ring);
+		return false;
+	}
+
+	result->open_seconds = (double) as->input->open_ns/1e9;
+
+	struct FrameInfo frames[64];
+
+	const double start = __now();
+	double last_frame = start;
+
+	while (1) {
+		int res = 0;
+		int nb_frames = 0;
+
+		if (batch_size == 0) {
+			int frame_size = 0;
+			res = as_read_write(as, &frame_size);
+			if (frame_size > 0) {
+				nb_frames = 1;
+			}
+		} else {
+			res = as_read_write_n(as, frames, batch_size, 1000, &nb_frames);
+		}
+
+		result->calls++;
+
+		if (res == -1) {
+			fprintf(stderr, "error encoding\n");
+			as_destroy_audiostreamer(as);
+			as_frame_ring_free(ring);
+			return false;
+		}
+
+		// With batches this is the latency of the batch spread over its frames.
+		if (nb_frames > 0) {
+			const double now = __now();
+			for (int i = 0; i < nb_frames; i++) {
+				if (!__add_latency(result, (now-last_frame)/nb_frames)) {
+					as_destroy_audiostreamer(as);
+					as_frame_ring_free(ring);
+					return false;
+				}
+			}
+			last_frame = now;
+		}
+
+		if (res == 0) {
+			break;
+		}
+	}
+
+	result->seconds = __now() - start;
+	result->frames = as->frames_written;
+	result->allocations = as->allocations;
+	result->audio_seconds = (double) (as->outputs[0]->pts-1)/
+		as->outputs[0]->codec_ctx->sample_rate;
+
+	as_destroy_audiostreamer(as);
+	as_frame_ring_free(ring);
+
+	return true;
+}
+
+static struct Audiostreamer *
+__open(const struct BenchInput * const bench_input, const int seconds,
+		const struct Encoding * const encoding, struct FrameRing * const ring)
+{
+	char url[512];
+	if (strcmp(bench_input->format, "lavfi") == 0) {
+		snprintf(url, sizeof(url), "%s:duration=%d,aformat=channel_layouts=stereo",
+				bench_input->url, seconds);
+	} else {
+		snprintf(url, sizeof(url), "%s", bench_input->url);
+	}
+
+	struct Input * const input = as_open_input(bench_input->format, url, NULL,
+			false);
+	if (!input) {
+		return NULL;
+	}
+
+	struct Output * const output = as_open_output(input, encoding->format, NULL,
+			encoding->encoder, encoding->encoder_options, encoding->bit_rate, ring);
+	if (!output) {
+		as_destroy_input(input);
+		return NULL;
+	}
+
+	struct Output * outputs[] = {output};
+	struct Audiostreamer * const as = as_init_audiostreamer(input, outputs, 1);
+	if (!as) {
+		as_destroy_output(output);
+		as_destroy_input(input);
+		return NULL;
+	}
+
+	return as;
+}
+
+static bool
+__add_latency(struct Result * const result, const double latency)
+{
+	if (result->nb_latencies%4096 == 0) {
+		double * const latencies = realloc(result->latencies,
+				(result->nb_latencies+4096)*sizeof(double));
+		if (!latencies) {
+			fprintf(stderr, "%s\n", strerror(errno));
+			return false;
+		}
+		result->latencies = latencies;
+	}
+
+	result->latencies[result->nb_latencies++] = latency;
+	return true;
+}
+
+// Percentile p (0 to 100) of sorted values.
+static double
+__percentile(const double * const values, const size_t n, const double p)
+{
+	if (n == 0) {
+		return 0;
+	}
+
+	size_t i = (size_t) (p/100*(double) n);
+	if (i >= n) {
+		i = n-1;
+	}
+
+	return values[i];
+}
+
+static int
+__compare_doubles(const void * const a, const void * const b)
+{
+	const double x = *(const double *) a;
+	const double y = *(const double *) b;
+
+	if (x < y) {
+		return -1;
+	}
+	if (x > y) {
+		return 1;
+	}
+	return 0;
+}
+
+static void
+__print_result(const struct BenchInput * const input,
+		const struct Encoding * const encoding, const int batch_size,
+		struct Result * const result, const bool first)
+{
+	qsort(result->latencies, result->nb_latencies, sizeof(double),
+			__compare_doubles);
+
+	const double * const l = result->latencies;
+	const size_t n = result->nb_latencies;
+
+	printf("%s  {\"input\": \"%s\", \"encoder\": \"%s\""
+			", \"encoder_options\": \"%s\", \"bit_rate\": %d"
+			", \"api\": \"%s\", \"batch_size\": %d"
+			", \"frames\": %" PRIu64 ", \"calls\": %" PRIu64
+			", \"allocations\": %" PRIu64 ", \"open_ms\": %.3f"
+			", \"seconds\": %.6f, \"audio_seconds\": %.3f"
+			", \"realtime_factor\": %.2f, \"frames_per_second\": %.1f"
+			", \"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f"
+			", \"max\": %.1f}}\n",
+			first ? "" : ",",
+			input->name, encoding->encoder,
+			encoding->encoder_options ? encoding->encoder_options : "",
+			encoding->bit_rate,
+			batch_size == 0 ? "as_read_write" : "as_read_write_n", batch_size,
+			result->frames, result->calls, result->allocations,
+			result->open_seconds*1e3, result->seconds, result->audio_seconds,
+			result->audio_seconds/result->seconds,
+			(double) result->frames/result->seconds,
+			__percentile(l, n, 50)*1e6, __percentile(l, n, 90)*1e6,
+			__percentile(l, n, 99)*1e6, n > 0 ? l[n-1]*1e6 : 0);
+
+	free(result->latencies);
+	result->latencies = NULL;
+}
+
+// Monotonic time in seconds.
+static double
+__now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec/1e9;
+}
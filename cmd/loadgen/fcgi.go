@@ -0,0 +1,217 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"net"
+	"net/http"
+	"net/textproto"
+	"net/url"
+	"strconv"
+	"strings"
+)
+
+// A minimal FastCGI client. We talk to the daemon the way a web server in front
+// of it would, so we can measure it as it runs in production (with -fcgi).
+//
+// We make one request per connection, and only GET requests.
+
+const (
+	fcgiVersion = 1
+
+	fcgiBeginRequest = 1
+	fcgiEndRequest   = 3
+	fcgiParams       = 4
+	fcgiStdin        = 5
+	fcgiStdout       = 6
+	fcgiStderr       = 7
+
+	fcgiResponder = 1
+
+	fcgiRequestID = 1
+
+	fcgiMaxContent = 65535
+)
+
+// fcgiGet requests u from the FastCGI server at address. It returns the
+// response once we have its headers. The body reads the response's stdout.
+func fcgiGet(address string, u *url.URL,
+	header http.Header) (*http.Response, net.Conn, error) {
+	conn, err := net.Dial("tcp", address)
+	if err != nil {
+		return nil, nil, err
+	}
+
+	params := map[string]string{
+		"GATEWAY_INTERFACE": "CGI/1.1",
+		"REQUEST_METHOD":    "GET",
+		"REQUEST_URI":       u.RequestURI(),
+		"SCRIPT_NAME":       "",
+		"PATH_INFO":         u.Path,
+		"QUERY_STRING":      u.RawQuery,
+		"SERVER_PROTOCOL":   "HTTP/1.1",
+		"SERVER_NAME":       u.Hostname(),
+		"SERVER_PORT":       u.Port(),
+		"HTTP_HOST":         u.Host,
+		"REMOTE_ADDR":       conn.LocalAddr().(*net.TCPAddr).IP.String(),
+		"REMOTE_PORT":       strconv.Itoa(conn.LocalAddr().(*net.TCPAddr).Port),
+	}
+	for k, v := range header {
+		params["HTTP_"+strings.ToUpper(strings.Replace(k, "-", "_", -1))] =
+			strings.Join(v, ", ")
+	}
+
+	w := bufio.NewWriter(conn)
+
+	// Role, then flags. We don't keep the connection.
+	if err := fcgiWriteRecord(w, fcgiBeginRequest,
+		[]byte{0, fcgiResponder, 0, 0, 0, 0, 0, 0}); err != nil {
+		_ = conn.Close()
+		return nil, nil, err
+	}
+
+	var p []byte
+	for k, v := range params {
+		p = fcgiAppendLength(p, len(k))
+		p = fcgiAppendLength(p, len(v))
+		p = append(p, k...)
+		p = append(p, v...)
+	}
+
+	// Params, then empty params and stdin to end each.
+	for _, r := range []struct {
+		kind    byte
+		content []byte
+	}{{fcgiParams, p}, {fcgiParams, nil}, {fcgiStdin, nil}} {
+		if err := fcgiWriteRecord(w, r.kind, r.content); err != nil {
+			_ = conn.Close()
+			return nil, nil, err
+		}
+	}
+
+	if err := w.Flush(); err != nil {
+		_ = conn.Close()
+		return nil, nil, err
+	}
+
+	// The response is CGI: headers including Status, a blank line, then the
+	// body.
+	body := bufio.NewReader(&fcgiStdoutReader{r: bufio.NewReader(conn)})
+
+	mimeHeader, err := textproto.NewReader(body).ReadMIMEHeader()
+	if err != nil {
+		_ = conn.Close()
+		return nil, nil, fmt.Errorf("unable to read response headers: %s", err)
+	}
+
+	resp := &http.Response{
+		StatusCode: http.StatusOK,
+		Header:     http.Header(mimeHeader),
+		Body:       io.NopCloser(body),
+	}
+
+	if status := resp.Header.Get("Status"); status != "" {
+		code, err := strconv.Atoi(strings.SplitN(status, " ", 2)[0])
+		if err != nil {
+			_ = conn.Close()
+			return nil, nil, fmt.Errorf("invalid status: %s", status)
+		}
+		resp.StatusCode = code
+	}
+
+	return resp, conn, nil
+}
+
+// fcgiWriteRecord writes a record, splitting content across several if needed.
+func fcgiWriteRecord(w io.Writer, kind byte, content []byte) error {
+	for {
+		n := len(content)
+		if n > fcgiMaxContent {
+			n = fcgiMaxContent
+		}
+
+		header := []byte{fcgiVersion, kind, 0, fcgiRequestID, 0, 0, 0, 0}
+		binary.BigEndian.PutUint16(header[4:], uint16(n))
+
+		if _, err := w.Write(header); err != nil {
+			return err
+		}
+		if _, err := w.Write(content[:n]); err != nil {
+			return err
+		}
+
+		content = content[n:]
+		if len(content) == 0 {
+			return nil
+		}
+	}
+}
+
+// fcgiAppendLength appends a name-value pair length.
+func fcgiAppendLength(p []byte, n int) []byte {
+	if n < 128 {
+		return append(p, byte(n))
+	}
+	return append(p, byte(n>>24)|0x80, byte(n>>16), byte(n>>8), byte(n))
+}
+
+// fcgiStdoutReader reads the content of stdout records. It returns io.EOF once
+// the request ends.
+type fcgiStdoutReader struct {
+	r *bufio.Reader
+
+	// Content left in the current stdout record, and padding after it.
+	left    int
+	padding int
+
+	done bool
+}
+
+func (s *fcgiStdoutReader) Read(p []byte) (int, error) {
+	for s.left == 0 {
+		if s.done {
+			return 0, io.EOF
+		}
+
+		if s.padding > 0 {
+			if _, err := s.r.Discard(s.padding); err != nil {
+				return 0, err
+			}
+			s.padding = 0
+		}
+
+		var header [8]byte
+		if _, err := io.ReadFull(s.r, header[:]); err != nil {
+			return 0, err
+		}
+
+		length := int(binary.BigEndian.Uint16(header[4:]))
+		s.padding = int(header[6])
+
+		switch header[1] {
+		case fcgiStdout:
+			s.left = length
+		case fcgiEndRequest:
+			s.done = true
+			if _, err := s.r.Discard(length); err != nil {
+				return 0, err
+			}
+		case fcgiStderr:
+			if _, err := s.r.Discard(length); err != nil {
+				return 0, err
+			}
+		default:
+			return 0, fmt.Errorf("unexpected record type %d", header[1])
+		}
+	}
+
+	if len(p) > s.left {
+		p = p[:s.left]
+	}
+
+	n, err := s.r.Read(p)
+	s.left -= n
+	return n, err
+}
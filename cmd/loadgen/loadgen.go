@@ -0,0 +1,665 @@
+// loadgen simulates many listeners of a local audiostreamer daemon so we can
+// measure how many it can serve.
+//
+// We open -clients connections to /audio, starting them evenly over -ramp, and
+// keep them open for -hold after that. Each reads at -rate, except a fraction
+// (-slow) that deliberately read at -slow-rate, slower than the audio arrives.
+// We talk to the daemon over HTTP, or with -fcgi as a FastCGI web server in
+// front of it would.
+//
+// For each client we check that what we receive is a sequence of MP3 frames,
+// and measure the gap between frames arriving. We classify why clients
+// disconnected. Every -interval we sample the daemon's CPU use and RSS from
+// /proc along with how many clients are connected.
+//
+// Output is JSON. capacity is the most clients we had connected before any
+// client reading at full rate had a problem: lost MP3 sync, stalled, got an
+// error, or got cut off as too slow. Compare it from release to release with
+// the same flags.
+package main
+
+import (
+	"encoding/json"
+	"flag"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"log"
+	"net"
+	"net/http"
+	"net/url"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Args holds command line arguments.
+type Args struct {
+	URL      *url.URL
+	FCGI     string
+	Clients  int
+	Ramp     time.Duration
+	Hold     time.Duration
+	Rate     int
+	Slow     float64
+	SlowRate int
+	PID      int
+	Interval time.Duration
+	Timeout  time.Duration
+}
+
+// Why a client's connection ended.
+const (
+	// Still connected when we stopped.
+	endCompleted = "completed"
+
+	// The daemon ended the stream. It only does this when the client fell too
+	// far behind (errClientTooSlow).
+	endTooSlow = "too_slow"
+
+	// No bytes arrived for -timeout.
+	endStalled = "stalled"
+
+	// We could not connect, got a bad status, or the connection failed.
+	endError = "error"
+)
+
+// clientResult is what one client saw.
+type clientResult struct {
+	slow bool
+	end  string
+	err  error
+
+	bytes      uint64
+	frames     uint64
+	syncErrors uint64
+
+	// Time between consecutive frames arriving, in microseconds.
+	gaps []uint32
+}
+
+// Sample is the state of the test at one point in time.
+type Sample struct {
+	Seconds    float64 `json:"seconds"`
+	Clients    int64   `json:"clients"`
+	CPUPercent float64 `json:"daemon_cpu_percent"`
+	RSSMB      float64 `json:"daemon_rss_mb"`
+	Problems   int64   `json:"problems"`
+}
+
+// Percentiles summarizes a set of durations in milliseconds.
+type Percentiles struct {
+	P50 float64 `json:"p50"`
+	P90 float64 `json:"p90"`
+	P99 float64 `json:"p99"`
+	Max float64 `json:"max"`
+}
+
+// Report is our output.
+type Report struct {
+	URL      string `json:"url"`
+	FCGI     bool   `json:"fcgi"`
+	Clients  int    `json:"clients"`
+	Slow     int    `json:"slow_clients"`
+	Capacity int64  `json:"capacity"`
+
+	Disconnects     map[string]int `json:"disconnects"`
+	SlowDisconnects map[string]int `json:"slow_disconnects"`
+
+	// The change in the daemon's count of clients it cut off as too slow, if we
+	// could read its /metrics.
+	DaemonTooSlow *uint64 `json:"daemon_too_slow,omitempty"`
+
+	Bytes      uint64 `json:"bytes"`
+	Frames     uint64 `json:"frames"`
+	SyncErrors uint64 `json:"sync_errors"`
+
+	// Gaps across every full rate client's frames.
+	Gaps Percentiles `json:"gap_ms"`
+
+	// The distribution of each full rate client's own p99 gap.
+	ClientP99Gaps Percentiles `json:"client_p99_gap_ms"`
+
+	Errors  []string `json:"errors,omitempty"`
+	Samples []Sample `json:"samples"`
+}
+
+// Clock ticks per second for /proc/<pid>/stat. This is 100 on every Linux
+// system I know of, and we can't ask sysconf() without cgo.
+const clockTicks = 100
+
+func main() {
+	log.SetFlags(log.Ldate | log.Ltime)
+
+	args, err := getArgs()
+	if err != nil {
+		log.Fatal(err)
+	}
+
+	tooSlowBefore, tooSlowErr := daemonTooSlow(args)
+
+	// Connected clients, and problems seen by full rate clients so far.
+	var connected, problems int64
+
+	results := make([]clientResult, args.Clients)
+	slowClients := int(args.Slow * float64(args.Clients))
+	stop := make(chan struct{})
+	var wg sync.WaitGroup
+
+	start := time.Now()
+	samples := []Sample{}
+	samplesDone := make(chan struct{})
+	go func() {
+		samples = sampler(args, start, &connected, &problems, stop)
+		close(samplesDone)
+	}()
+
+	for i := 0; i < args.Clients; i++ {
+		// Spread slow clients evenly through the ramp.
+		slow := i*slowClients/args.Clients != (i+1)*slowClients/args.Clients
+		rate := args.Rate
+		if slow {
+			rate = args.SlowRate
+		}
+
+		wg.Add(1)
+		go func(i int) {
+			defer wg.Done()
+			results[i] = runClient(args, rate, slow, &connected, &problems, stop)
+		}(i)
+
+		if args.Clients > 1 {
+			time.Sleep(args.Ramp / time.Duration(args.Clients-1))
+		}
+	}
+
+	time.Sleep(args.Hold)
+	close(stop)
+	wg.Wait()
+	<-samplesDone
+
+	report := Report{
+		URL:             args.URL.String(),
+		FCGI:            args.FCGI != "",
+		Clients:         args.Clients,
+		Slow:            slowClients,
+		Capacity:        capacity(samples),
+		Disconnects:     map[string]int{},
+		SlowDisconnects: map[string]int{},
+		Samples:         samples,
+	}
+
+	var gaps, clientP99Gaps []uint32
+	errors := map[string]int{}
+
+	for _, r := range results {
+		if r.slow {
+			report.SlowDisconnects[r.end]++
+		} else {
+			report.Disconnects[r.end]++
+			gaps = append(gaps, r.gaps...)
+			if len(r.gaps) > 0 {
+				clientP99Gaps = append(clientP99Gaps, percentiles(r.gaps).p99)
+			}
+		}
+
+		report.Bytes += r.bytes
+		report.Frames += r.frames
+		report.SyncErrors += r.syncErrors
+
+		if r.err != nil {
+			errors[r.err.Error()]++
+		}
+	}
+
+	report.Gaps = percentiles(gaps).ms()
+	report.ClientP99Gaps = percentiles(clientP99Gaps).ms()
+
+	for err, n := range errors {
+		report.Errors = append(report.Errors, fmt.Sprintf("%d: %s", n, err))
+	}
+	sort.Strings(report.Errors)
+
+	if tooSlowErr == nil {
+		if after, err := daemonTooSlow(args); err == nil {
+			d := after - tooSlowBefore
+			report.DaemonTooSlow = &d
+		}
+	} else {
+		log.Printf("Unable to read daemon metrics: %s", tooSlowErr)
+	}
+
+	out, err := json.MarshalIndent(report, "", "  ")
+	if err != nil {
+		log.Fatalf("Unable to encode report: %s", err)
+	}
+	fmt.Printf("%s\n", out)
+}
+
+// getArgs retrieves and validates command line arguments.
+func getArgs() (Args, error) {
+	rawURL := flag.String("url", "http://127.0.0.1:8080/audio", "URL of the stream to request. With -fcgi we take the path from this.")
+	fcgi := flag.String("fcgi", "", "Host:port of the daemon serving FastCGI (its -fcgi mode). We make requests as a FastCGI web server in front of it would. Empty to use HTTP.")
+	clients := flag.Int("clients", 100, "Number of clients to connect.")
+	ramp := flag.Duration("ramp", time.Minute, "Connect clients evenly over this long.")
+	hold := flag.Duration("hold", 30*time.Second, "Keep every client connected for this long after the last connects.")
+	rate := flag.Int("rate", 0, "Bytes per second each client reads. 0 to read as fast as audio arrives.")
+	slow := flag.Float64("slow", 0, "Fraction of clients (0 to 1) that read at -slow-rate instead.")
+	slowRate := flag.Int("slow-rate", 4000, "Bytes per second slow clients read. Make it less than the stream's bit rate (96 kbps is 12000 bytes per second).")
+	pid := flag.Int("pid", 0, "PID of the daemon, to sample its CPU use and RSS. 0 to look for a process named audiostreamer.")
+	interval := flag.Duration("interval", time.Second, "How often to sample.")
+	timeout := flag.Duration("timeout", 10*time.Second, "Count a client as stalled and disconnect it if it gets no bytes for this long.")
+
+	flag.Parse()
+
+	u, err := url.Parse(*rawURL)
+	if err != nil || u.Host == "" {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid URL: %s", *rawURL)
+	}
+
+	if *clients <= 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("you must have at least one client")
+	}
+
+	if *slow < 0 || *slow > 1 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("-slow must be from 0 to 1")
+	}
+
+	if *rate < 0 || *slowRate <= 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("invalid rate")
+	}
+
+	if *interval <= 0 || *timeout <= 0 {
+		flag.PrintDefaults()
+		return Args{}, fmt.Errorf("-interval and -timeout must be positive")
+	}
+
+	if *pid == 0 {
+		*pid = findDaemon()
+		if *pid == 0 {
+			log.Printf("Unable to find the daemon. Not sampling its CPU use or RSS.")
+		}
+	}
+
+	return Args{
+		URL:      u,
+		FCGI:     *fcgi,
+		Clients:  *clients,
+		Ramp:     *ramp,
+		Hold:     *hold,
+		Rate:     *rate,
+		Slow:     *slow,
+		SlowRate: *slowRate,
+		PID:      *pid,
+		Interval: *interval,
+		Timeout:  *timeout,
+	}, nil
+}
+
+// get requests u over HTTP or FastCGI. The caller must close the connection
+// or the response body.
+func get(args Args, u *url.URL) (*http.Response, io.Closer, error) {
+	if args.FCGI != "" {
+		return fcgiGet(args.FCGI, u, http.Header{})
+	}
+
+	// We want a connection per client, as browsers each have their own.
+	client := &http.Client{
+		Transport: &http.Transport{
+			DisableKeepAlives: true,
+			Dial: (&net.Dialer{
+				Timeout: args.Timeout,
+			}).Dial,
+		},
+	}
+
+	resp, err := client.Get(u.String())
+	if err != nil {
+		return nil, nil, err
+	}
+	return resp, resp.Body, nil
+}
+
+// runClient reads from the stream until stop closes or the connection ends.
+//
+// If rate is positive we read at most that many bytes per second.
+func runClient(args Args, rate int, slow bool, connected, problems *int64,
+	stop <-chan struct{}) clientResult {
+	r := clientResult{slow: slow}
+
+	// Count a problem unless we're a slow client. They're supposed to have
+	// them.
+	problem := func() {
+		if !slow {
+			atomic.AddInt64(problems, 1)
+		}
+	}
+
+	resp, closer, err := get(args, args.URL)
+	if err != nil {
+		r.end, r.err = endError, err
+		problem()
+		return r
+	}
+
+	if resp.StatusCode != http.StatusOK {
+		_ = closer.Close()
+		r.end, r.err = endError, fmt.Errorf("status %d", resp.StatusCode)
+		problem()
+		return r
+	}
+
+	atomic.AddInt64(connected, 1)
+	defer atomic.AddInt64(connected, -1)
+
+	// Close the connection when we stop or stall. That ends any read.
+	var stalled int32
+	activity := make(chan struct{}, 1)
+	closed := make(chan struct{})
+	defer close(closed)
+
+	go func() {
+		timer := time.NewTimer(args.Timeout)
+		defer timer.Stop()
+		for {
+			select {
+			case <-stop:
+			case <-timer.C:
+				atomic.StoreInt32(&stalled, 1)
+			case <-activity:
+				if !timer.Stop() {
+					<-timer.C
+				}
+				timer.Reset(args.Timeout)
+				continue
+			case <-closed:
+			}
+			_ = closer.Close()
+			return
+		}
+	}()
+
+	var v mp3Validator
+	buf := make([]byte, 4096)
+
+	// If we limit our rate we read in pieces of about a tenth of a second.
+	if rate > 0 && rate/10 < len(buf) {
+		buf = buf[:rate/10+1]
+	}
+
+	start := time.Now()
+	var lastFrame time.Time
+
+	for {
+		n, err := resp.Body.Read(buf)
+		if n > 0 {
+			select {
+			case activity <- struct{}{}:
+			default:
+			}
+
+			r.bytes += uint64(n)
+
+			syncErrors := v.syncErrors
+			frames := v.Write(buf[:n])
+			if v.syncErrors != syncErrors {
+				problem()
+			}
+
+			now := time.Now()
+			for i := 0; i < frames; i++ {
+				if !lastFrame.IsZero() {
+					r.gaps = append(r.gaps, uint32(now.Sub(lastFrame)/time.Microsecond))
+				}
+				lastFrame = now
+			}
+
+			if rate > 0 {
+				due := start.Add(time.Duration(r.bytes) * time.Second /
+					time.Duration(rate))
+				time.Sleep(time.Until(due))
+			}
+		}
+
+		if err == nil {
+			continue
+		}
+
+		select {
+		case <-stop:
+			r.end = endCompleted
+		default:
+			if atomic.LoadInt32(&stalled) == 1 {
+				r.end = endStalled
+			} else if err == io.EOF {
+				r.end = endTooSlow
+			} else {
+				r.end, r.err = endError, err
+			}
+			problem()
+		}
+		break
+	}
+
+	r.frames, r.syncErrors = v.frames, v.syncErrors
+	return r
+}
+
+// sampler samples every interval until stop closes.
+func sampler(args Args, start time.Time, connected, problems *int64,
+	stop <-chan struct{}) []Sample {
+	var samples []Sample
+
+	lastCPU, _ := daemonCPU(args.PID)
+	lastTime := time.Now()
+
+	ticker := time.NewTicker(args.Interval)
+	defer ticker.Stop()
+
+	for {
+		select {
+		case <-stop:
+			return samples
+		case <-ticker.C:
+		}
+
+		s := Sample{
+			Seconds:  time.Since(start).Seconds(),
+			Clients:  atomic.LoadInt64(connected),
+			Problems: atomic.LoadInt64(problems),
+		}
+
+		if cpu, err := daemonCPU(args.PID); err == nil {
+			s.CPUPercent = 100 * (cpu - lastCPU) / time.Since(lastTime).Seconds()
+			lastCPU = cpu
+		}
+		lastTime = time.Now()
+
+		if rss, err := daemonRSS(args.PID); err == nil {
+			s.RSSMB = float64(rss) / 1024 / 1024
+		}
+
+		log.Printf("%6.1fs: %d clients, daemon %.1f%% CPU, %.1f MB RSS, %d problems",
+			s.Seconds, s.Clients, s.CPUPercent, s.RSSMB, s.Problems)
+
+		samples = append(samples, s)
+	}
+}
+
+// capacity returns the most clients connected in a sample before any problem.
+func capacity(samples []Sample) int64 {
+	var max int64
+	for _, s := range samples {
+		if s.Problems > 0 {
+			break
+		}
+		if s.Clients > max {
+			max = s.Clients
+		}
+	}
+	return max
+}
+
+// findDaemon returns the PID of a process named audiostreamer, or 0.
+func findDaemon() int {
+	paths, err := filepath.Glob("/proc/[0-9]*/comm")
+	if err != nil {
+		return 0
+	}
+
+	for _, path := range paths {
+		comm, err := ioutil.ReadFile(path)
+		if err != nil || strings.TrimSpace(string(comm)) != "audiostreamer" {
+			continue
+		}
+
+		pid, err := strconv.Atoi(filepath.Base(filepath.Dir(path)))
+		if err == nil {
+			return pid
+		}
+	}
+
+	return 0
+}
+
+// daemonCPU returns the CPU time in seconds the process used so far, user and
+// system.
+func daemonCPU(pid int) (float64, error) {
+	if pid == 0 {
+		return 0, fmt.Errorf("no daemon")
+	}
+
+	stat, err := ioutil.ReadFile(fmt.Sprintf("/proc/%d/stat", pid))
+	if err != nil {
+		return 0, err
+	}
+
+	// The command name may contain spaces, so we start after it.
+	s := string(stat)
+	fields := strings.Fields(s[strings.LastIndex(s, ")")+1:])
+	if len(fields) < 13 {
+		return 0, fmt.Errorf("unexpected stat: %s", s)
+	}
+
+	// utime and stime are fields 14 and 15 of the whole line.
+	utime, err := strconv.ParseUint(fields[11], 10, 64)
+	if err != nil {
+		return 0, err
+	}
+	stime, err := strconv.ParseUint(fields[12], 10, 64)
+	if err != nil {
+		return 0, err
+	}
+
+	return float64(utime+stime) / clockTicks, nil
+}
+
+// daemonRSS returns the process's resident set size in bytes.
+func daemonRSS(pid int) (uint64, error) {
+	if pid == 0 {
+		return 0, fmt.Errorf("no daemon")
+	}
+
+	status, err := ioutil.ReadFile(fmt.Sprintf("/proc/%d/status", pid))
+	if err != nil {
+		return 0, err
+	}
+
+	for _, line := range strings.Split(string(status), "\n") {
+		if !strings.HasPrefix(line, "VmRSS:") {
+			continue
+		}
+		fields := strings.Fields(line)
+		if len(fields) < 2 {
+			break
+		}
+		kb, err := strconv.ParseUint(fields[1], 10, 64)
+		if err != nil {
+			return 0, err
+		}
+		return kb * 1024, nil
+	}
+
+	return 0, fmt.Errorf("no VmRSS in status")
+}
+
+// daemonTooSlow reads the daemon's /metrics and returns how many clients it
+// cut off as too slow, across every rendition.
+func daemonTooSlow(args Args) (uint64, error) {
+	u := *args.URL
+	u.Path, u.RawQuery = "/metrics", ""
+
+	resp, closer, err := get(args, &u)
+	if err != nil {
+		return 0, err
+	}
+	defer func() {
+		_ = closer.Close()
+	}()
+
+	if resp.StatusCode != http.StatusOK {
+		return 0, fmt.Errorf("status %d", resp.StatusCode)
+	}
+
+	body, err := ioutil.ReadAll(resp.Body)
+	if err != nil {
+		return 0, err
+	}
+
+	var total uint64
+	for _, line := range strings.Split(string(body), "\n") {
+		if !strings.HasPrefix(line, "audiostreamer_clients_too_slow_total") {
+			continue
+		}
+		fields := strings.Fields(line)
+		n, err := strconv.ParseUint(fields[len(fields)-1], 10, 64)
+		if err != nil {
+			return 0, err
+		}
+		total += n
+	}
+
+	return total, nil
+}
+
+type gapPercentiles struct {
+	p50, p90, p99, max uint32
+}
+
+// percentiles sorts gaps and returns its percentiles.
+func percentiles(gaps []uint32) gapPercentiles {
+	if len(gaps) == 0 {
+		return gapPercentiles{}
+	}
+
+	sort.Slice(gaps, func(i, j int) bool { return gaps[i] < gaps[j] })
+
+	at := func(p float64) uint32 {
+		return gaps[int(p*float64(len(gaps)-1))]
+	}
+
+	return gapPercentiles{
+		p50: at(0.5),
+		p90: at(0.9),
+		p99: at(0.99),
+		max: gaps[len(gaps)-1],
+	}
+}
+
+// ms converts from microseconds to milliseconds.
+func (p gapPercentiles) ms() Percentiles {
+	return Percentiles{
+		P50: float64(p.p50) / 1000,
+		P90: float64(p.p90) / 1000,
+		P99: float64(p.p99) / 1000,
+		Max: float64(p.max) / 1000,
+	}
+}
@@ -0,0 +1,176 @@
+package main
+
+import "bytes"
+
+// mp3Validator checks that bytes we receive are a sequence of MPEG audio
+// frames, one right after another. We parse each frame's header to find where
+// the next one must start. If it doesn't start there we count a sync error and
+// search for the next frame.
+//
+// We can be fed bytes in any size pieces. We keep what we need of a partial
+// frame header between calls.
+type mp3Validator struct {
+	// Bytes of a frame header we have so far.
+	header []byte
+
+	// Bytes left in the current frame after its header.
+	left int
+
+	// Whether what's left is an ID3 tag rather than a frame. The muxer may
+	// start the stream with one.
+	tag bool
+
+	// Whether we're searching for a frame rather than expecting one.
+	searching bool
+
+	// Number of frames we saw.
+	frames uint64
+
+	// Number of times we did not find a frame where we expected one.
+	syncErrors uint64
+
+	// Bytes we skipped while searching.
+	skipped uint64
+}
+
+// Bit rates in kbps indexed by [version is MPEG-1][layer 3, 2, 1][index].
+var mp3BitRates = [2][3][16]int{
+	// MPEG-2 and 2.5.
+	{
+		{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+		{0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160, 0},
+		{0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256, 0},
+	},
+	// MPEG-1.
+	{
+		{0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 0},
+		{0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 0},
+		{0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448, 0},
+	},
+}
+
+// Sample rates indexed by [version bits][index].
+var mp3SampleRates = [4][3]int{
+	{11025, 12000, 8000},  // MPEG-2.5
+	{0, 0, 0},             // Reserved
+	{22050, 24000, 16000}, // MPEG-2
+	{44100, 48000, 32000}, // MPEG-1
+}
+
+// mp3FrameLength returns the length in bytes of the frame with the given
+// header, including the header. If the header is not valid it returns 0.
+func mp3FrameLength(h []byte) int {
+	if h[0] != 0xff || h[1]&0xe0 != 0xe0 {
+		return 0
+	}
+
+	version := int(h[1]>>3) & 0x3
+	layer := int(h[1]>>1) & 0x3
+	bitRateIndex := int(h[2]>>4) & 0xf
+	sampleRateIndex := int(h[2]>>2) & 0x3
+	padding := int(h[2]>>1) & 0x1
+
+	if version == 1 || layer == 0 || sampleRateIndex == 3 {
+		return 0
+	}
+
+	mpeg1 := 0
+	if version == 3 {
+		mpeg1 = 1
+	}
+
+	bitRate := mp3BitRates[mpeg1][layer-1][bitRateIndex] * 1000
+	sampleRate := mp3SampleRates[version][sampleRateIndex]
+	if bitRate == 0 {
+		return 0
+	}
+
+	// Layer I.
+	if layer == 3 {
+		return (12*bitRate/sampleRate + padding) * 4
+	}
+
+	// Layer III in MPEG-2 and 2.5 has half the samples per frame.
+	if layer == 1 && mpeg1 == 0 {
+		return 72*bitRate/sampleRate + padding
+	}
+
+	return 144*bitRate/sampleRate + padding
+}
+
+// isID3Prefix tells whether h could be the start of an ID3v2 tag header.
+func isID3Prefix(h []byte) bool {
+	if len(h) > 10 {
+		return false
+	}
+	if len(h) > 3 {
+		h = h[:3]
+	}
+	return bytes.HasPrefix([]byte("ID3"), h)
+}
+
+// Write takes the next bytes of the stream. It returns how many complete frames
+// they finished.
+func (v *mp3Validator) Write(p []byte) int {
+	frames := 0
+
+	for len(p) > 0 {
+		if v.left > 0 {
+			n := v.left
+			if n > len(p) {
+				n = len(p)
+			}
+			v.left -= n
+			p = p[n:]
+			if v.left == 0 && !v.tag {
+				v.frames++
+				frames++
+			}
+			continue
+		}
+
+		v.header = append(v.header, p[0])
+		p = p[1:]
+
+		// An ID3v2 tag at the start: "ID3", version, flags, and its size in 4
+		// bytes of 7 bits each.
+		if v.frames == 0 && !v.tag && isID3Prefix(v.header) {
+			if len(v.header) == 10 {
+				h := v.header
+				v.left = int(h[6])<<21 | int(h[7])<<14 | int(h[8])<<7 | int(h[9])
+				v.tag = v.left > 0
+				v.header = v.header[:0]
+			}
+			continue
+		}
+		v.tag = false
+
+		if len(v.header) < 4 {
+			// Catch a bad sync byte right away so we search from the next one.
+			if len(v.header) == 1 && v.header[0] == 0xff ||
+				len(v.header) == 2 && v.header[1]&0xe0 == 0xe0 ||
+				len(v.header) == 3 {
+				continue
+			}
+		} else if length := mp3FrameLength(v.header); length > 4 {
+			v.header = v.header[:0]
+			v.left = length - 4
+			v.searching = false
+			continue
+		}
+
+		// Not a frame. Drop a byte and keep searching.
+		if !v.searching {
+			v.syncErrors++
+			v.searching = true
+		}
+		v.skipped++
+		v.header = append(v.header[:0], v.header[1:]...)
+		for len(v.header) > 0 && v.header[0] != 0xff {
+			v.header = v.header[1:]
+			v.skipped++
+		}
+	}
+
+	return frames
+}
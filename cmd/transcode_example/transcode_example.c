@@ -1,4 +1,5 @@
 #include "audiostreamer.h"
+#include <inttypes.h>
 #include <stdbool.h>
 
 int
@@ -18,8 +19,14 @@ main(void)
 	//const char * const input_format = "mp3";
 	//const char * const input_url = "file:/tmp/test.mp3";
 
+	// We know what PulseAudio gives us. Saying so skips probing the input,
+	// which opens it faster. Use NULL to probe (e.g. for MP3).
+	const char * const input_options = "sample_rate=48000:channels=2";
+	//const char * const input_options = NULL;
+
 	const bool verbose = true;
-	struct Input * const input = as_open_input(input_format, input_url, verbose);
+	struct Input * const input = as_open_input(input_format, input_url,
+			input_options, verbose);
 	if (!input) {
 		return 1;
 	}
@@ -29,11 +36,15 @@ main(void)
 
 	// Output as MP3.
 	struct Output * const output = as_open_output(input, "mp3", "file:out.mp3",
-			"libmp3lame");
+			"libmp3lame", NULL, 96000, NULL);
 
 	// Output as webm+vorbis
 	//struct Output * const output = as_open_output(input, "webm", "file:out.webm",
-	//		"libvorbis");
+	//		"libvorbis", NULL, 96000, NULL);
+
+	// Output as Ogg+Opus with 20 ms frames
+	//struct Output * const output = as_open_output(input, "ogg", "file:out.opus",
+	//		"libopus", "frame_duration=20", 64000, NULL);
 
 	if (!output) {
 		as_destroy_input(input);
@@ -43,7 +54,8 @@ main(void)
 
 	// Read, decode, encode, write in a loop until we either hit input EOF or
 	// reach the maximum number of frames we want to output right now.
-	struct Audiostreamer * const as = as_init_audiostreamer(input, output);
+	struct Output * outputs[] = {output};
+	struct Audiostreamer * const as = as_init_audiostreamer(input, outputs, 1);
 	if (!as) {
 		as_destroy_input(input);
 		as_destroy_output(output);
@@ -76,6 +88,12 @@ main(void)
 	}
 
 
+	// Steady state encoding should not allocate. If this is more than a few we
+	// have a problem.
+	printf("wrote %" PRIu64 " frames with %" PRIu64 " allocations\n",
+			as->frames_written, as->allocations);
+
+
 	// Clean up.
 
 	as_destroy_audiostreamer(as);
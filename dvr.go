@@ -0,0 +1,840 @@
+package main
+
+import (
+	"bufio"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"log"
+	"net/http"
+	"os"
+	"path/filepath"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"syscall"
+	"time"
+)
+
+// A Recorder keeps a rendition's frames on disk so clients can listen from a
+// time in the past, e.g. /audio?from=-300s. It takes frames from the broadcast
+// like a client does, so recording costs a copy per frame and no encoding.
+//
+// We write frames to segment files. Each segment holds a few minutes of audio.
+// We size it up front for the rendition's bit rate, preallocate it, and map it
+// into memory. Recording a frame copies it into the mapping. Clients read from
+// the same mapping, so serving a recording is a write from memory the kernel
+// already has.
+//
+// Beside each segment is an index of its frames: each frame's offset and size,
+// its PTS, and when we captured its audio (wall clock). We append it to a file
+// so we can pick up what we recorded when we restart. In memory we keep only a
+// mark about every second. To find where to start we look up the marks around
+// a time and read the frames between them from the file, so a day of MP3 costs
+// a megabyte or two of memory rather than the whole index.
+//
+// We delete segments once their newest frame is older than the retention time.
+type Recorder struct {
+	dir string
+
+	// How long a segment may hold, and how many bytes we preallocate for it.
+	// If a segment fills up before then we start another early.
+	segmentDuration time.Duration
+	segmentSize     int
+
+	retention time.Duration
+
+	// Returns the stream header. Each segment starts with it so a client can
+	// start from any segment.
+	header func() []byte
+
+	// Returns how many times the stream header has changed. When the encoder
+	// restarts it gets a new header, and frames after that don't go with the
+	// one our segment starts with.
+	headerGeneration func() uint64
+
+	mutex sync.RWMutex
+
+	// Segments oldest first. We're writing to the last unless current is nil.
+	segments []*dvrSegment
+
+	// We close this when we record frames and replace it with a new one.
+	changed chan struct{}
+
+	// The segment we're writing to, the header generation it starts with, and
+	// its index file. Only the recorder's goroutine touches these.
+	current           *dvrSegment
+	currentGeneration uint64
+	index             *os.File
+	indexBuf          *bufio.Writer
+	lastSync          time.Time
+	retryAfter        time.Time
+}
+
+// A dvrSegment is a segment file mapped into memory.
+type dvrSegment struct {
+	// Path without an extension. The name is when it started, in nanoseconds
+	// since the epoch, so names sort in time order.
+	path string
+
+	data []byte
+
+	// How much of data holds frames (after the header). The recorder writes
+	// beyond it and then moves it on with the mutex held.
+	size int
+
+	headerSize int
+
+	// How many frames the segment holds, and when we captured the first and
+	// last.
+	frames int
+	first  int64
+	last   int64
+
+	// A mark for the first frame and then about every dvrMarkInterval.
+	marks []dvrMark
+
+	// The frames from the last mark on. Only the segment we're writing to has
+	// these, since they may not be in the index file yet.
+	recent []dvrEntry
+
+	// Clients reading from the segment. We unmap it once it's removed and
+	// they're done.
+	refs    int
+	removed bool
+}
+
+// A dvrEntry is a frame in a segment's index.
+type dvrEntry struct {
+	// Nanoseconds since the epoch.
+	wall int64
+	pts  int64
+
+	offset uint32
+	size   uint32
+}
+
+// A dvrMark is a frame we keep in memory from a segment's index.
+type dvrMark struct {
+	wall   int64
+	offset uint32
+
+	// Which frame it is in the index.
+	frame uint32
+}
+
+// An index file starts with this, then the size of the header at the start of
+// the segment (4 bytes), then a dvrEntry per frame (dvrEntrySize bytes).
+// Numbers are little endian.
+const (
+	dvrIndexMagic      = "ASDVR1\x00\x00"
+	dvrIndexHeaderSize = len(dvrIndexMagic) + 4
+	dvrEntrySize       = 24
+)
+
+// We flush a segment's index to its file at most this often. If we crash we
+// lose no more than this much of the recording.
+const dvrIndexSyncInterval = time.Second
+
+// How much audio there is between the marks we keep in memory.
+const dvrMarkInterval = time.Second
+
+// If we can't create a segment we wait this long before trying again.
+const dvrRetryInterval = 10 * time.Second
+
+// Clients reading a recording get at most this many bytes per write.
+const dvrWriteSize = 64 * 1024
+
+// NewRecorder creates a Recorder for a rendition of the given bit rate (Kb/s)
+// keeping segments in dir. We pick up segments already there.
+func NewRecorder(dir string, bitRate int, segmentDuration,
+	retention time.Duration, header func() []byte,
+	headerGeneration func() uint64) (*Recorder, error) {
+	if err := os.MkdirAll(dir, 0755); err != nil {
+		return nil, err
+	}
+
+	// A quarter more than the bit rate says, for headers and encoders that go
+	// over, and room for a large stream header.
+	segmentSize := int(int64(bitRate)*125*int64(segmentDuration/time.Second)*5/4) +
+		256*1024
+
+	r := &Recorder{
+		dir:              dir,
+		segmentDuration:  segmentDuration,
+		segmentSize:      segmentSize,
+		retention:        retention,
+		header:           header,
+		headerGeneration: headerGeneration,
+		changed:          make(chan struct{}),
+	}
+
+	if err := r.load(); err != nil {
+		return nil, err
+	}
+
+	r.expire()
+
+	return r, nil
+}
+
+// load maps the segments in our directory.
+func (r *Recorder) load() error {
+	paths, err := filepath.Glob(filepath.Join(r.dir, "*.idx"))
+	if err != nil {
+		return err
+	}
+	sort.Strings(paths)
+
+	for _, path := range paths {
+		segment, err := loadDVRSegment(strings.TrimSuffix(path, ".idx"))
+		if err != nil {
+			log.Printf("dvr: ignoring %s: %s", path, err)
+			continue
+		}
+		if segment == nil {
+			continue
+		}
+		r.segments = append(r.segments, segment)
+	}
+
+	return nil
+}
+
+// loadDVRSegment reads a segment's index and maps the segment. If we crashed
+// while writing it, its file is still its preallocated size, and its index may
+// end partway through an entry. We trim both to the frames we know about.
+//
+// Returns nil if the segment has no frames.
+func loadDVRSegment(path string) (*dvrSegment, error) {
+	index, err := os.ReadFile(path + ".idx")
+	if err != nil {
+		return nil, err
+	}
+
+	// We crashed before we wrote any of it.
+	if len(index) < dvrIndexHeaderSize {
+		removeDVRSegment(path)
+		return nil, nil
+	}
+
+	if string(index[:len(dvrIndexMagic)]) != dvrIndexMagic {
+		return nil, fmt.Errorf("not an index")
+	}
+
+	segment := &dvrSegment{
+		path:       path,
+		headerSize: int(binary.LittleEndian.Uint32(index[len(dvrIndexMagic):])),
+	}
+	segment.size = segment.headerSize
+
+	for p := index[dvrIndexHeaderSize:]; len(p) >= dvrEntrySize; p = p[dvrEntrySize:] {
+		entry := decodeDVREntry(p)
+		if int(entry.offset) != segment.size {
+			return nil, fmt.Errorf("frame at %d, expected %d", entry.offset,
+				segment.size)
+		}
+		segment.add(entry)
+	}
+	segment.recent = nil
+
+	if segment.frames == 0 {
+		removeDVRSegment(path)
+		return nil, nil
+	}
+
+	f, err := os.OpenFile(path+".seg", os.O_RDWR, 0)
+	if err != nil {
+		return nil, err
+	}
+	defer func() {
+		_ = f.Close()
+	}()
+
+	fi, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+	if fi.Size() < int64(segment.size) {
+		return nil, fmt.Errorf("segment is shorter than its index")
+	}
+	if fi.Size() > int64(segment.size) {
+		if err := f.Truncate(int64(segment.size)); err != nil {
+			return nil, err
+		}
+	}
+
+	segment.data, err = syscall.Mmap(int(f.Fd()), 0, segment.size,
+		syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, fmt.Errorf("mmap: %s", err)
+	}
+
+	return segment, nil
+}
+
+func decodeDVREntry(p []byte) dvrEntry {
+	return dvrEntry{
+		wall:   int64(binary.LittleEndian.Uint64(p)),
+		pts:    int64(binary.LittleEndian.Uint64(p[8:])),
+		offset: binary.LittleEndian.Uint32(p[16:]),
+		size:   binary.LittleEndian.Uint32(p[20:]),
+	}
+}
+
+func removeDVRSegment(path string) {
+	for _, ext := range []string{".seg", ".idx"} {
+		if err := os.Remove(path + ext); err != nil && !os.IsNotExist(err) {
+			log.Printf("dvr: %s", err)
+		}
+	}
+}
+
+// runRecorder subscribes to a rendition like a client and records each frame
+// it reads.
+//
+// Like the segmenter we're a permanent client, so the rendition is always
+// encoded while recording. If we fall too far behind we subscribe again,
+// leaving a gap.
+func runRecorder(verbose bool, recorder *Recorder, rendition *Rendition,
+	renditionIndex int, clientChangeChan chan<- ClientChange) {
+	clientChangeChan <- ClientChange{Rendition: renditionIndex, Change: 1}
+
+	for {
+		subscriber := rendition.Broadcast.Subscribe("dvr", 0, LagPolicy{})
+
+		for {
+			frame, err := subscriber.Next(nil, nil)
+			if err != nil {
+				break
+			}
+
+			recorder.addFrame(frame)
+			frame.Release()
+
+			// Once we've caught up, write out the index if it's been a while.
+			if !subscriber.Ready() &&
+				time.Since(recorder.lastSync) >= dvrIndexSyncInterval {
+				recorder.syncIndex()
+			}
+		}
+
+		subscriber.Close()
+
+		if verbose {
+			log.Printf("recorder: fell behind on %s, subscribing again",
+				rendition.Path)
+		}
+	}
+}
+
+// addFrame records a frame.
+func (r *Recorder) addFrame(frame Frame) {
+	if frame.Header {
+		return
+	}
+
+	// We time frames by when we captured their audio, on the wall clock.
+	now := time.Now()
+	wall := now.UnixNano()
+	if frame.captured > 0 {
+		wall -= monoNow() - frame.captured
+	}
+
+	// A new header means the encoder restarted. What it encodes now needs the
+	// new header, so it goes in a new segment. We may see the change a few
+	// frames late if we're behind, but a restart takes far longer than that.
+	if r.current != nil && r.current.frames > 0 &&
+		(r.current.size+len(frame.Audio) > len(r.current.data) ||
+			time.Duration(wall-r.current.first) >= r.segmentDuration ||
+			r.headerGeneration() != r.currentGeneration) {
+		r.finishSegment()
+	}
+
+	if r.current == nil {
+		if now.Before(r.retryAfter) {
+			return
+		}
+
+		if err := r.startSegment(wall); err != nil {
+			log.Printf("dvr: unable to start segment: %s", err)
+			r.retryAfter = now.Add(dvrRetryInterval)
+			return
+		}
+	}
+
+	// A new segment has room for the largest frame.
+	segment := r.current
+
+	entry := dvrEntry{
+		wall:   wall,
+		pts:    frame.pts,
+		offset: uint32(segment.size),
+		size:   uint32(len(frame.Audio)),
+	}
+
+	// Clients only read up to size, so we can copy before we take the lock.
+	copy(segment.data[segment.size:], frame.Audio)
+
+	// find reads frames before the last mark from the file, so they need to be
+	// there before we add another.
+	if segment.needsMark(wall) {
+		r.syncIndex()
+	}
+
+	var b [dvrEntrySize]byte
+	binary.LittleEndian.PutUint64(b[:], uint64(entry.wall))
+	binary.LittleEndian.PutUint64(b[8:], uint64(entry.pts))
+	binary.LittleEndian.PutUint32(b[16:], entry.offset)
+	binary.LittleEndian.PutUint32(b[20:], entry.size)
+	_, _ = r.indexBuf.Write(b[:])
+
+	r.mutex.Lock()
+	segment.add(entry)
+	changed := r.changed
+	r.changed = make(chan struct{})
+	r.mutex.Unlock()
+
+	close(changed)
+}
+
+// needsMark tells whether a frame captured at wall gets a mark.
+func (s *dvrSegment) needsMark(wall int64) bool {
+	return len(s.marks) == 0 ||
+		time.Duration(wall-s.marks[len(s.marks)-1].wall) >= dvrMarkInterval
+}
+
+// add adds a frame to the segment. It must follow the frames we have.
+func (s *dvrSegment) add(entry dvrEntry) {
+	if s.needsMark(entry.wall) {
+		s.marks = append(s.marks, dvrMark{
+			wall:   entry.wall,
+			offset: entry.offset,
+			frame:  uint32(s.frames),
+		})
+		s.recent = s.recent[:0]
+	}
+	s.recent = append(s.recent, entry)
+
+	if s.frames == 0 {
+		s.first = entry.wall
+	}
+	s.last = entry.wall
+	s.frames++
+	s.size += int(entry.size)
+}
+
+// startSegment creates, preallocates, and maps a new segment starting with
+// the stream header.
+func (r *Recorder) startSegment(wall int64) error {
+	// If the header changes between these, we start another segment with the
+	// next frame.
+	generation := r.headerGeneration()
+	header := r.header()
+
+	path := filepath.Join(r.dir, fmt.Sprintf("%019d", wall))
+
+	f, err := os.OpenFile(path+".seg", os.O_RDWR|os.O_CREATE|os.O_TRUNC, 0644)
+	if err != nil {
+		return err
+	}
+	defer func() {
+		_ = f.Close()
+	}()
+
+	size := r.segmentSize + len(header)
+
+	// Preallocating keeps the segment in one piece on disk and means we find
+	// out now if the disk is full, not when we touch a page of the mapping. Not
+	// every filesystem can, so settle for setting the size.
+	if err := syscall.Fallocate(int(f.Fd()), 0, 0, int64(size)); err != nil {
+		if err := f.Truncate(int64(size)); err != nil {
+			removeDVRSegment(path)
+			return err
+		}
+	}
+
+	data, err := syscall.Mmap(int(f.Fd()), 0, size,
+		syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		removeDVRSegment(path)
+		return fmt.Errorf("mmap: %s", err)
+	}
+
+	index, err := os.OpenFile(path+".idx", os.O_WRONLY|os.O_CREATE|os.O_TRUNC,
+		0644)
+	if err != nil {
+		_ = syscall.Munmap(data)
+		removeDVRSegment(path)
+		return err
+	}
+
+	copy(data, header)
+
+	r.index = index
+	r.indexBuf = bufio.NewWriter(index)
+	_, _ = r.indexBuf.WriteString(dvrIndexMagic)
+	var b [4]byte
+	binary.LittleEndian.PutUint32(b[:], uint32(len(header)))
+	_, _ = r.indexBuf.Write(b[:])
+
+	segment := &dvrSegment{
+		path:       path,
+		data:       data,
+		size:       len(header),
+		headerSize: len(header),
+	}
+
+	r.mutex.Lock()
+	r.segments = append(r.segments, segment)
+	r.mutex.Unlock()
+
+	r.current = segment
+	r.currentGeneration = generation
+
+	return nil
+}
+
+// syncIndex writes out what we have of the current segment's index.
+func (r *Recorder) syncIndex() {
+	r.lastSync = time.Now()
+
+	if r.indexBuf == nil {
+		return
+	}
+
+	if err := r.indexBuf.Flush(); err != nil {
+		log.Printf("dvr: unable to write index: %s", err)
+	}
+}
+
+// finishSegment finishes writing the current segment and deletes segments we
+// no longer keep.
+//
+// We give back the space we preallocated but didn't use. The mapping stays as
+// it is. Clients never read past the frames, so they never touch the part no
+// longer in the file.
+func (r *Recorder) finishSegment() {
+	segment := r.current
+
+	r.syncIndex()
+	if err := r.index.Close(); err != nil {
+		log.Printf("dvr: unable to close index: %s", err)
+	}
+	r.index = nil
+	r.indexBuf = nil
+
+	if err := os.Truncate(segment.path+".seg", int64(segment.size)); err != nil {
+		log.Printf("dvr: unable to truncate segment: %s", err)
+	}
+
+	// Its whole index is in the file now.
+	r.mutex.Lock()
+	segment.recent = nil
+	r.mutex.Unlock()
+
+	r.current = nil
+
+	r.expire()
+}
+
+// expire deletes segments whose newest frame is older than the retention
+// time. We never delete the segment we're writing to.
+func (r *Recorder) expire() {
+	oldest := time.Now().Add(-r.retention).UnixNano()
+
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	for len(r.segments) > 0 {
+		segment := r.segments[0]
+		if segment == r.current || segment.last >= oldest {
+			break
+		}
+
+		r.segments[0] = nil
+		r.segments = r.segments[1:]
+
+		removeDVRSegment(segment.path)
+
+		// Clients reading it keep the mapping until they move on.
+		segment.removed = true
+		if segment.refs == 0 {
+			segment.unmap()
+		}
+	}
+}
+
+func (s *dvrSegment) unmap() {
+	if err := syscall.Munmap(s.data); err != nil {
+		log.Printf("dvr: munmap: %s", err)
+	}
+	s.data = nil
+}
+
+// find returns the segment holding the first frame captured at or after wall,
+// and the offset of that frame. If we don't have frames that old we start at
+// the oldest we have. If wall is after our newest frame, we start after it.
+//
+// The segment is held for the caller until it calls release. Returns nil if we
+// have no frames.
+func (r *Recorder) find(wall int64) (*dvrSegment, int) {
+	r.mutex.Lock()
+
+	i := sort.Search(len(r.segments), func(i int) bool {
+		segment := r.segments[i]
+		return segment.frames > 0 && segment.last >= wall
+	})
+	if i == len(r.segments) {
+		i--
+	}
+	if i < 0 || r.segments[i].frames == 0 {
+		r.mutex.Unlock()
+		return nil, 0
+	}
+
+	segment := r.segments[i]
+	segment.refs++
+
+	// The frame is at the first mark at or after wall, or in the frames just
+	// before it.
+	marks := segment.marks
+	j := sort.Search(len(marks), func(j int) bool {
+		return marks[j].wall >= wall
+	})
+
+	if j == 0 {
+		offset := int(marks[0].offset)
+		r.mutex.Unlock()
+		return segment, offset
+	}
+
+	// Frames from the last mark on may only be in memory.
+	if j == len(marks) && segment.recent != nil {
+		offset := segment.size
+		for _, entry := range segment.recent {
+			if entry.wall >= wall {
+				offset = int(entry.offset)
+				break
+			}
+		}
+		r.mutex.Unlock()
+		return segment, offset
+	}
+
+	from := int(marks[j-1].frame) + 1
+	to := segment.frames
+	offset := segment.size
+	if j < len(marks) {
+		to = int(marks[j].frame)
+		offset = int(marks[j].offset)
+	}
+
+	r.mutex.Unlock()
+
+	return segment, segment.findInIndex(from, to, wall, offset)
+}
+
+// findInIndex reads frames from up to (not including) to from the segment's
+// index file, and returns the offset of the first captured at or after wall.
+// If none is, or we can't read them, it returns offset.
+//
+// We read without the lock. The recorder only appends to the file.
+func (s *dvrSegment) findInIndex(from, to int, wall int64, offset int) int {
+	if from >= to {
+		return offset
+	}
+
+	f, err := os.Open(s.path + ".idx")
+	if err != nil {
+		log.Printf("dvr: %s", err)
+		return offset
+	}
+	defer func() {
+		_ = f.Close()
+	}()
+
+	buf := make([]byte, (to-from)*dvrEntrySize)
+	n, err := f.ReadAt(buf, int64(dvrIndexHeaderSize+from*dvrEntrySize))
+	if err != nil && err != io.EOF {
+		log.Printf("dvr: unable to read index: %s", err)
+	}
+
+	for p := buf[:n]; len(p) >= dvrEntrySize; p = p[dvrEntrySize:] {
+		entry := decodeDVREntry(p)
+		if entry.wall >= wall {
+			return int(entry.offset)
+		}
+	}
+
+	return offset
+}
+
+// next tells how many bytes of segment hold frames. If a client has read them
+// all (up to offset) and we're done writing the segment, it also returns the
+// segment after it, held for the caller. If we're not, it returns a channel
+// that closes when we record more.
+func (r *Recorder) next(segment *dvrSegment, offset int) (int, *dvrSegment,
+	<-chan struct{}) {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	size := segment.size
+	if offset < size {
+		return size, nil, nil
+	}
+
+	for i, s := range r.segments {
+		if s == segment && i+1 < len(r.segments) {
+			following := r.segments[i+1]
+			following.refs++
+			return size, following, nil
+		}
+	}
+
+	// If we deleted it while it was the oldest, go on with the oldest we have.
+	if segment.removed && len(r.segments) > 0 {
+		following := r.segments[0]
+		following.refs++
+		return size, following, nil
+	}
+
+	return size, nil, r.changed
+}
+
+// release lets go of a segment from find or next.
+func (r *Recorder) release(segment *dvrSegment) {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	segment.refs--
+	if segment.refs == 0 && segment.removed {
+		segment.unmap()
+	}
+}
+
+// Stats tells how many segments we have, their size in bytes, and how much
+// audio they span.
+func (r *Recorder) Stats() (int, int64, time.Duration) {
+	r.mutex.RLock()
+	defer r.mutex.RUnlock()
+
+	bytes := int64(0)
+	for _, segment := range r.segments {
+		bytes += int64(segment.size)
+	}
+
+	span := time.Duration(0)
+	if len(r.segments) > 0 {
+		first := r.segments[0]
+		last := r.segments[len(r.segments)-1]
+		if first.frames > 0 && last.frames > 0 {
+			span = time.Duration(last.last - first.first)
+		}
+	}
+
+	return len(r.segments), bytes, span
+}
+
+// parseFrom parses when a client wants to listen from. It's either relative to
+// now, e.g. -300s or -1h, a time in RFC 3339 format, or seconds since the
+// epoch.
+func parseFrom(s string) (time.Time, error) {
+	if strings.HasPrefix(s, "-") {
+		d, err := time.ParseDuration(s)
+		if err != nil {
+			return time.Time{}, err
+		}
+		return time.Now().Add(d), nil
+	}
+
+	if t, err := time.Parse(time.RFC3339, s); err == nil {
+		return t, nil
+	}
+
+	secs, err := strconv.ParseInt(s, 10, 64)
+	if err != nil {
+		return time.Time{}, fmt.Errorf("invalid time: %s", s)
+	}
+	return time.Unix(secs, 0), nil
+}
+
+// recordingRequest serves a rendition from its recording, starting from the
+// frame captured at or after from. We send what we have as fast as the client
+// takes it and then follow the recording as we add to it, so the client
+// hears everything from then on with no gaps.
+//
+// Segments each start with the stream header. The client gets the header of
+// the segment it starts in.
+func (h HTTPHandler) recordingRequest(rw http.ResponseWriter, r *http.Request,
+	mount *Mount, rendition *Rendition, from time.Time) {
+	recorder := rendition.Recorder
+
+	segment, offset := recorder.find(from.UnixNano())
+	if segment == nil {
+		rw.WriteHeader(http.StatusNotFound)
+		_, _ = rw.Write([]byte("<h1>404 Nothing recorded</h1>"))
+		return
+	}
+
+	rw.Header().Set("Content-Type", rendition.Codec.ContentType)
+	rw.Header().Set("Cache-Control", "no-cache, no-store, must-revalidate")
+
+	var out io.Writer = rw
+	if r.Header.Get("Icy-MetaData") == "1" && rendition.Codec.Format == "mp3" {
+		rw.Header().Set("icy-metaint", strconv.Itoa(icyMetaInt))
+		out = newICYWriter(rw, mount.Metadata)
+	}
+
+	flusher, _ := rw.(http.Flusher)
+
+	write := func(p []byte) bool {
+		if _, err := out.Write(p); err != nil {
+			if h.Verbose {
+				log.Printf("%s: write: %s", r.RemoteAddr, err)
+			}
+			return false
+		}
+		return true
+	}
+
+	ok := write(segment.data[:segment.headerSize])
+
+	for ok {
+		size, following, changed := recorder.next(segment, offset)
+
+		if offset < size {
+			end := size
+			if end-offset > dvrWriteSize {
+				end = offset + dvrWriteSize
+			}
+
+			ok = write(segment.data[offset:end])
+			offset = end
+			continue
+		}
+
+		if following != nil {
+			recorder.release(segment)
+			segment = following
+			offset = segment.headerSize
+			continue
+		}
+
+		// We've sent everything we have. Send it out and wait for more.
+		if flusher != nil {
+			flusher.Flush()
+		}
+
+		select {
+		case <-changed:
+		case <-r.Context().Done():
+			ok = false
+		}
+	}
+
+	recorder.release(segment)
+
+	log.Printf("%s: Recording client cleaned up", r.RemoteAddr)
+}
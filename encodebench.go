@@ -0,0 +1,143 @@
+package main
+
+import (
+	"fmt"
+	"time"
+	"unsafe"
+)
+
+// #include "audiostreamer.h"
+// #include <stdlib.h>
+import "C"
+
+// encodeBenchResult is what benchEncode measured.
+type encodeBenchResult struct {
+	// Frames the reader took from the ring.
+	frames uint64
+
+	// Calls into the library to encode.
+	calls uint64
+
+	elapsed time.Duration
+}
+
+// benchEncode encodes seconds of a generated tone to MP3 the way encoder()
+// does, calling as_read_write() from Go for each unit of work if batch is 0,
+// and as_read_write_n() for up to batch frames otherwise. A reader goroutine
+// takes frames from the ring into a framePool as reader() does.
+//
+// cmd/bench measures the same from C. This is here so we can see what crossing
+// into C and waking the reader costs per call. See BenchmarkReadWrite.
+func benchEncode(seconds, batch int) (encodeBenchResult, error) {
+	ring := C.as_frame_ring_alloc(ringFrames, ringFrameCapacity)
+	if ring == nil {
+		return encodeBenchResult{}, fmt.Errorf("unable to allocate ring")
+	}
+	defer C.as_frame_ring_free(ring)
+
+	inputFormat := C.CString("lavfi")
+	inputURL := C.CString(fmt.Sprintf(
+		"sine=frequency=440:sample_rate=44100:duration=%d,aformat=channel_layouts=stereo",
+		seconds))
+	input := C.as_open_input(inputFormat, inputURL, nil, false)
+	C.free(unsafe.Pointer(inputFormat))
+	C.free(unsafe.Pointer(inputURL))
+	if input == nil {
+		return encodeBenchResult{}, fmt.Errorf("unable to open input")
+	}
+
+	outputFormat := C.CString("mp3")
+	outputEncoder := C.CString("libmp3lame")
+	output := C.as_open_output(input, outputFormat, nil, outputEncoder, nil,
+		128000, ring)
+	C.free(unsafe.Pointer(outputFormat))
+	C.free(unsafe.Pointer(outputEncoder))
+	if output == nil {
+		C.as_destroy_input(input)
+		return encodeBenchResult{}, fmt.Errorf("unable to open output")
+	}
+
+	outputs := []*C.struct_Output{output}
+	audiostreamer := C.as_init_audiostreamer(input, &outputs[0], 1)
+	if audiostreamer == nil {
+		C.as_destroy_output(output)
+		C.as_destroy_input(input)
+		return encodeBenchResult{}, fmt.Errorf("unable to initialize audiostreamer")
+	}
+	defer C.as_destroy_audiostreamer(audiostreamer)
+
+	// The reader stops once it has every frame we wrote.
+	writtenChan := make(chan uint64, 1)
+	readChan := make(chan uint64)
+	go benchReader(ring, writtenChan, readChan)
+
+	var result encodeBenchResult
+	frames := make([]C.struct_FrameInfo, encodeBatchFrames)
+	if batch > len(frames) {
+		frames = make([]C.struct_FrameInfo, batch)
+	}
+
+	start := time.Now()
+
+	for {
+		res := C.int(0)
+		if batch == 0 {
+			frameSize := C.int(0)
+			res = C.as_read_write(audiostreamer, &frameSize)
+		} else {
+			nbFrames := C.int(0)
+			res = C.as_read_write_n(audiostreamer, &frames[0], C.int(batch),
+				encodeBatchTimeoutMS, &nbFrames)
+		}
+		result.calls++
+
+		if res == -1 {
+			writtenChan <- 0
+			<-readChan
+			return encodeBenchResult{}, fmt.Errorf("failure decoding/encoding")
+		}
+
+		if res == 0 {
+			break
+		}
+	}
+
+	writtenChan <- uint64(audiostreamer.frames_written)
+	result.frames = <-readChan
+	result.elapsed = time.Since(start)
+
+	return result, nil
+}
+
+// benchReader reads frames from the ring until it has read as many as it
+// hears on writtenChan were written. It replies with how many it read.
+func benchReader(ring *C.struct_FrameRing, writtenChan <-chan uint64,
+	readChan chan<- uint64) {
+	pool := newFramePool(framePoolSlabSize)
+	seq := uint64(C.as_frame_ring_next_seq(ring))
+	first := seq
+	written := ^uint64(0)
+
+	for seq-first < written {
+		select {
+		case written = <-writtenChan:
+			continue
+		default:
+		}
+
+		if !C.as_frame_ring_wait(ring, C.uint64_t(seq), 100) {
+			continue
+		}
+
+		frame, err := readFrame(ring, seq, pool)
+		if err != nil {
+			// Overwritten. Count it as read so we finish.
+			seq++
+			continue
+		}
+		seq++
+		frame.Release()
+	}
+
+	readChan <- seq - first
+}
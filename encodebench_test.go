@@ -0,0 +1,42 @@
+package main
+
+import (
+	"fmt"
+	"testing"
+)
+
+// How much audio each run encodes.
+const benchEncodeSeconds = 60
+
+// BenchmarkReadWrite encodes from Go with one unit of work per call into C
+// (batch 0) and with batches of frames per call. Compare frames/s across the
+// sub-benchmarks:
+//
+//	go test -run '^$' -bench ReadWrite
+func BenchmarkReadWrite(b *testing.B) {
+	for _, batch := range []int{0, 1, 4, 16, 64} {
+		name := "as_read_write"
+		if batch > 0 {
+			name = fmt.Sprintf("as_read_write_n/%d", batch)
+		}
+
+		b.Run(name, func(b *testing.B) {
+			var frames, calls uint64
+			var seconds float64
+
+			for i := 0; i < b.N; i++ {
+				result, err := benchEncode(benchEncodeSeconds, batch)
+				if err != nil {
+					b.Fatal(err)
+				}
+
+				frames += result.frames
+				calls += result.calls
+				seconds += result.elapsed.Seconds()
+			}
+
+			b.ReportMetric(float64(frames)/seconds, "frames/s")
+			b.ReportMetric(float64(calls)/float64(frames), "calls/frame")
+		})
+	}
+}
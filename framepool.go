@@ -0,0 +1,137 @@
+package main
+
+import (
+	"sync"
+	"sync/atomic"
+)
+
+// A framePool hands out memory for frames from large slabs so that reading a
+// frame does not allocate. The reader reads each frame straight into the
+// current slab. Once every frame in a slab has been released, we reuse the
+// slab.
+//
+// Frames are reference counted by slab. The broadcast ring holds a reference
+// to each frame in it, and each subscriber holds one while it is using a frame.
+type framePool struct {
+	// Size of each slab. Must be at least the largest frame.
+	slabSize int
+
+	// The slab the reader is filling. Only the reader touches this.
+	current *frameSlab
+
+	mutex sync.Mutex
+	free  []*frameSlab
+
+	// Number of slabs we allocated, ever.
+	slabs uint64
+}
+
+type frameSlab struct {
+	pool *framePool
+	data []byte
+
+	// How much of data we've handed out.
+	used int
+
+	// Number of frames referencing the slab, plus one while it is the pool's
+	// current slab.
+	refs int32
+}
+
+// The pool allocates slabs of this many bytes.
+const framePoolSlabSize = 64 * 1024
+
+func newFramePool(slabSize int) *framePool {
+	return &framePool{slabSize: slabSize}
+}
+
+// buffer returns space for a frame of up to size bytes in the current slab. If
+// there isn't enough space left we move on to another slab.
+//
+// Call commit once you know how much you used.
+func (p *framePool) buffer(size int) []byte {
+	if p.current == nil || len(p.current.data)-p.current.used < size {
+		if p.current != nil {
+			p.current.release()
+		}
+		p.current = p.getSlab()
+	}
+
+	return p.current.data[p.current.used : p.current.used+size]
+}
+
+// commit hands out the first size bytes of the space from buffer() as a
+// frame. The frame holds a reference to the slab.
+func (p *framePool) commit(size int) Frame {
+	slab := p.current
+	start := slab.used
+	slab.used += size
+
+	atomic.AddInt32(&slab.refs, 1)
+
+	return Frame{
+		Audio: slab.data[start:slab.used:slab.used],
+		slab:  slab,
+	}
+}
+
+// getSlab takes a free slab or allocates one. The pool holds a reference to it
+// while it is the current slab.
+func (p *framePool) getSlab() *frameSlab {
+	p.mutex.Lock()
+
+	var slab *frameSlab
+	if n := len(p.free); n > 0 {
+		slab = p.free[n-1]
+		p.free[n-1] = nil
+		p.free = p.free[:n-1]
+	}
+
+	p.mutex.Unlock()
+
+	if slab == nil {
+		slab = &frameSlab{pool: p, data: make([]byte, p.slabSize)}
+		atomic.AddUint64(&p.slabs, 1)
+	}
+
+	slab.used = 0
+	slab.refs = 1
+	return slab
+}
+
+// Slabs tells how many slabs we allocated.
+func (p *framePool) Slabs() uint64 {
+	return atomic.LoadUint64(&p.slabs)
+}
+
+func (s *frameSlab) retain() {
+	atomic.AddInt32(&s.refs, 1)
+}
+
+// release drops a reference. When there are none left nothing can reach the
+// slab's frames any more, so we give it back to the pool.
+func (s *frameSlab) release() {
+	if atomic.AddInt32(&s.refs, -1) != 0 {
+		return
+	}
+
+	s.pool.mutex.Lock()
+	s.pool.free = append(s.pool.free, s)
+	s.pool.mutex.Unlock()
+}
+
+// retain takes a reference to the frame's memory. Frames not from a pool don't
+// need one.
+func (f Frame) retain() {
+	if f.slab != nil {
+		f.slab.retain()
+	}
+}
+
+// Release gives back a reference to the frame's memory. Don't use the frame
+// afterwards.
+func (f Frame) Release() {
+	if f.slab != nil {
+		f.slab.release()
+	}
+}
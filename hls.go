@@ -0,0 +1,593 @@
+package main
+
+import (
+	"bytes"
+	"fmt"
+	"log"
+	"math"
+	"net/http"
+	"strconv"
+	"strings"
+	"sync"
+)
+
+// A Segmenter packages a rendition's frames into MPEG-TS segments of about a
+// fixed duration for HLS. It keeps the most recent segments in memory and a
+// playlist describing them.
+//
+// Unlike /audio, every client gets the same bytes for a segment, so a proxy
+// in front of us can cache them. One request per segment reaches us no matter
+// how many clients there are.
+//
+// We only segment MP3. MPEG-TS can carry MPEG audio as is.
+type Segmenter struct {
+	// Segment duration we aim for, in seconds. Segments end at the first frame
+	// boundary at or after it.
+	targetDuration float64
+
+	// How many segments we keep.
+	window int
+
+	mutex sync.RWMutex
+
+	// Complete segments, oldest first.
+	segments []*Segment
+
+	// Sequence number the segment we're building will get.
+	nextSeq uint64
+
+	// The segment we're building. Only the segmenter's goroutine touches these.
+	ts          tsWriter
+	curDuration float64
+	curFrames   int
+
+	// Frames we're collecting into the next PES packet.
+	pes       bytes.Buffer
+	pesFrames int
+	pesPTS    uint64
+
+	// Samples (per channel) we've seen. This is our timeline.
+	samples uint64
+
+	// Whether the next segment follows a gap.
+	discontinuity bool
+}
+
+// A Segment is a complete MPEG-TS segment.
+type Segment struct {
+	Seq      uint64
+	Duration float64
+	Data     []byte
+
+	// Whether this segment does not follow on from the one before it.
+	Discontinuity bool
+}
+
+// We put this many frames in each PES packet. Fewer means more overhead.
+const hlsFramesPerPES = 16
+
+// MPEG-TS identifiers.
+const (
+	tsPacketSize = 188
+	tsPMTPID     = 0x1000
+	tsAudioPID   = 0x100
+	// PES stream ID of the first MPEG audio stream.
+	tsAudioStreamID = 0xc0
+	// 90 kHz clock ticks we start PTS at. PCR runs this far behind so it is
+	// always before PTS.
+	tsPTSOffset = 90000
+	tsPCRDelay  = 9000
+)
+
+// NewSegmenter creates a Segmenter that produces segments of targetDuration
+// seconds and keeps window of them.
+func NewSegmenter(targetDuration float64, window int) *Segmenter {
+	return &Segmenter{
+		targetDuration: targetDuration,
+		window:         window,
+		ts:             tsWriter{cc: map[uint16]uint8{}},
+	}
+}
+
+// runSegmenter subscribes to a rendition like a client and segments each frame
+// it reads.
+//
+// We're a permanent client, so the rendition is always encoded while HLS is
+// on. If we fall too far behind we subscribe again. The segment after that is
+// marked as a discontinuity.
+func runSegmenter(verbose bool, segmenter *Segmenter, rendition *Rendition,
+	renditionIndex int, clientChangeChan chan<- ClientChange) {
+	clientChangeChan <- ClientChange{Rendition: renditionIndex, Change: 1}
+
+	for {
+		subscriber := rendition.Broadcast.Subscribe("hls", 0, LagPolicy{})
+
+		for {
+			frame, err := subscriber.Next(nil, nil)
+			if err != nil {
+				break
+			}
+
+			segmenter.addFrame(frame)
+			frame.Release()
+		}
+
+		subscriber.Close()
+
+		if verbose {
+			log.Printf("segmenter: fell behind on %s, subscribing again",
+				rendition.Path)
+		}
+
+		segmenter.reset()
+	}
+}
+
+// addFrame adds an MP3 frame to the segment we're building. We skip anything
+// that isn't an MP3 frame, such as the stream header (ID3 tag).
+func (s *Segmenter) addFrame(frame Frame) {
+	if frame.Header {
+		return
+	}
+
+	sampleRate, samplesPerFrame, ok := parseMP3FrameHeader(frame.Audio)
+	if !ok {
+		return
+	}
+
+	// A new segment starts with the tables that describe the stream.
+	if s.curFrames == 0 {
+		s.ts.writePAT()
+		s.ts.writePMT(sampleRate)
+	}
+
+	if s.pesFrames == 0 {
+		s.pesPTS = tsPTSOffset + s.samples*90000/uint64(sampleRate)
+	}
+
+	_, _ = s.pes.Write(frame.Audio)
+	s.pesFrames++
+	s.curFrames++
+
+	s.samples += uint64(samplesPerFrame)
+	s.curDuration += float64(samplesPerFrame) / float64(sampleRate)
+
+	if s.pesFrames == hlsFramesPerPES {
+		s.flushPES()
+	}
+
+	if s.curDuration >= s.targetDuration {
+		s.finishSegment()
+	}
+}
+
+// flushPES writes the frames we collected as a PES packet.
+func (s *Segmenter) flushPES() {
+	if s.pesFrames == 0 {
+		return
+	}
+
+	s.ts.writePES(tsAudioPID, tsAudioStreamID, s.pesPTS, s.pes.Bytes())
+	s.pes.Reset()
+	s.pesFrames = 0
+}
+
+// finishSegment completes the segment we're building and adds it to the
+// window.
+func (s *Segmenter) finishSegment() {
+	s.flushPES()
+
+	segment := &Segment{
+		Duration:      s.curDuration,
+		Data:          append([]byte(nil), s.ts.buf.Bytes()...),
+		Discontinuity: s.discontinuity,
+	}
+
+	s.ts.buf.Reset()
+	s.curDuration = 0
+	s.curFrames = 0
+	s.discontinuity = false
+
+	s.mutex.Lock()
+	segment.Seq = s.nextSeq
+	s.nextSeq++
+	s.segments = append(s.segments, segment)
+	if len(s.segments) > s.window {
+		s.segments[0] = nil
+		s.segments = s.segments[1:]
+	}
+	s.mutex.Unlock()
+}
+
+// reset throws away the segment we're building. We call this when we miss
+// frames.
+func (s *Segmenter) reset() {
+	s.ts.buf.Reset()
+	s.pes.Reset()
+	s.pesFrames = 0
+	s.curDuration = 0
+	s.curFrames = 0
+	s.discontinuity = true
+}
+
+// Playlist returns the live playlist.
+func (s *Segmenter) Playlist() []byte {
+	s.mutex.RLock()
+	defer s.mutex.RUnlock()
+
+	var b bytes.Buffer
+
+	b.WriteString("#EXTM3U\n")
+	b.WriteString("#EXT-X-VERSION:3\n")
+	fmt.Fprintf(&b, "#EXT-X-TARGETDURATION:%d\n", s.maxDuration())
+
+	if len(s.segments) > 0 {
+		fmt.Fprintf(&b, "#EXT-X-MEDIA-SEQUENCE:%d\n", s.segments[0].Seq)
+	}
+
+	for _, segment := range s.segments {
+		if segment.Discontinuity {
+			b.WriteString("#EXT-X-DISCONTINUITY\n")
+		}
+		fmt.Fprintf(&b, "#EXTINF:%.3f,\n", segment.Duration)
+		fmt.Fprintf(&b, "%d.ts\n", segment.Seq)
+	}
+
+	return b.Bytes()
+}
+
+// The playlist's target duration must be at least every segment's duration
+// rounded to the nearest second. The caller must hold the lock.
+func (s *Segmenter) maxDuration() int {
+	max := int(math.Ceil(s.targetDuration))
+	for _, segment := range s.segments {
+		d := int(math.Floor(segment.Duration + 0.5))
+		if d > max {
+			max = d
+		}
+	}
+	return max
+}
+
+// Segment returns the segment with the given sequence number if it is in the
+// window.
+func (s *Segmenter) Segment(seq uint64) (*Segment, bool) {
+	s.mutex.RLock()
+	defer s.mutex.RUnlock()
+
+	if len(s.segments) == 0 || seq < s.segments[0].Seq {
+		return nil, false
+	}
+
+	i := seq - s.segments[0].Seq
+	if i >= uint64(len(s.segments)) {
+		return nil, false
+	}
+
+	return s.segments[i], true
+}
+
+// hlsRequest serves a mount's playlists and segments:
+//
+// /hls/live.m3u8 is a master playlist listing each segmented rendition.
+// /hls/<kbps>/live.m3u8 is a rendition's live playlist.
+// /hls/<kbps>/<seq>.ts is a segment.
+//
+// These are under the mount's prefix, e.g. /kitchen/hls/live.m3u8.
+//
+// Segments never change so they can be cached for as long as they might be
+// in a playlist. Playlists change every segment.
+func (h HTTPHandler) hlsRequest(rw http.ResponseWriter, r *http.Request,
+	mount *Mount) {
+	path := strings.TrimPrefix(r.URL.Path, mount.Prefix()+"/hls/")
+
+	if path == "live.m3u8" {
+		h.hlsMasterRequest(rw, mount)
+		return
+	}
+
+	pieces := strings.Split(path, "/")
+	if len(pieces) != 2 {
+		hlsNotFound(rw)
+		return
+	}
+
+	var segmenter *Segmenter
+	for _, rendition := range mount.Renditions {
+		if rendition.Segmenter != nil && strconv.Itoa(rendition.BitRate) == pieces[0] {
+			segmenter = rendition.Segmenter
+			break
+		}
+	}
+	if segmenter == nil {
+		hlsNotFound(rw)
+		return
+	}
+
+	if pieces[1] == "live.m3u8" {
+		maxAge := int(segmenter.targetDuration / 2)
+		if maxAge < 1 {
+			maxAge = 1
+		}
+
+		rw.Header().Set("Content-Type", "application/vnd.apple.mpegurl")
+		rw.Header().Set("Cache-Control", fmt.Sprintf("public, max-age=%d", maxAge))
+		_, _ = rw.Write(segmenter.Playlist())
+		return
+	}
+
+	if !strings.HasSuffix(pieces[1], ".ts") {
+		hlsNotFound(rw)
+		return
+	}
+
+	seq, err := strconv.ParseUint(strings.TrimSuffix(pieces[1], ".ts"), 10, 64)
+	if err != nil {
+		hlsNotFound(rw)
+		return
+	}
+
+	segment, ok := segmenter.Segment(seq)
+	if !ok {
+		hlsNotFound(rw)
+		return
+	}
+
+	maxAge := int(math.Ceil(segmenter.targetDuration * float64(segmenter.window+1)))
+
+	rw.Header().Set("Content-Type", "video/mp2t")
+	rw.Header().Set("Cache-Control",
+		fmt.Sprintf("public, max-age=%d, immutable", maxAge))
+	rw.Header().Set("Content-Length", strconv.Itoa(len(segment.Data)))
+	_, _ = rw.Write(segment.Data)
+}
+
+// hlsMasterRequest serves a playlist listing each of a mount's segmented
+// renditions.
+func (h HTTPHandler) hlsMasterRequest(rw http.ResponseWriter, mount *Mount) {
+	var b bytes.Buffer
+
+	b.WriteString("#EXTM3U\n")
+	for _, rendition := range mount.Renditions {
+		if rendition.Segmenter == nil {
+			continue
+		}
+
+		fmt.Fprintf(&b, "#EXT-X-STREAM-INF:BANDWIDTH=%d,CODECS=\"mp4a.40.34\"\n",
+			rendition.BitRate*1000)
+		fmt.Fprintf(&b, "%d/live.m3u8\n", rendition.BitRate)
+	}
+
+	rw.Header().Set("Content-Type", "application/vnd.apple.mpegurl")
+	rw.Header().Set("Cache-Control", "public, max-age=60")
+	_, _ = rw.Write(b.Bytes())
+}
+
+func hlsNotFound(rw http.ResponseWriter) {
+	rw.Header().Set("Cache-Control", "no-cache")
+	rw.WriteHeader(http.StatusNotFound)
+	_, _ = rw.Write([]byte("<h1>404 Not found</h1>"))
+}
+
+// parseMP3FrameHeader looks at the header of an MPEG audio layer III frame and
+// tells us its sample rate and how many samples per channel it holds.
+func parseMP3FrameHeader(b []byte) (int, int, bool) {
+	if len(b) < 4 || b[0] != 0xff || b[1]&0xe0 != 0xe0 {
+		return 0, 0, false
+	}
+
+	// 3 = MPEG 1, 2 = MPEG 2, 0 = MPEG 2.5.
+	version := (b[1] >> 3) & 0x03
+	// 1 = layer III.
+	layer := (b[1] >> 1) & 0x03
+	rateIndex := (b[2] >> 2) & 0x03
+
+	if version == 1 || layer != 1 || rateIndex == 3 {
+		return 0, 0, false
+	}
+
+	rates := [3]int{44100, 48000, 32000}
+	sampleRate := rates[rateIndex]
+
+	switch version {
+	case 3:
+		return sampleRate, 1152, true
+	case 2:
+		return sampleRate / 2, 576, true
+	default:
+		return sampleRate / 4, 576, true
+	}
+}
+
+// tsWriter writes MPEG-TS packets to a buffer.
+type tsWriter struct {
+	buf bytes.Buffer
+
+	// Continuity counter of each PID.
+	cc map[uint16]uint8
+}
+
+// writePAT writes the program association table. It says our one program's
+// PMT is at tsPMTPID.
+func (w *tsWriter) writePAT() {
+	section := []byte{
+		0x00,       // table_id
+		0xb0, 0x0d, // section_syntax_indicator, section_length (13)
+		0x00, 0x01, // transport_stream_id
+		0xc1,       // version 0, current_next_indicator
+		0x00, 0x00, // section_number, last_section_number
+		0x00, 0x01, // program_number
+		0xe0 | byte(tsPMTPID>>8), byte(tsPMTPID & 0xff),
+	}
+	w.writePSI(0, section)
+}
+
+// writePMT writes the program map table. It says our program has one MPEG
+// audio stream at tsAudioPID, which also carries the PCR.
+func (w *tsWriter) writePMT(sampleRate int) {
+	// MPEG-1 audio (0x03) has sample rates of 32 kHz and up. Lower rates are
+	// MPEG-2 audio (0x04).
+	streamType := byte(0x03)
+	if sampleRate < 32000 {
+		streamType = 0x04
+	}
+
+	section := []byte{
+		0x02,       // table_id
+		0xb0, 0x12, // section_syntax_indicator, section_length (18)
+		0x00, 0x01, // program_number
+		0xc1,       // version 0, current_next_indicator
+		0x00, 0x00, // section_number, last_section_number
+		0xe0 | byte(tsAudioPID>>8), byte(tsAudioPID & 0xff), // PCR_PID
+		0xf0, 0x00, // program_info_length
+		streamType,
+		0xe0 | byte(tsAudioPID>>8), byte(tsAudioPID & 0xff),
+		0xf0, 0x00, // ES_info_length
+	}
+	w.writePSI(tsPMTPID, section)
+}
+
+// writePSI writes a table section with its CRC in a single packet.
+func (w *tsWriter) writePSI(pid uint16, section []byte) {
+	crc := crc32MPEG(section)
+	payload := append([]byte{0x00}, section...) // pointer_field
+	payload = append(payload, byte(crc>>24), byte(crc>>16), byte(crc>>8),
+		byte(crc))
+
+	for len(payload) < tsPacketSize-4 {
+		payload = append(payload, 0xff)
+	}
+
+	w.writePacket(pid, true, false, 0, payload)
+}
+
+// writePES writes a PES packet with the given PTS (90 kHz) split across as
+// many TS packets as it takes. The first carries a PCR.
+func (w *tsWriter) writePES(pid uint16, streamID byte, pts uint64,
+	data []byte) {
+	// Timestamps are 33 bits. They wrap after about 26 hours.
+	pts &= 0x1ffffffff
+
+	header := []byte{0x00, 0x00, 0x01, streamID, 0x00, 0x00,
+		0x80, // marker bits
+		0x80, // PTS only
+		0x05, // PES_header_data_length
+		byte(0x21 | (pts>>29)&0x0e),
+		byte(pts >> 22),
+		byte(0x01 | (pts>>14)&0xfe),
+		byte(pts >> 7),
+		byte(0x01 | (pts<<1)&0xfe),
+	}
+
+	// PES_packet_length counts from after itself. 0 means unbounded, which is
+	// only allowed for video, so keep packets below the limit.
+	length := len(header) - 6 + len(data)
+	if length <= 0xffff {
+		header[4] = byte(length >> 8)
+		header[5] = byte(length)
+	}
+
+	payload := append(header, data...)
+
+	pcr := uint64(0)
+	if pts > tsPCRDelay {
+		pcr = pts - tsPCRDelay
+	}
+
+	first := true
+	for len(payload) > 0 {
+		n := w.writePacket(pid, first, first, pcr, payload)
+		payload = payload[n:]
+		first = false
+	}
+}
+
+// writePacket writes a single TS packet holding as much of payload as fits.
+// If it doesn't fill the packet we pad it with adaptation field stuffing.
+//
+// Returns how many bytes of payload we wrote.
+func (w *tsWriter) writePacket(pid uint16, start, withPCR bool, pcr uint64,
+	payload []byte) int {
+	pusi := byte(0)
+	if start {
+		pusi = 0x40
+	}
+
+	cc := w.cc[pid]
+	w.cc[pid] = (cc + 1) & 0x0f
+
+	// Adaptation field: length byte, flags byte, and PCR.
+	adaptationMin := 0
+	if withPCR {
+		adaptationMin = 8
+	}
+
+	n := len(payload)
+	if n > tsPacketSize-4-adaptationMin {
+		n = tsPacketSize - 4 - adaptationMin
+	}
+
+	adaptation := tsPacketSize - 4 - n
+
+	control := byte(0x10) // payload only
+	if adaptation > 0 {
+		control = 0x30 // adaptation field and payload
+	}
+
+	var packet [tsPacketSize]byte
+	packet[0] = 0x47
+	packet[1] = pusi | byte(pid>>8)&0x1f
+	packet[2] = byte(pid)
+	packet[3] = control | cc
+
+	i := 4
+	if adaptation > 0 {
+		packet[i] = byte(adaptation - 1)
+		i++
+
+		if adaptation > 1 {
+			flags := byte(0)
+			if withPCR {
+				flags = 0x10
+			}
+			packet[i] = flags
+			i++
+
+			if withPCR {
+				packet[i] = byte(pcr >> 25)
+				packet[i+1] = byte(pcr >> 17)
+				packet[i+2] = byte(pcr >> 9)
+				packet[i+3] = byte(pcr >> 1)
+				packet[i+4] = byte(pcr<<7) | 0x7e
+				packet[i+5] = 0x00
+				i += 6
+			}
+
+			for ; i < 4+adaptation; i++ {
+				packet[i] = 0xff
+			}
+		}
+	}
+
+	copy(packet[i:], payload[:n])
+
+	_, _ = w.buf.Write(packet[:])
+
+	return n
+}
+
+// crc32MPEG computes the CRC used by MPEG-TS tables.
+func crc32MPEG(data []byte) uint32 {
+	crc := uint32(0xffffffff)
+	for _, b := range data {
+		crc ^= uint32(b) << 24
+		for i := 0; i < 8; i++ {
+			if crc&0x80000000 != 0 {
+				crc = crc<<1 ^ 0x04c11db7
+			} else {
+				crc <<= 1
+			}
+		}
+	}
+	return crc
+}
@@ -0,0 +1,126 @@
+package main
+
+import (
+	"fmt"
+	"strings"
+	"sync/atomic"
+	"time"
+)
+
+// We trace how long each frame takes to get from capture to a client. The
+// library stamps each frame with when it read the frame's audio from the input
+// and when it added the frame to its ring. We add when the reader took it from
+// the ring and, per client, when the client took it from the broadcast, wrote
+// it, and flushed it.
+//
+// Times are CLOCK_MONOTONIC nanoseconds as the library gives them (see
+// monoNow()), or 0 if we don't know.
+//
+// Each stage gets a histogram per rendition.
+const (
+	// Read from the input until added to the library's ring. This is time in
+	// the FIFO, the encoder's lookahead, encoding, and muxing.
+	latencyEncode = iota
+
+	// Added to the library's ring until the reader published it.
+	latencyRing
+
+	// Published until a client took it. This is time waiting for a slow client
+	// and waking it up.
+	latencyQueue
+
+	// Taken until written to the client's response.
+	latencyWrite
+
+	// Written until flushed out to the client's connection.
+	latencyFlush
+
+	// Read from the input until written to the client's response.
+	latencyEndToEnd
+
+	latencyStages
+)
+
+var latencyStageNames = [latencyStages]string{
+	"encode",
+	"ring",
+	"queue",
+	"write",
+	"flush",
+	"end_to_end",
+}
+
+// Upper bounds of histogram buckets. There's another for everything larger.
+var latencyBuckets = [...]time.Duration{
+	time.Millisecond,
+	2500 * time.Microsecond,
+	5 * time.Millisecond,
+	10 * time.Millisecond,
+	25 * time.Millisecond,
+	50 * time.Millisecond,
+	100 * time.Millisecond,
+	250 * time.Millisecond,
+	500 * time.Millisecond,
+	time.Second,
+	2500 * time.Millisecond,
+	5 * time.Second,
+	10 * time.Second,
+}
+
+// A latencyHistogram counts durations in latencyBuckets. Many clients record
+// into the same one, so we update it atomically rather than with a mutex.
+type latencyHistogram struct {
+	// Bucket i counts durations at most latencyBuckets[i] and more than the
+	// bucket before. The last counts the rest.
+	counts [len(latencyBuckets) + 1]uint64
+
+	sumNS uint64
+}
+
+// latencyHistograms has a histogram for each stage.
+type latencyHistograms [latencyStages]latencyHistogram
+
+// observe records the time from start to end, both monotonic nanoseconds. If
+// we don't know start we record nothing.
+func (h *latencyHistograms) observe(stage int, start, end int64) {
+	if start == 0 || end < start {
+		return
+	}
+
+	d := time.Duration(end - start)
+
+	i := 0
+	for i < len(latencyBuckets) && d > latencyBuckets[i] {
+		i++
+	}
+
+	atomic.AddUint64(&h[stage].counts[i], 1)
+	atomic.AddUint64(&h[stage].sumNS, uint64(d))
+}
+
+// write writes the histograms in the Prometheus text format. labels go on
+// every line.
+func (h *latencyHistograms) write(b *strings.Builder, labels string) {
+	for stage := range h {
+		name := latencyStageNames[stage]
+
+		cumulative := uint64(0)
+		for i := range h[stage].counts {
+			cumulative += atomic.LoadUint64(&h[stage].counts[i])
+
+			le := "+Inf"
+			if i < len(latencyBuckets) {
+				le = fmt.Sprintf("%g", latencyBuckets[i].Seconds())
+			}
+
+			fmt.Fprintf(b,
+				"audiostreamer_latency_seconds_bucket{%s,stage=%q,le=%q} %d\n",
+				labels, name, le, cumulative)
+		}
+
+		fmt.Fprintf(b, "audiostreamer_latency_seconds_sum{%s,stage=%q} %.9f\n",
+			labels, name, float64(atomic.LoadUint64(&h[stage].sumNS))/1e9)
+		fmt.Fprintf(b, "audiostreamer_latency_seconds_count{%s,stage=%q} %d\n",
+			labels, name, cumulative)
+	}
+}
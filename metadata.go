@@ -0,0 +1,287 @@
+package main
+
+import (
+	"bytes"
+	"crypto/subtle"
+	"encoding/json"
+	"fmt"
+	"io"
+	"log"
+	"net"
+	"net/http"
+	"os"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+	"unicode/utf8"
+)
+
+// Metadata holds what's playing on a mount. Someone tells us when it changes,
+// either with a POST to /metadata or by writing a file we watch.
+//
+// We serialize it once per change, both as an ICY metadata block for MP3
+// clients that ask for it and as a Server-Sent Event for pages watching
+// /metadata. Each client then writes out bytes we already have.
+type Metadata struct {
+	mutex sync.RWMutex
+
+	current *metadataBlock
+
+	// We close this when the metadata changes and replace it with a new one.
+	changed chan struct{}
+
+	// Number of times it changed.
+	updates uint64
+}
+
+type metadataBlock struct {
+	Title string
+
+	// A length byte (in units of 16 bytes) then StreamTitle='...'; padded with
+	// NULs.
+	icy []byte
+
+	// An event with the title as JSON.
+	event []byte
+}
+
+// Clients that send Icy-MetaData: 1 get a metadata block after every this
+// many bytes of audio.
+const icyMetaInt = 16000
+
+// An ICY metadata block can be at most 255*16 bytes.
+const icyMaxLength = 255 * 16
+
+// How often we look to see whether a metadata file changed.
+const metadataFilePollInterval = time.Second
+
+// NewMetadata creates Metadata with no title.
+func NewMetadata() *Metadata {
+	return &Metadata{
+		current: newMetadataBlock(""),
+		changed: make(chan struct{}),
+	}
+}
+
+func newMetadataBlock(title string) *metadataBlock {
+	// Titles are a single line. We can't escape quotes in ICY metadata, so we
+	// don't try.
+	title = strings.TrimSpace(strings.SplitN(title, "\n", 2)[0])
+
+	text := fmt.Sprintf("StreamTitle='%s';", title)
+	if len(text) > icyMaxLength {
+		// Cut at the start of a character so we don't leave half of one.
+		n := icyMaxLength - 2
+		for n > 0 && !utf8.RuneStart(text[n]) {
+			n--
+		}
+		text = text[:n] + "';"
+	}
+
+	length := (len(text) + 15) / 16
+	icy := make([]byte, 1+length*16)
+	icy[0] = byte(length)
+	copy(icy[1:], text)
+
+	event, _ := json.Marshal(struct {
+		Title string `json:"title"`
+	}{title})
+
+	return &metadataBlock{
+		Title: title,
+		icy:   icy,
+		event: []byte(fmt.Sprintf("data: %s\n\n", event)),
+	}
+}
+
+// Set changes the title. If it's the same as what we have we do nothing.
+func (m *Metadata) Set(title string) {
+	block := newMetadataBlock(title)
+
+	m.mutex.Lock()
+
+	if block.Title == m.current.Title {
+		m.mutex.Unlock()
+		return
+	}
+
+	m.current = block
+	changed := m.changed
+	m.changed = make(chan struct{})
+
+	m.mutex.Unlock()
+
+	atomic.AddUint64(&m.updates, 1)
+	close(changed)
+}
+
+// Get returns the current metadata, and a channel that closes when it changes.
+func (m *Metadata) Get() (*metadataBlock, <-chan struct{}) {
+	m.mutex.RLock()
+	defer m.mutex.RUnlock()
+	return m.current, m.changed
+}
+
+// Updates tells how many times the metadata changed.
+func (m *Metadata) Updates() uint64 {
+	return atomic.LoadUint64(&m.updates)
+}
+
+// watchMetadataFile sets the title to the first line of the file at path
+// whenever the file changes.
+func watchMetadataFile(path string, metadata *Metadata) {
+	var lastModTime time.Time
+	var lastSize int64 = -1
+
+	for {
+		fi, err := os.Stat(path)
+		if err == nil && (!fi.ModTime().Equal(lastModTime) ||
+			fi.Size() != lastSize) {
+			data, err := os.ReadFile(path)
+			if err != nil {
+				log.Printf("metadata: %s", err)
+			} else {
+				metadata.Set(string(data))
+				lastModTime, lastSize = fi.ModTime(), fi.Size()
+			}
+		}
+
+		time.Sleep(metadataFilePollInterval)
+	}
+}
+
+// icyWriter writes audio to a client that asked for ICY metadata. After every
+// icyMetaInt bytes of audio it writes a metadata block. If the metadata has
+// not changed since the last block we sent, we send an empty block (a single
+// zero byte).
+type icyWriter struct {
+	w        io.Writer
+	metadata *Metadata
+
+	// Bytes of audio until the next metadata block.
+	left int
+
+	// The metadata we last sent.
+	sent *metadataBlock
+}
+
+func newICYWriter(w io.Writer, metadata *Metadata) *icyWriter {
+	return &icyWriter{
+		w:        w,
+		metadata: metadata,
+		left:     icyMetaInt,
+	}
+}
+
+var icyEmptyBlock = []byte{0}
+
+func (w *icyWriter) Write(p []byte) (int, error) {
+	written := 0
+
+	for len(p) > 0 {
+		n := len(p)
+		if n > w.left {
+			n = w.left
+		}
+
+		if _, err := w.w.Write(p[:n]); err != nil {
+			return written, err
+		}
+		written += n
+		p = p[n:]
+		w.left -= n
+
+		if w.left > 0 {
+			break
+		}
+
+		block, _ := w.metadata.Get()
+		icy := icyEmptyBlock
+		if block != w.sent {
+			icy = block.icy
+			w.sent = block
+		}
+
+		if _, err := w.w.Write(icy); err != nil {
+			return written, err
+		}
+		w.left = icyMetaInt
+	}
+
+	return written, nil
+}
+
+// metadataRequest serves a mount's metadata.
+//
+// A GET is a stream of Server-Sent Events, one each time the title changes,
+// so a page can show what's playing without polling.
+//
+// A POST sets the title to the title form value, or else the request body.
+// With -metadata-token it must carry the token. Otherwise we only take these
+// from the local machine. That's not enough if a proxy on this machine
+// forwards clients to us over HTTP, as every request comes from loopback.
+func (h HTTPHandler) metadataRequest(rw http.ResponseWriter, r *http.Request,
+	mount *Mount) {
+	if r.Method == "POST" {
+		if !h.metadataAllowed(r) {
+			rw.WriteHeader(http.StatusForbidden)
+			return
+		}
+
+		title := r.FormValue("title")
+		if title == "" {
+			body, err := io.ReadAll(io.LimitReader(r.Body, icyMaxLength))
+			if err != nil {
+				rw.WriteHeader(http.StatusBadRequest)
+				return
+			}
+			title = string(bytes.TrimSpace(body))
+		}
+
+		mount.Metadata.Set(title)
+		if h.Verbose {
+			log.Printf("metadata: %q is now playing %q", mount.Name, title)
+		}
+		rw.WriteHeader(http.StatusNoContent)
+		return
+	}
+
+	rw.Header().Set("Content-Type", "text/event-stream")
+	rw.Header().Set("Cache-Control", "no-cache")
+
+	flusher, _ := rw.(http.Flusher)
+
+	for {
+		block, changed := mount.Metadata.Get()
+
+		if _, err := rw.Write(block.event); err != nil {
+			return
+		}
+		if flusher != nil {
+			flusher.Flush()
+		}
+
+		select {
+		case <-changed:
+		case <-r.Context().Done():
+			return
+		}
+	}
+}
+
+// metadataAllowed says whether r may set what's playing.
+func (h HTTPHandler) metadataAllowed(r *http.Request) bool {
+	if h.MetadataToken != "" {
+		auth := r.Header.Get("Authorization")
+		if !strings.HasPrefix(auth, "Bearer ") {
+			return false
+		}
+		return subtle.ConstantTimeCompare([]byte(auth[len("Bearer "):]),
+			[]byte(h.MetadataToken)) == 1
+	}
+
+	host, _, err := net.SplitHostPort(r.RemoteAddr)
+	ip := net.ParseIP(host)
+	return err == nil && ip != nil && ip.IsLoopback()
+}
@@ -0,0 +1,220 @@
+package main
+
+import (
+	"context"
+	"fmt"
+	"log"
+	"net"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+// #include "audiostreamer.h"
+// #include <stdlib.h>
+// #include <sys/socket.h>
+import "C"
+
+// NativeServer serves renditions over HTTP from C rather than from Go. See
+// as_fanout_alloc() in the library.
+//
+// It serves the same paths as /audio, on its own port. Each of its threads has
+// its own listening socket on that port (SO_REUSEPORT) and sends frames
+// straight from the rendition's ring to its clients. A client costs it about
+// a hundred bytes plus the socket, where serving it from Go costs a goroutine,
+// a ResponseWriter and a Subscriber.
+//
+// We keep control: we decide what it serves, tell the encoder supervisor about
+// its clients, and report its counters at /metrics.
+type NativeServer struct {
+	fanout *C.struct_Fanout
+
+	// What each of the fan-out server's routes serves, by route number.
+	routes []nativeRoute
+}
+
+type nativeRoute struct {
+	mount     *Mount
+	rendition int
+
+	// Clients we last told the encoder supervisor the route has. Only
+	// watchClients() touches this.
+	clients int
+}
+
+// How often we look at how many clients the native server has. A new client
+// of a rendition nobody else is listening to waits up to this long before we
+// start encoding it.
+const nativeClientPollInterval = 250 * time.Millisecond
+
+// startNativeServer starts serving every mount's renditions natively on port
+// with the given number of threads.
+func startNativeServer(host string, port, threads int, burst time.Duration,
+	mounts []*Mount) (*NativeServer, error) {
+	fanout := C.as_fanout_alloc(C.int(burst / time.Millisecond))
+	if fanout == nil {
+		return nil, fmt.Errorf("unable to allocate fan-out server")
+	}
+
+	s := &NativeServer{fanout: fanout}
+
+	contentTypes := map[string]*C.char{}
+	defer func() {
+		for _, contentType := range contentTypes {
+			C.free(unsafe.Pointer(contentType))
+		}
+	}()
+
+	for _, mount := range mounts {
+		for i, rendition := range mount.Renditions {
+			contentType, ok := contentTypes[rendition.Codec.ContentType]
+			if !ok {
+				contentType = C.CString(rendition.Codec.ContentType)
+				contentTypes[rendition.Codec.ContentType] = contentType
+			}
+
+			// <prefix>/audio is the first rendition, as with Go.
+			paths := []string{rendition.Path}
+			if i == 0 {
+				paths = append(paths, mount.Prefix()+"/audio")
+			}
+
+			for _, path := range paths {
+				cPath := C.CString(path)
+				added := C.as_fanout_add_route(fanout, cPath, rendition.Ring,
+					contentType)
+				C.free(unsafe.Pointer(cPath))
+				if !added {
+					C.as_fanout_free(fanout)
+					return nil, fmt.Errorf("unable to add route %s", path)
+				}
+
+				s.routes = append(s.routes, nativeRoute{mount: mount, rendition: i})
+			}
+		}
+	}
+
+	fds, err := listenReusePort(fmt.Sprintf("%s:%d", host, port), threads)
+	if err != nil {
+		C.as_fanout_free(fanout)
+		return nil, err
+	}
+
+	// The fan-out server owns the sockets from here on, even if it fails to
+	// start.
+	if !C.as_fanout_start(fanout, &fds[0], C.size_t(len(fds))) {
+		C.as_fanout_free(fanout)
+		return nil, fmt.Errorf("unable to start fan-out server")
+	}
+
+	go s.watchClients()
+
+	return s, nil
+}
+
+// listenReusePort opens n listening sockets on address with SO_REUSEPORT so
+// the kernel spreads connections across them. We return descriptors that are
+// no longer Go's to manage.
+func listenReusePort(address string, n int) ([]C.int, error) {
+	lc := net.ListenConfig{
+		Control: func(network, address string, c syscall.RawConn) error {
+			var err error
+			if cerr := c.Control(func(fd uintptr) {
+				err = syscall.SetsockoptInt(int(fd), syscall.SOL_SOCKET,
+					C.SO_REUSEPORT, 1)
+			}); cerr != nil {
+				return cerr
+			}
+			return err
+		},
+	}
+
+	var fds []C.int
+	closeAll := func() {
+		for _, fd := range fds {
+			_ = syscall.Close(int(fd))
+		}
+	}
+
+	for i := 0; i < n; i++ {
+		listener, err := lc.Listen(context.Background(), "tcp", address)
+		if err != nil {
+			closeAll()
+			return nil, err
+		}
+
+		f, err := listener.(*net.TCPListener).File()
+		_ = listener.Close()
+		if err != nil {
+			closeAll()
+			return nil, err
+		}
+
+		// The File closes its descriptor when it's garbage collected, so we hand
+		// over a copy.
+		fd, err := syscall.Dup(int(f.Fd()))
+		_ = f.Close()
+		if err != nil {
+			closeAll()
+			return nil, err
+		}
+
+		fds = append(fds, C.int(fd))
+	}
+
+	return fds, nil
+}
+
+// watchClients tells each mount's encoder supervisor when the native server's
+// clients come and go, as audioRequest() does for its own.
+func (s *NativeServer) watchClients() {
+	for {
+		for i := range s.routes {
+			route := &s.routes[i]
+
+			var stats C.struct_FanoutStats
+			if !C.as_fanout_get_stats(s.fanout, C.size_t(i), &stats) {
+				continue
+			}
+
+			clients := int(stats.clients)
+			if clients != route.clients {
+				route.mount.ClientChangeChan <- ClientChange{
+					Rendition: route.rendition,
+					Change:    clients - route.clients,
+				}
+				route.clients = clients
+			}
+		}
+
+		time.Sleep(nativeClientPollInterval)
+	}
+}
+
+// Stats sums the counters of the routes serving a rendition.
+func (s *NativeServer) Stats(mount *Mount, rendition int) C.struct_FanoutStats {
+	var total C.struct_FanoutStats
+
+	// By index, since copying a route would read clients while watchClients()
+	// writes it.
+	for i := range s.routes {
+		route := &s.routes[i]
+		if route.mount != mount || route.rendition != rendition {
+			continue
+		}
+
+		var stats C.struct_FanoutStats
+		if !C.as_fanout_get_stats(s.fanout, C.size_t(i), &stats) {
+			log.Printf("Unable to get native server stats")
+			continue
+		}
+
+		total.clients += stats.clients
+		total.accepted += stats.accepted
+		total.too_slow += stats.too_slow
+		total.bytes_out += stats.bytes_out
+		total.writes += stats.writes
+	}
+
+	return total
+}